@@ -0,0 +1,90 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+// Measures the cost of multiplexing many guests with GuestScheduler.
+//
+// USAGE: cpulm_guest_bench [threads] [slice]
+//
+// Each guest runs the sum workload. For each guest count, the guests are run
+// by a GuestScheduler with the given count of threads (by default one per
+// core) then, up to 1000 guests, with one host thread per guest.
+
+#include "guest_scheduler.hpp"
+#include "workloads.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void print_result(std::size_t guests, const char* mode, std::uint64_t instructions, double time,
+    std::uint64_t switches) {
+    std::printf("%8zu %-14s %14llu %10.3f %10.2f %12llu\n", guests, mode, (unsigned long long)instructions, time,
+        instructions / time / 1e6, (unsigned long long)switches);
+}
+
+static std::vector<std::unique_ptr<VM>> make_guests(const std::shared_ptr<const Program>& program, std::size_t count) {
+    const std::vector<std::uint32_t> ram;
+    std::vector<std::unique_ptr<VM>> vms;
+    vms.reserve(count);
+    for (std::size_t i = 0; i < count; ++i)
+        vms.push_back(std::make_unique<VM>(program, ram, false));
+    return vms;
+}
+
+static std::uint64_t total_instructions(const std::vector<std::unique_ptr<VM>>& vms) {
+    std::uint64_t total = 0;
+    for (const auto& vm : vms)
+        total += vm->get_instruction_count();
+    return total;
+}
+
+static void run_scheduler(const std::shared_ptr<const Program>& program, std::size_t guests, std::size_t threads,
+    std::uint64_t slice) {
+    auto vms = make_guests(program, guests);
+    const auto start = std::chrono::steady_clock::now();
+    GuestScheduler scheduler(threads);
+    for (auto& vm : vms)
+        scheduler.spawn(run_guest(*vm, slice));
+    scheduler.run();
+    print_result(guests, "coroutines", total_instructions(vms), seconds_since(start), scheduler.get_resume_count());
+}
+
+static void run_threads(const std::shared_ptr<const Program>& program, std::size_t guests) {
+    auto vms = make_guests(program, guests);
+    const auto start = std::chrono::steady_clock::now();
+    {
+        std::vector<std::thread> threads;
+        threads.reserve(guests);
+        for (auto& vm : vms)
+            threads.emplace_back([&vm] { vm->run(); });
+        for (auto& thread : threads)
+            thread.join();
+    }
+    print_result(guests, "thread per VM", total_instructions(vms), seconds_since(start), 0);
+}
+
+int main(int argc, char* argv[]) {
+    const std::size_t threads = argc > 1 ? std::strtoul(argv[1], nullptr, 0) : std::thread::hardware_concurrency();
+    const std::uint64_t slice = argc > 2 ? std::strtoull(argv[2], nullptr, 0) : 10000;
+
+    // A short program, so that the cost of switching between guests shows.
+    const auto program = std::make_shared<const Program>(make_sum_workload(1000, 10));
+
+    std::printf("%zu scheduler thread(s), slices of %llu instructions\n", threads, (unsigned long long)slice);
+    std::printf("%8s %-14s %14s %10s %10s %12s\n", "guests", "mode", "instructions", "time (s)", "MIPS", "resumes");
+    for (std::size_t guests = 1; guests <= 10000; guests *= 10) {
+        run_scheduler(program, guests, threads, slice);
+        if (guests <= 1000)
+            run_threads(program, guests);
+    }
+
+    return 0;
+}
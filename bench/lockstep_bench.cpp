@@ -0,0 +1,95 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+// Compares LockstepVM with as many scalar VM, on one host thread.
+//
+// USAGE: cpulm_lockstep_bench
+//
+// Each workload is a parameter sweep: the same ROM with a RAM image per
+// instance. The "uniform" sweeps run the same data in every instance, the
+// others make the instances diverge. The results of the lockstep lanes are
+// checked against the scalar VM.
+
+#include "lockstep.hpp"
+#include "workloads.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct Sweep {
+    std::string name;
+    std::shared_ptr<const Program> program;
+    /// Returns the RAM image of the instance @a i.
+    std::function<std::vector<std::uint32_t>(std::size_t)> ram;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void print_result(const Sweep& sweep, std::size_t instances, const char* mode, std::uint64_t instructions,
+    double time, double lane_usage) {
+    std::printf("%-16s %9zu %-14s %14llu %10.3f %10.2f %9.0f%%\n", sweep.name.c_str(), instances, mode,
+        (unsigned long long)instructions, time, instructions / time / 1e6, lane_usage * 100);
+}
+
+template <std::size_t Lanes>
+static void run_sweep(const Sweep& sweep) {
+    std::vector<std::vector<std::uint32_t>> rams;
+    for (std::size_t i = 0; i < Lanes; ++i)
+        rams.push_back(sweep.ram(i));
+
+    std::vector<reg_t> expected;
+    std::uint64_t instructions = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < Lanes; ++i) {
+        VM vm(sweep.program, rams[i], false);
+        vm.run();
+        expected.push_back(vm.get_reg(VM::REG_OUT));
+        instructions += vm.get_instruction_count();
+    }
+    print_result(sweep, Lanes, "scalar VM", instructions, seconds_since(start), 1.0);
+
+    start = std::chrono::steady_clock::now();
+    LockstepVM<Lanes> lockstep(sweep.program, rams);
+    lockstep.run();
+    const double time = seconds_since(start);
+
+    instructions = 0;
+    for (std::size_t i = 0; i < Lanes; ++i) {
+        instructions += lockstep.get_instruction_count(i);
+        if (lockstep.get_reg(i, VM::REG_OUT) != expected[i]) {
+            std::fprintf(stderr, "\x1b[1;31mERROR:\x1b[0m lane %zu of %s computed %u instead of %u\n", i,
+                sweep.name.c_str(), lockstep.get_reg(i, VM::REG_OUT), expected[i]);
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    print_result(sweep, Lanes, "lockstep", instructions, time,
+        (double)instructions / ((double)lockstep.get_step_count() * Lanes));
+}
+
+int main() {
+    const auto sum = std::make_shared<const Program>(make_sum_workload(10000, 10));
+    const auto collatz = std::make_shared<const Program>(make_collatz_workload(20000));
+
+    const Sweep sweeps[] = {
+        { "sum (uniform)", sum, [](std::size_t) { return std::vector<std::uint32_t>(); } },
+        { "collatz (uniform)", collatz, [](std::size_t) { return std::vector<std::uint32_t> { 1 }; } },
+        { "collatz", collatz, [](std::size_t i) { return std::vector<std::uint32_t> { std::uint32_t(1 + i * 1000) }; } },
+    };
+
+    std::printf("%-16s %9s %-14s %14s %10s %10s %10s\n", "workload", "instances", "mode", "instructions",
+        "time (s)", "MIPS", "lanes used");
+    for (const Sweep& sweep : sweeps) {
+        run_sweep<8>(sweep);
+        run_sweep<16>(sweep);
+    }
+
+    return 0;
+}
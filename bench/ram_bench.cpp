@@ -0,0 +1,153 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+// Compares the RAM backends (see RamBackend) on raw loads and stores, in
+// nanoseconds per access.
+//
+// USAGE: cpulm_ram_bench [words]
+//
+// Each pattern stores to then loads from the first `words` words of the RAM
+// (4M by default): sequentially, with a stride of one page plus one word, and
+// at random addresses. The stores of the first pass allocate the pages. The
+// `range` pattern writes and reads the same words sequentially with the bulk
+// accesses (RamRef::write_range() and RamRef::read_range()), a page at a
+// time.
+
+#include "flat_ram.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// The addresses of a pattern, computed before the timing.
+static std::vector<addr_t> make_addresses(const char* pattern, addr_t words) {
+    std::vector<addr_t> addresses(words);
+    if (pattern[0] == 's' && pattern[1] == 'e') {
+        for (addr_t i = 0; i < words; ++i)
+            addresses[i] = i;
+    } else if (pattern[0] == 's') {
+        const addr_t stride = FlatRam::PAGE_WORDS + 1;
+        for (addr_t i = 0; i < words; ++i)
+            addresses[i] = addr_t((std::uint64_t(i) * stride) % words);
+    } else {
+        std::uint32_t state = 2463534242u; // xorshift32
+        for (addr_t i = 0; i < words; ++i) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            addresses[i] = state % words;
+        }
+    }
+
+    return addresses;
+}
+
+/// Runs the stores then the loads of @a addresses through @a ram, twice so
+/// that the second stores find the pages allocated.
+template<class Ram>
+static void run_pattern(const char* pattern, const char* backend, Ram& ram, const std::vector<addr_t>& addresses) {
+    double times[3];
+    word_t sum = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        auto start = std::chrono::steady_clock::now();
+        for (addr_t addr : addresses)
+            ram.set(addr, addr + 1);
+        times[pass] = seconds_since(start);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (addr_t addr : addresses)
+        sum += ram.get(addr);
+    times[2] = seconds_since(start);
+
+    // The sum keeps the loads from being optimized away.
+    const double accesses = double(addresses.size());
+    std::printf("%-10s %-12s %12.2f %12.2f %12.2f %12x\n", pattern, backend,
+        times[0] / accesses * 1e9, times[1] / accesses * 1e9, times[2] / accesses * 1e9, sum);
+}
+
+/// As run_pattern(), with the bulk accesses on spans of one page.
+template<class Ram>
+static void run_ranges(const char* backend, Ram& ram, addr_t words) {
+    constexpr addr_t span_words = FlatRam::PAGE_WORDS;
+    std::vector<word_t> span(span_words);
+    double times[3];
+    word_t sum = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        auto start = std::chrono::steady_clock::now();
+        for (addr_t base = 0; base < words; base += span_words) {
+            const addr_t length = std::min(span_words, words - base);
+            for (addr_t i = 0; i < length; ++i)
+                span[i] = base + i + 1;
+            ram.write_range(base, std::span<const word_t>(span.data(), length));
+        }
+        times[pass] = seconds_since(start);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (addr_t base = 0; base < words; base += span_words) {
+        const addr_t length = std::min(span_words, words - base);
+        ram.read_range(base, std::span<word_t>(span.data(), length));
+        for (addr_t i = 0; i < length; ++i)
+            sum += span[i];
+    }
+    times[2] = seconds_since(start);
+
+    const double accesses = double(words);
+    std::printf("%-10s %-12s %12.2f %12.2f %12.2f %12x\n", "range", backend,
+        times[0] / accesses * 1e9, times[1] / accesses * 1e9, times[2] / accesses * 1e9, sum);
+}
+
+int main(int argc, char* argv[]) {
+    addr_t words = addr_t(4) << 20;
+    if (argc > 1)
+        words = addr_t(std::strtoul(argv[1], nullptr, 0));
+    if (words == 0) {
+        std::fprintf(stderr, "\x1b[1;31mERROR:\x1b[0m invalid word count\n");
+        return EXIT_FAILURE;
+    }
+
+    std::printf("%-10s %-12s %12s %12s %12s %12s\n",
+        "pattern", "backend", "first (ns)", "store (ns)", "load (ns)", "checksum");
+    for (const char* pattern : { "sequential", "strided", "random" }) {
+        const std::vector<addr_t> addresses = make_addresses(pattern, words);
+
+        ram_t* sparse = ram_create();
+        RamRef sparse_ram { sparse, nullptr };
+        run_pattern(pattern, "sparse", sparse_ram, addresses);
+        ram_destroy(sparse);
+
+        for (const bool huge_pages : { false, true }) {
+            sparse = ram_create();
+            {
+                FlatRam flat(sparse, huge_pages);
+                run_pattern(pattern, huge_pages ? "flat (huge)" : "flat", flat, addresses);
+            }
+            ram_destroy(sparse);
+        }
+    }
+
+    ram_t* sparse = ram_create();
+    RamRef sparse_ram { sparse, nullptr };
+    run_ranges("sparse", sparse_ram, words);
+    ram_destroy(sparse);
+
+    for (const bool huge_pages : { false, true }) {
+        sparse = ram_create();
+        {
+            FlatRam flat(sparse, huge_pages);
+            run_ranges(huge_pages ? "flat (huge)" : "flat", flat, words);
+        }
+        ram_destroy(sparse);
+    }
+
+    return 0;
+}
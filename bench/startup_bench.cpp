@@ -0,0 +1,108 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+// Measures the startup time of the VM with a RAM image, in milliseconds.
+//
+// USAGE: cpulm_startup_bench [MiB...]
+//
+// For each size (1, 100 and 1024 MiB by default), a RAM image is written to a
+// temporary file then loaded: read into a vector then copied again by the
+// VM constructor (as the VM used to do), mapped then copied into SparseMemory,
+// and mapped then used in place by the flat backend. The flat backend runs
+// first, before the heap is filled by the copies. The file is in the page
+// cache in all cases, so only the copies are measured, not the disk.
+
+#include "vm.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// Writes an image of @a mebibytes MiB of nonzero words to @a filename.
+static void write_image(const char* filename, std::size_t mebibytes) {
+    std::FILE* file = std::fopen(filename, "wb");
+    if (file == nullptr) {
+        std::fprintf(stderr, "\x1b[1;31mERROR:\x1b[0m failed to write file '%s'\n", filename);
+        std::exit(EXIT_FAILURE);
+    }
+
+    std::vector<std::uint32_t> buffer(std::size_t(1) << 18);
+    for (std::size_t i = 0; i < mebibytes; ++i) {
+        for (std::size_t j = 0; j < buffer.size(); ++j)
+            buffer[j] = std::uint32_t(i * buffer.size() + j + 1);
+        std::fwrite(buffer.data(), sizeof(std::uint32_t), buffer.size(), file);
+    }
+
+    std::fclose(file);
+}
+
+/// Reads the image @a filename into a vector, as the VM used to do.
+static std::vector<std::uint32_t> read_image(const char* filename) {
+    std::vector<std::uint32_t> image;
+    std::FILE* file = std::fopen(filename, "rb");
+    if (file == nullptr) {
+        std::fprintf(stderr, "\x1b[1;31mERROR:\x1b[0m failed to read file '%s'\n", filename);
+        return image;
+    }
+
+    std::fseek(file, 0, SEEK_END);
+    image.resize(std::size_t(std::ftell(file)) / sizeof(std::uint32_t));
+    std::fseek(file, 0, SEEK_SET);
+    if (std::fread(image.data(), sizeof(std::uint32_t), image.size(), file) != image.size())
+        std::fprintf(stderr, "\x1b[1;31mERROR:\x1b[0m failed to read file '%s'\n", filename);
+    std::fclose(file);
+    return image;
+}
+
+static void print_result(std::size_t mebibytes, const char* mode, double time) {
+    std::printf("%8zu %-16s %12.2f\n", mebibytes, mode, time * 1e3);
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::size_t> sizes;
+    for (int i = 1; i < argc; ++i)
+        sizes.push_back(std::strtoul(argv[i], nullptr, 0));
+    if (sizes.empty())
+        sizes = { 1, 100, 1024 };
+
+    const std::vector<std::uint32_t> rom = { 0 };
+    const std::string filename = std::string(P_tmpdir) + "/cpulm_startup_bench.do";
+
+    std::printf("%8s %-16s %12s\n", "MiB", "mode", "time (ms)");
+    for (std::size_t mebibytes : sizes) {
+        write_image(filename.c_str(), mebibytes);
+
+        auto start = std::chrono::steady_clock::now();
+        {
+            VM vm(rom, {}, false);
+            vm.set_ram_backend(RamBackend::FLAT);
+            if (const char* failure = vm.load_ram_file(filename.c_str()))
+                std::fprintf(stderr, "\x1b[1;31mERROR:\x1b[0m %s\n", failure);
+            print_result(mebibytes, "mapped (flat)", seconds_since(start));
+        }
+
+        start = std::chrono::steady_clock::now();
+        {
+            VM vm(rom, {}, false);
+            if (const char* failure = vm.load_ram_file(filename.c_str()))
+                std::fprintf(stderr, "\x1b[1;31mERROR:\x1b[0m %s\n", failure);
+            print_result(mebibytes, "mapped (sparse)", seconds_since(start));
+        }
+
+        start = std::chrono::steady_clock::now();
+        {
+            VM vm(rom, read_image(filename.c_str()), false);
+            print_result(mebibytes, "read + copy", seconds_since(start));
+        }
+    }
+
+    std::remove(filename.c_str());
+    return 0;
+}
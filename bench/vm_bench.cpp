@@ -0,0 +1,111 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+// Measures the throughput of the VM, in instructions per second.
+//
+// USAGE: cpulm_bench [input.po...]
+//
+// Without arguments, the synthetic fib and sum workloads are used.
+
+#include "history.hpp"
+#include "mapped_file.hpp"
+#include "vm.hpp"
+#include "workloads.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct Workload {
+    std::string name;
+    std::vector<std::uint32_t> rom;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void print_result(const Workload& workload, const char* mode, std::uint64_t instructions, double time) {
+    std::printf("%-12s %-12s %12llu %10.3f %10.2f\n",
+        workload.name.c_str(), mode, (unsigned long long)instructions,
+        time, instructions / time / 1e6);
+}
+
+static void run_workload(Workload& workload) {
+    const std::vector<std::uint32_t> ram;
+
+    // Count the retired instructions with single steps, that is also the
+    // throughput of the REPL `step` command.
+    std::uint64_t instructions = 0;
+    auto start = std::chrono::steady_clock::now();
+    {
+        VM vm(workload.rom, ram, false);
+        while (!vm.at_end()) {
+            vm.step();
+            ++instructions;
+        }
+    }
+    print_result(workload, "step", instructions, seconds_since(start));
+
+    const std::pair<const char*, ExecutionEngine> engines[] = {
+        { "interpreter", ExecutionEngine::INTERPRETER },
+        { "block", ExecutionEngine::BASIC_BLOCKS },
+        { "jit", ExecutionEngine::JIT },
+    };
+
+    for (const auto& [name, engine] : engines) {
+        start = std::chrono::steady_clock::now();
+        {
+            VM vm(workload.rom, ram, false);
+            vm.set_engine(engine);
+            vm.run();
+        }
+        print_result(workload, name, instructions, seconds_since(start));
+    }
+
+    // The interpreter on the flat RAM backend.
+    start = std::chrono::steady_clock::now();
+    {
+        VM vm(workload.rom, ram, false);
+        vm.set_ram_backend(RamBackend::FLAT);
+        vm.run();
+    }
+    print_result(workload, "flat", instructions, seconds_since(start));
+
+    // The cost of recording the history for the reverse execution.
+    start = std::chrono::steady_clock::now();
+    {
+        VM vm(workload.rom, ram, false);
+        vm.enable_history(ExecutionHistory::DEFAULT_MEMORY_LIMIT);
+        vm.run();
+    }
+    print_result(workload, "history", instructions, seconds_since(start));
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<Workload> workloads;
+    if (argc > 1) {
+        for (int i = 1; i < argc; ++i) {
+            MappedFile rom;
+            if (const char* failure = rom.open(argv[i], false)) {
+                std::fprintf(stderr, "\x1b[1;31mERROR:\x1b[0m failed to read file '%s'; %s\n", argv[i], failure);
+                return EXIT_FAILURE;
+            }
+            workloads.push_back({ argv[i], std::vector<std::uint32_t>(rom.data(), rom.data() + rom.size()) });
+        }
+    } else {
+        workloads.push_back({ "fib(27)", make_fib_workload(27) });
+        workloads.push_back({ "sum(10000)", make_sum_workload(10000, 100) });
+    }
+
+    std::printf("%-12s %-12s %12s %10s %10s\n",
+        "workload", "engine", "instructions", "time (s)", "MIPS");
+    for (auto& workload : workloads)
+        run_workload(workload);
+
+    return 0;
+}
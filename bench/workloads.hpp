@@ -0,0 +1,257 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#ifndef CPULM_BENCH_WORKLOADS_HPP
+#define CPULM_BENCH_WORKLOADS_HPP
+
+#include "machine_code.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Synthetic CPUlm programs used by the benchmarks.
+ *
+ * There is no assembler in this repository, so the workloads are encoded
+ * directly. They mirror the programs of the test/ directory but run long
+ * enough to be measured.
+ */
+
+/// A very small helper to encode CPUlm programs with forward labels.
+class ProgramBuilder {
+public:
+    using Label = std::size_t;
+
+    static constexpr std::uint8_t R0 = 0;
+    static constexpr std::uint8_t R1 = 1;
+    static constexpr std::uint8_t ROUT = 28;
+    static constexpr std::uint8_t SP = 29;
+    static constexpr std::uint8_t RA = 30;
+    static constexpr std::uint8_t RHALT = 31;
+
+    Label new_label() {
+        m_labels.push_back(-1);
+        return m_labels.size() - 1;
+    }
+
+    void bind(Label label) { m_labels[label] = m_code.size(); }
+
+    void alu(alucode_t alucode, std::uint8_t rd, std::uint8_t rs1, std::uint8_t rs2) {
+        emit(OP_alu | (rd << 4) | (rs1 << 9) | (rs2 << 14) | (alucode << 19));
+    }
+
+    void shift(opcode_t opcode, std::uint8_t rd, std::uint8_t rs1, std::uint8_t rs2) {
+        emit(opcode | (rd << 4) | (rs1 << 9) | (rs2 << 14));
+    }
+
+    void load(std::uint8_t rd, std::uint8_t rs) { emit(OP_load | (rd << 4) | (rs << 9)); }
+    void store(std::uint8_t rd, std::uint8_t rs) { emit(OP_store | (rd << 4) | (rs << 9)); }
+
+    /// Emits `loadi.l` if @a low is true, `loadi.h` otherwise.
+    void loadi(std::uint8_t rd, std::uint8_t rs, std::uint16_t imm, bool low = true) {
+        emit(OP_loadi | (rd << 4) | (rs << 9) | (std::uint32_t(imm) << 14) | (std::uint32_t(low) << 30));
+    }
+
+    /// Loads the address of @a label into @a rd (assumes a 16-bits address).
+    void loadi(std::uint8_t rd, Label label) {
+        m_fixups.push_back({ m_code.size(), label, false });
+        loadi(rd, R0, 0);
+    }
+
+    void mov(std::uint8_t rd, std::uint8_t rs) { alu(BF_add, rd, rs, R0); }
+    void inc(std::uint8_t rd) { alu(BF_add, rd, rd, R1); }
+    void dec(std::uint8_t rd) { alu(BF_sub, rd, rd, R1); }
+    void test(std::uint8_t rs) { alu(BF_or, R0, rs, R0); }
+
+    void jmp(std::uint8_t rs) { emit(OP_jmp | (rs << 4)); }
+    void jmpc(std::uint8_t rs, std::uint8_t select) { emit(OP_jmpc | (rs << 4) | (select << 9)); }
+
+    void jmpi(Label label) {
+        m_fixups.push_back({ m_code.size(), label, true });
+        emit(OP_jmpi);
+    }
+
+    void jmpic(Label label, std::uint8_t select) {
+        m_fixups.push_back({ m_code.size(), label, true });
+        emit(OP_jmpic | (std::uint32_t(select) << 28));
+    }
+
+    void call(Label label) {
+        const Label ret = new_label();
+        loadi(RA, ret);
+        jmpi(label);
+        bind(ret);
+    }
+
+    void ret() { jmp(RA); }
+
+    /// Emits a `break` instruction, which stops the execution.
+    void brk() { emit(OP_break); }
+
+    void halt() {
+        loadi(RHALT, R0, 0xffff, true);
+        loadi(RHALT, RHALT, 0xffff, false);
+        jmp(RHALT);
+    }
+
+    std::vector<std::uint32_t> finish() {
+        for (const auto& fixup : m_fixups) {
+            const auto target = m_labels[fixup.label];
+            if (fixup.relative)
+                m_code[fixup.at] |= ((target - fixup.at) & 0xffffff) << 4;
+            else
+                m_code[fixup.at] |= (target & 0xffff) << 14;
+        }
+
+        return m_code;
+    }
+
+private:
+    void emit(std::uint32_t inst) { m_code.push_back(inst); }
+
+    struct Fixup {
+        std::size_t at;
+        Label label;
+        bool relative;
+    };
+
+    std::vector<std::uint32_t> m_code;
+    std::vector<std::size_t> m_labels;
+    std::vector<Fixup> m_fixups;
+};
+
+static constexpr std::uint8_t SELECT_Z = 1 << FLAG_ZERO;
+static constexpr std::uint8_t SELECT_N = 1 << FLAG_NEGATIVE;
+
+/// Recursive fib(n) as in test/fib.ulm, with a stack to save the locals.
+inline std::vector<std::uint32_t> make_fib_workload(std::uint16_t n) {
+    using B = ProgramBuilder;
+    B b;
+    const auto fib = b.new_label();
+    const auto fib1 = b.new_label();
+
+    b.loadi(B::SP, B::R0, 0x8000);
+    b.loadi(20, B::R0, n);
+    b.call(fib);
+    b.halt();
+
+    // rout = fib(r20)
+    b.bind(fib);
+    b.alu(BF_sub, 2, 20, B::R1);
+    b.jmpic(fib1, SELECT_Z | SELECT_N);
+    b.store(B::SP, B::RA);
+    b.inc(B::SP);
+    b.store(B::SP, 20);
+    b.inc(B::SP);
+    b.mov(20, 2);
+    b.call(fib);
+    b.dec(B::SP);
+    b.load(20, B::SP);
+    b.store(B::SP, B::ROUT);
+    b.inc(B::SP);
+    b.alu(BF_sub, 20, 20, B::R1);
+    b.alu(BF_sub, 20, 20, B::R1);
+    b.call(fib);
+    b.dec(B::SP);
+    b.load(3, B::SP);
+    b.alu(BF_add, B::ROUT, 3, B::ROUT);
+    b.dec(B::SP);
+    b.load(B::RA, B::SP);
+    b.ret();
+    b.bind(fib1);
+    b.mov(B::ROUT, 20);
+    b.ret();
+
+    return b.finish();
+}
+
+/// Fills then sums an array as in test/sum.ulm, @a iterations times.
+inline std::vector<std::uint32_t> make_sum_workload(std::uint16_t length, std::uint16_t iterations) {
+    using B = ProgramBuilder;
+    B b;
+    const auto outer = b.new_label();
+    const auto fill = b.new_label();
+    const auto fill_end = b.new_label();
+    const auto sum = b.new_label();
+    const auto sum_end = b.new_label();
+    const auto done = b.new_label();
+
+    b.loadi(10, B::R0, iterations);
+    b.bind(outer);
+    b.loadi(20, B::R0, 0x2000);
+    b.loadi(21, B::R0, length);
+    b.bind(fill);
+    b.test(21);
+    b.jmpic(fill_end, SELECT_Z);
+    b.store(20, 21);
+    b.inc(20);
+    b.dec(21);
+    b.jmpi(fill);
+    b.bind(fill_end);
+    b.loadi(20, B::R0, 0x2000);
+    b.loadi(21, B::R0, length);
+    b.loadi(B::ROUT, B::R0, 0);
+    b.bind(sum);
+    b.test(21);
+    b.jmpic(sum_end, SELECT_Z);
+    b.load(2, 20);
+    b.alu(BF_add, B::ROUT, B::ROUT, 2);
+    b.inc(20);
+    b.dec(21);
+    b.jmpi(sum);
+    b.bind(sum_end);
+    b.dec(10);
+    b.jmpic(done, SELECT_Z);
+    b.jmpi(outer);
+    b.bind(done);
+    b.halt();
+
+    return b.finish();
+}
+
+/// Sums the lengths of the Collatz sequences of the @a count numbers from
+/// RAM[0]. The branches depend on the data, so different RAM images make the
+/// instances of the program diverge.
+inline std::vector<std::uint32_t> make_collatz_workload(std::uint16_t count) {
+    using B = ProgramBuilder;
+    B b;
+    const auto outer = b.new_label();
+    const auto inner = b.new_label();
+    const auto even = b.new_label();
+    const auto next = b.new_label();
+    const auto done = b.new_label();
+
+    b.load(20, B::R0);
+    b.loadi(21, B::R0, count);
+    b.loadi(B::ROUT, B::R0, 0);
+    b.bind(outer);
+    b.test(21);
+    b.jmpic(done, SELECT_Z);
+    b.mov(2, 20);
+    b.bind(inner);
+    b.alu(BF_sub, 3, 2, B::R1);
+    b.jmpic(next, SELECT_Z);
+    b.alu(BF_and, 3, 2, B::R1);
+    b.jmpic(even, SELECT_Z);
+    b.shift(OP_lsl, 4, 2, B::R1);
+    b.alu(BF_add, 2, 2, 4);
+    b.inc(2);
+    b.inc(B::ROUT);
+    b.jmpi(inner);
+    b.bind(even);
+    b.shift(OP_lsr, 2, 2, B::R1);
+    b.inc(B::ROUT);
+    b.jmpi(inner);
+    b.bind(next);
+    b.inc(20);
+    b.dec(21);
+    b.jmpi(outer);
+    b.bind(done);
+    b.halt();
+
+    return b.finish();
+}
+
+#endif // CPULM_BENCH_WORKLOADS_HPP
@@ -0,0 +1,160 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#ifndef ASM_VM_ALU_HPP
+#define ASM_VM_ALU_HPP
+
+#include "machine_code.hpp"
+
+#include <cstdint>
+
+/*
+ * Semantics of the ALU instructions, shared by all the execution engines.
+ *
+ * Flags are handled as a packed bitmask where the bit `i` is the flag_t `i`,
+ * that is the same layout as the flags select of jmpc and jmpic.
+ *
+ * Most ALU results are never tested by a conditional jump, so the flags are
+ * computed lazily: an ALU instruction only records its operation, operands
+ * and result in a LazyFlags and the Z, N, C and V flags are built from them
+ * when they are actually read.
+ */
+
+using alu_value_t = MachineCodeInfo::RegisterValueTy;
+using packed_flags_t = std::uint8_t;
+
+static constexpr packed_flags_t flag_bit(flag_t flag) {
+    return packed_flags_t(1u << flag);
+}
+
+/// Returns the Z and N flags of an ALU result.
+static inline packed_flags_t alu_zn_flags(alu_value_t result) {
+    return (result == 0 ? flag_bit(FLAG_ZERO) : 0)
+        | (((std::int32_t)result < 0) ? flag_bit(FLAG_NEGATIVE) : 0);
+}
+
+/// Returns the flags set by the ALU operation @a op that computed @a result
+/// from @a lhs and @a rhs.
+static inline packed_flags_t alu_flags(std::uint8_t op, alu_value_t lhs, alu_value_t rhs, alu_value_t result) {
+    packed_flags_t flags = alu_zn_flags(result);
+    switch (op) {
+    case BF_add:
+        // The carry is the unsigned overflow and V the signed one.
+        if (result < lhs)
+            flags |= flag_bit(FLAG_CARRY);
+        if ((((lhs ^ result) & (rhs ^ result)) >> 31) != 0)
+            flags |= flag_bit(FLAG_OVERFLOW);
+        break;
+    case BF_sub:
+        // The carry is the borrow.
+        if (lhs < rhs)
+            flags |= flag_bit(FLAG_CARRY);
+        if ((((lhs ^ rhs) & (lhs ^ result)) >> 31) != 0)
+            flags |= flag_bit(FLAG_OVERFLOW);
+        break;
+    case BF_mul: {
+        std::int32_t signed_result;
+        alu_value_t unsigned_result;
+        if (__builtin_mul_overflow(lhs, rhs, &unsigned_result))
+            flags |= flag_bit(FLAG_CARRY);
+        if (__builtin_mul_overflow((std::int32_t)lhs, (std::int32_t)rhs, &signed_result))
+            flags |= flag_bit(FLAG_OVERFLOW);
+    } break;
+    default:
+        // The logical operations and div only set Z and N.
+        break;
+    }
+
+    return flags;
+}
+
+/// The flags of the last ALU instruction, computed only when they are read.
+struct LazyFlags {
+    /// Value of op when the flags are already computed in @a packed.
+    static constexpr std::uint8_t PACKED = 0xff;
+
+    std::uint8_t op = PACKED;
+    packed_flags_t packed = 0;
+    alu_value_t lhs = 0;
+    alu_value_t rhs = 0;
+    alu_value_t result = 0;
+
+    /// Records the ALU operation @a alu_op, returns its @a alu_result.
+    alu_value_t record(alucode_t alu_op, alu_value_t alu_lhs, alu_value_t alu_rhs, alu_value_t alu_result) {
+        op = alu_op;
+        lhs = alu_lhs;
+        rhs = alu_rhs;
+        result = alu_result;
+        return alu_result;
+    }
+
+    /// Replaces the flags by the already computed @a flags.
+    void set(packed_flags_t flags) {
+        op = PACKED;
+        packed = flags;
+    }
+
+    [[nodiscard]] packed_flags_t get() const {
+        return op == PACKED ? packed : alu_flags(op, lhs, rhs, result);
+    }
+
+    /// Returns true if any of the flags of @a select is set (jmpc and jmpic).
+    [[nodiscard]] bool test(packed_flags_t select) const {
+        if (op == PACKED)
+            return (packed & select) != 0;
+        // Most jumps only test Z or N, which do not depend on the operation.
+        constexpr packed_flags_t carry_or_overflow = flag_bit(FLAG_CARRY) | flag_bit(FLAG_OVERFLOW);
+        if ((select & carry_or_overflow) == 0)
+            return (alu_zn_flags(result) & select) != 0;
+        return (alu_flags(op, lhs, rhs, result) & select) != 0;
+    }
+};
+
+static inline alu_value_t alu_and(alu_value_t lhs, alu_value_t rhs, LazyFlags& flags) {
+    return flags.record(BF_and, lhs, rhs, lhs & rhs);
+}
+
+static inline alu_value_t alu_or(alu_value_t lhs, alu_value_t rhs, LazyFlags& flags) {
+    return flags.record(BF_or, lhs, rhs, lhs | rhs);
+}
+
+static inline alu_value_t alu_nor(alu_value_t lhs, alu_value_t rhs, LazyFlags& flags) {
+    return flags.record(BF_nor, lhs, rhs, ~(lhs | rhs));
+}
+
+static inline alu_value_t alu_xor(alu_value_t lhs, alu_value_t rhs, LazyFlags& flags) {
+    return flags.record(BF_xor, lhs, rhs, lhs ^ rhs);
+}
+
+static inline alu_value_t alu_add(alu_value_t lhs, alu_value_t rhs, LazyFlags& flags) {
+    return flags.record(BF_add, lhs, rhs, lhs + rhs);
+}
+
+static inline alu_value_t alu_sub(alu_value_t lhs, alu_value_t rhs, LazyFlags& flags) {
+    return flags.record(BF_sub, lhs, rhs, lhs - rhs);
+}
+
+static inline alu_value_t alu_mul(alu_value_t lhs, alu_value_t rhs, LazyFlags& flags) {
+    return flags.record(BF_mul, lhs, rhs, lhs * rhs);
+}
+
+static inline alu_value_t alu_div(alu_value_t lhs, alu_value_t rhs, LazyFlags& flags) {
+    return flags.record(BF_div, lhs, rhs, lhs / rhs);
+}
+
+static inline alu_value_t shift_lsl(alu_value_t lhs, alu_value_t rhs) {
+    return lhs << (rhs & 0b11111);
+}
+
+static inline alu_value_t shift_asr(alu_value_t lhs, alu_value_t rhs) {
+    // Arithmetic shift is done when operating on SIGNED values.
+    return (std::int32_t)lhs >> (rhs & 0b11111);
+}
+
+static inline alu_value_t shift_lsr(alu_value_t lhs, alu_value_t rhs) {
+    // Logical shift is done when operating on UNSIGNED values.
+    return lhs >> (rhs & 0b11111);
+}
+
+#endif // ASM_VM_ALU_HPP
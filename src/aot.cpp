@@ -0,0 +1,229 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+/*
+ * cpulm_aot: translates a ROM to a C translation unit.
+ *
+ * Each instruction of the ROM becomes a labelled C statement, direct jumps
+ * (jmpi and jmpic) become gotos and register jumps (jmp and jmpc) go through
+ * a switch on the target address that the C compiler turns into a jump
+ * table. The generated file defines cpulm_aot_program() and must be linked
+ * with the cpulm_aot_runtime library, see cpulm_add_aot_executable() in
+ * CMakeLists.txt.
+ *
+ * As in the VM, the clock is checked every CPULM_AOT_TICK_CHECK_INTERVAL
+ * instructions. Each jump counts the instructions since the previous jump
+ * of the ROM, which are all executed unless the program jumped between them.
+ */
+
+#include "mapped_file.hpp"
+#include "vm.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <span>
+#include <string>
+#include <string_view>
+
+[[noreturn]] static void error(const std::string& msg) {
+    std::cerr << "\x1b[1;31mERROR:\x1b[0m " << msg << "\n";
+    std::exit(EXIT_FAILURE);
+}
+
+class Translator {
+public:
+    Translator(std::FILE* output, std::span<const std::uint32_t> rom)
+        : m_output(output)
+        , m_rom(rom) { }
+
+    void translate(const char* rom_filename);
+
+private:
+    /// Returns the C expression reading @a reg, r0 and r1 are constants.
+    static std::string read_reg(reg_index_t reg);
+    void emit_instruction(addr_t addr, const DecodedInstruction& inst);
+    /// Emits a jump to a constant address.
+    void emit_direct_jump(reg_t target);
+
+    std::FILE* m_output;
+    std::span<const std::uint32_t> m_rom;
+    /// The instruction after the previous jump.
+    addr_t m_block_begin = 0;
+};
+
+std::string Translator::read_reg(reg_index_t reg) {
+    if (reg == 0)
+        return "0u";
+    if (reg == 1)
+        return "1u";
+    return "r[" + std::to_string(reg) + "]";
+}
+
+void Translator::emit_direct_jump(reg_t target) {
+    if (target < m_rom.size())
+        std::fprintf(m_output, "goto L_%u;", target);
+    else
+        std::fprintf(m_output, "pc = %#xu; goto out_of_program;", target);
+}
+
+void Translator::emit_instruction(addr_t addr, const DecodedInstruction& inst) {
+    std::FILE* out = m_output;
+    const auto rd = std::to_string(inst.rd);
+    const auto rs1 = read_reg(inst.rs1);
+    const auto rs2 = read_reg(inst.rs2);
+
+    std::fprintf(out, "L_%u:\n    ", addr);
+    const addr_t block_size = addr - m_block_begin + 1;
+    switch (inst.base_handler()) {
+#define BINARY_INSTRUCTION(name, func)                                                                           \
+    case H_alu_##name:                                                                                           \
+        std::fprintf(out, "r[%s] = cpulm_alu_" #name "(%s, %s, &flags);", rd.c_str(), rs1.c_str(), rs2.c_str()); \
+        break;
+#include "instructions.def"
+    case H_alu:
+        std::fprintf(out, "cpulm_aot_error(\"invalid ALU code\", %#xu);", addr);
+        break;
+    case H_lsl:
+    case H_asr:
+    case H_lsr: {
+        const char* name = inst.opcode == OP_lsl ? "lsl" : (inst.opcode == OP_asr ? "asr" : "lsr");
+        std::fprintf(out, "r[%s] = cpulm_shift_%s(%s, %s);", rd.c_str(), name, rs1.c_str(), rs2.c_str());
+    } break;
+    case H_load:
+        std::fprintf(out, "r[%s] = ram_get(ram, %s);", rd.c_str(), rs1.c_str());
+        break;
+    case H_loadi:
+        std::fprintf(out, "r[%s] = %s + %#xu;", rd.c_str(), rs1.c_str(), inst.imm);
+        break;
+    case H_store:
+        std::fprintf(out, "ram_set(ram, %s, %s);", rs1.c_str(), rs2.c_str());
+        break;
+    case H_jmp:
+        std::fprintf(out, "TICK(%u); pc = %s; goto dispatch;", block_size, rs1.c_str());
+        m_block_begin = addr + 1;
+        break;
+    case H_jmpc:
+        std::fprintf(out, "TICK(%u); if ((flags & %#x) != 0) { pc = %s; goto dispatch; }", block_size, inst.select, rs1.c_str());
+        m_block_begin = addr + 1;
+        break;
+    case H_jmpi:
+        std::fprintf(out, "TICK(%u); ", block_size);
+        emit_direct_jump(inst.imm);
+        m_block_begin = addr + 1;
+        break;
+    case H_jmpic:
+        std::fprintf(out, "TICK(%u); if ((flags & %#x) != 0) { ", block_size, inst.select);
+        emit_direct_jump(inst.imm);
+        std::fprintf(out, " }");
+        m_block_begin = addr + 1;
+        break;
+    case H_break:
+        // Same as the VM, the program stops after the break instruction.
+        std::fprintf(out, "pc = %#xu; cpulm_aot_breakpoint(pc); goto stop;", addr + 1);
+        m_block_begin = addr + 1;
+        break;
+    default:
+        std::fprintf(out, "cpulm_aot_error(\"invalid opcode\", %#xu);", addr);
+        break;
+    }
+    std::fprintf(out, "\n");
+}
+
+void Translator::translate(const char* rom_filename) {
+    std::FILE* out = m_output;
+    std::fprintf(out, "/* Generated by cpulm_aot from '%s', do not edit. */\n\n", rom_filename);
+    std::fprintf(out, "#include \"aot_runtime.h\"\n\n");
+    std::fprintf(out, "#include <string.h>\n\n");
+
+    std::fprintf(out, "#define TICK(count)                                       \\\n"
+                      "    do {                                                  \\\n"
+                      "        if ((countdown -= (count)) <= 0) {                \\\n"
+                      "            countdown = CPULM_AOT_TICK_CHECK_INTERVAL;    \\\n"
+                      "            cpulm_aot_update_tick(state);                 \\\n"
+                      "        }                                                 \\\n"
+                      "    } while (0)\n\n");
+
+    std::fprintf(out, "void cpulm_aot_program(struct cpulm_aot_state* state) {\n");
+    std::fprintf(out, "    ram_t* const ram = state->ram;\n");
+    std::fprintf(out, "    uint32_t r[CPULM_AOT_REG_SLOTS];\n");
+    std::fprintf(out, "    uint8_t flags = state->flags;\n");
+    std::fprintf(out, "    uint32_t pc = state->pc;\n");
+    std::fprintf(out, "    int32_t countdown = CPULM_AOT_TICK_CHECK_INTERVAL;\n");
+    std::fprintf(out, "    memcpy(r, state->regs, sizeof(r));\n");
+    std::fprintf(out, "    goto dispatch;\n\n");
+
+    for (addr_t addr = 0; addr < m_rom.size(); ++addr)
+        emit_instruction(addr, DecodedInstruction::decode(m_rom[addr], addr));
+
+    // Running past the last instruction.
+    std::fprintf(out, "    pc = %#zxu;\n", m_rom.size());
+    std::fprintf(out, "    goto out_of_program;\n\n");
+
+    std::fprintf(out, "dispatch:\n");
+    std::fprintf(out, "    switch (pc) {\n");
+    for (addr_t addr = 0; addr < m_rom.size(); ++addr)
+        std::fprintf(out, "    case %u: goto L_%u;\n", addr, addr);
+    std::fprintf(out, "    default: goto out_of_program;\n");
+    std::fprintf(out, "    }\n\n");
+
+    std::fprintf(out, "out_of_program:\n");
+    std::fprintf(out, "    if (pc != CPULM_AOT_HALT_ADDRESS)\n");
+    std::fprintf(out, "        cpulm_aot_error(\"jumping outside of program.\", pc);\n");
+    std::fprintf(out, "    goto stop;\n\n");
+
+    std::fprintf(out, "stop:\n");
+    std::fprintf(out, "    state->pc = pc;\n");
+    std::fprintf(out, "    state->flags = flags;\n");
+    std::fprintf(out, "    memcpy(state->regs, r, sizeof(r));\n");
+    std::fprintf(out, "}\n");
+}
+
+static void show_help_message(const char* argv0) {
+    std::cout << "USAGE: " << argv0 << " [-o output.c] input.po\n";
+}
+
+int main(int argc, char* argv[]) {
+    const char* input_file = nullptr;
+    const char* output_file = nullptr;
+
+    for (int i = 1 /* ignore argv0 */; i < argc; i++) {
+        const std::string_view option = argv[i];
+        if (option == "-h" || option == "--help") {
+            show_help_message(argv[0]);
+            return EXIT_SUCCESS;
+        } else if (option == "-o") {
+            if (i + 1 == argc)
+                error("missing argument to '-o'");
+            output_file = argv[++i];
+        } else if (option.starts_with("-")) {
+            error(std::string("unknown option '") + option.data() + "'");
+        } else if (input_file == nullptr) {
+            input_file = argv[i];
+        } else {
+            error("too many rom file");
+        }
+    }
+
+    if (input_file == nullptr)
+        error("missing a rom file");
+
+    MappedFile rom;
+    if (const char* failure = rom.open(input_file, false))
+        error(std::string("failed to read file '") + input_file + "'; " + failure);
+
+    std::FILE* output = stdout;
+    if (output_file != nullptr) {
+        output = std::fopen(output_file, "w");
+        if (output == nullptr)
+            error(std::string("failed to write file '") + output_file + "'");
+    }
+
+    Translator translator(output, { rom.data(), rom.size() });
+    translator.translate(input_file);
+
+    if (output != stdout)
+        std::fclose(output);
+    return EXIT_SUCCESS;
+}
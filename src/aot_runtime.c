@@ -0,0 +1,145 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "aot_runtime.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "screen.h"
+#include "time_device.h"
+
+static struct timespec previous_tick_time;
+
+void cpulm_aot_update_tick(struct cpulm_aot_state* state) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    const int64_t elapsed = (int64_t)(now.tv_sec - previous_tick_time.tv_sec) * 1000000000
+        + (now.tv_nsec - previous_tick_time.tv_nsec);
+    if (elapsed >= 1000000000) {
+        // 1 second has elapsed
+        time_device_tick(state->ram);
+        previous_tick_time = now;
+    }
+}
+
+void cpulm_aot_error(const char* msg, uint32_t pc) {
+    fprintf(stderr, "\x1b[1;31mERROR:\x1b[0m machine code ill-formed; %s (PC = %#x)\n", msg, pc);
+    exit(EXIT_FAILURE);
+}
+
+void cpulm_aot_breakpoint(uint32_t pc) {
+    printf("Breakpoint at PC = %#x (%u) reached.\n", pc, pc);
+}
+
+_Noreturn static void error(const char* msg, const char* arg) {
+    fprintf(stderr, "\x1b[1;31mERROR:\x1b[0m %s%s\n", msg, arg != NULL ? arg : "");
+    exit(EXIT_FAILURE);
+}
+
+static void load_ram_file(ram_t* ram, const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+        error("failed to read file ", filename);
+
+    size_t size = 0;
+    size_t capacity = 1024;
+    word_t* data = malloc(capacity * sizeof(word_t));
+    size_t read_words;
+    while (data != NULL && (read_words = fread(data + size, sizeof(word_t), capacity - size, file)) > 0) {
+        size += read_words;
+        if (size == capacity) {
+            capacity *= 2;
+            word_t* new_data = realloc(data, capacity * sizeof(word_t));
+            if (new_data == NULL)
+                free(data);
+            data = new_data;
+        }
+    }
+
+    fclose(file);
+    if (data == NULL)
+        error("out of memory while reading ", filename);
+
+    ram_init(ram, data, size);
+    free(data);
+}
+
+static void print_registers(const struct cpulm_aot_state* state) {
+    printf("pc = %#x\n", state->pc);
+    for (int i = 0; i < CPULM_AOT_REG_SLOTS - 1; ++i)
+        printf("r%d = %#x\n", i, state->regs[i]);
+    printf("flags = %#x\n", state->flags);
+}
+
+static void print_ram(ram_t* ram, addr_t begin, addr_t count) {
+    for (addr_t i = 0; i < count; ++i)
+        printf("[%#x] = %#x\n", begin + i, ram_get(ram, begin + i));
+}
+
+static void show_help_message(const char* argv0) {
+    printf("USAGE: %s [--no-screen] [--regs] [--dump-ram begin count] [input.do]\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+    bool use_screen = true;
+    bool show_registers = false;
+    bool dump_ram = false;
+    addr_t dump_begin = 0;
+    addr_t dump_count = 0;
+    const char* ram_file = NULL;
+
+    for (int i = 1 /* ignore argv0 */; i < argc; ++i) {
+        const char* option = argv[i];
+        if (strcmp(option, "-h") == 0 || strcmp(option, "--help") == 0) {
+            show_help_message(argv[0]);
+            return EXIT_SUCCESS;
+        } else if (strcmp(option, "--no-screen") == 0) {
+            use_screen = false;
+        } else if (strcmp(option, "--regs") == 0) {
+            show_registers = true;
+        } else if (strcmp(option, "--dump-ram") == 0) {
+            if (i + 2 >= argc)
+                error("missing argument to '--dump-ram'", NULL);
+
+            dump_ram = true;
+            dump_begin = (addr_t)strtoul(argv[++i], NULL, 0);
+            dump_count = (addr_t)strtoul(argv[++i], NULL, 0);
+        } else if (option[0] == '-') {
+            error("unknown option ", option);
+        } else if (ram_file == NULL) {
+            ram_file = option;
+        } else {
+            error("too many ram file", NULL);
+        }
+    }
+
+    struct cpulm_aot_state state;
+    memset(&state, 0, sizeof(state));
+    state.regs[1] = 1;
+    state.ram = ram_create();
+
+    if (use_screen)
+        screen_init_with_ram_mapping(state.ram);
+    if (ram_file != NULL)
+        load_ram_file(state.ram, ram_file);
+    time_device_install(state.ram);
+    clock_gettime(CLOCK_MONOTONIC, &previous_tick_time);
+
+    cpulm_aot_program(&state);
+
+    if (use_screen)
+        screen_terminate();
+    if (show_registers)
+        print_registers(&state);
+    if (dump_ram)
+        print_ram(state.ram, dump_begin, dump_count);
+
+    ram_destroy(state.ram);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,140 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+// The runtime of the native programs built by cpulm_aot.
+//
+// The C file generated from a ROM only defines cpulm_aot_program(), the
+// runtime provides the main() function (loading of the RAM image, screen and
+// time device) and the semantics of the ALU shared with alu.hpp.
+
+#ifndef CPULM_AOT_RUNTIME_H
+#define CPULM_AOT_RUNTIME_H
+
+#include <stdint.h>
+
+#include "memory.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// The count of register slots, the last one receives the writes to r0 and r1.
+#define CPULM_AOT_REG_SLOTS 33
+/// The count of instructions executed between two checks of the clock, as
+/// VM::TICK_CHECK_INTERVAL.
+#define CPULM_AOT_TICK_CHECK_INTERVAL 16384
+/// The address jumped to in order to stop the program.
+#define CPULM_AOT_HALT_ADDRESS 0xffffffffu
+
+#define CPULM_AOT_FLAG_ZERO (1u << 0)
+#define CPULM_AOT_FLAG_NEGATIVE (1u << 1)
+#define CPULM_AOT_FLAG_CARRY (1u << 2)
+#define CPULM_AOT_FLAG_OVERFLOW (1u << 3)
+
+struct cpulm_aot_state {
+    uint32_t regs[CPULM_AOT_REG_SLOTS];
+    /// The flags packed as in the select of jmpc and jmpic.
+    uint8_t flags;
+    uint32_t pc;
+    ram_t* ram;
+};
+
+/// @brief Runs the program from state->pc until it halts or reaches a break.
+///
+/// Defined by the C file generated by cpulm_aot.
+void cpulm_aot_program(struct cpulm_aot_state* state);
+
+/// @brief Called every CPULM_AOT_TICK_CHECK_INTERVAL instructions to update
+/// the time device.
+void cpulm_aot_update_tick(struct cpulm_aot_state* state);
+
+/// @brief Reports an ill-formed machine code at the given pc and exits.
+_Noreturn void cpulm_aot_error(const char* msg, uint32_t pc);
+
+/// @brief Reports that a break instruction was reached.
+void cpulm_aot_breakpoint(uint32_t pc);
+
+/*
+ * Semantics of the ALU instructions, must be kept in sync with alu.hpp.
+ */
+
+static inline uint8_t cpulm_alu_zn_flags(uint32_t result) {
+    return (result == 0 ? CPULM_AOT_FLAG_ZERO : 0)
+        | ((int32_t)result < 0 ? CPULM_AOT_FLAG_NEGATIVE : 0);
+}
+
+static inline uint32_t cpulm_alu_and(uint32_t lhs, uint32_t rhs, uint8_t* flags) {
+    const uint32_t result = lhs & rhs;
+    *flags = cpulm_alu_zn_flags(result);
+    return result;
+}
+
+static inline uint32_t cpulm_alu_or(uint32_t lhs, uint32_t rhs, uint8_t* flags) {
+    const uint32_t result = lhs | rhs;
+    *flags = cpulm_alu_zn_flags(result);
+    return result;
+}
+
+static inline uint32_t cpulm_alu_nor(uint32_t lhs, uint32_t rhs, uint8_t* flags) {
+    const uint32_t result = ~(lhs | rhs);
+    *flags = cpulm_alu_zn_flags(result);
+    return result;
+}
+
+static inline uint32_t cpulm_alu_xor(uint32_t lhs, uint32_t rhs, uint8_t* flags) {
+    const uint32_t result = lhs ^ rhs;
+    *flags = cpulm_alu_zn_flags(result);
+    return result;
+}
+
+static inline uint32_t cpulm_alu_add(uint32_t lhs, uint32_t rhs, uint8_t* flags) {
+    int32_t signed_result;
+    uint32_t result;
+    const int overflow = __builtin_add_overflow((int32_t)lhs, (int32_t)rhs, &signed_result);
+    const int carry = __builtin_add_overflow(lhs, rhs, &result);
+    *flags = cpulm_alu_zn_flags(result) | (carry ? CPULM_AOT_FLAG_CARRY : 0) | (overflow ? CPULM_AOT_FLAG_OVERFLOW : 0);
+    return result;
+}
+
+static inline uint32_t cpulm_alu_sub(uint32_t lhs, uint32_t rhs, uint8_t* flags) {
+    int32_t signed_result;
+    uint32_t result;
+    const int overflow = __builtin_sub_overflow((int32_t)lhs, (int32_t)rhs, &signed_result);
+    const int carry = __builtin_sub_overflow(lhs, rhs, &result);
+    *flags = cpulm_alu_zn_flags(result) | (carry ? CPULM_AOT_FLAG_CARRY : 0) | (overflow ? CPULM_AOT_FLAG_OVERFLOW : 0);
+    return result;
+}
+
+static inline uint32_t cpulm_alu_mul(uint32_t lhs, uint32_t rhs, uint8_t* flags) {
+    int32_t signed_result;
+    uint32_t result;
+    const int overflow = __builtin_mul_overflow((int32_t)lhs, (int32_t)rhs, &signed_result);
+    const int carry = __builtin_mul_overflow(lhs, rhs, &result);
+    *flags = cpulm_alu_zn_flags(result) | (carry ? CPULM_AOT_FLAG_CARRY : 0) | (overflow ? CPULM_AOT_FLAG_OVERFLOW : 0);
+    return result;
+}
+
+static inline uint32_t cpulm_alu_div(uint32_t lhs, uint32_t rhs, uint8_t* flags) {
+    const uint32_t result = lhs / rhs;
+    *flags = cpulm_alu_zn_flags(result);
+    return result;
+}
+
+static inline uint32_t cpulm_shift_lsl(uint32_t lhs, uint32_t rhs) {
+    return lhs << (rhs & 0x1f);
+}
+
+static inline uint32_t cpulm_shift_asr(uint32_t lhs, uint32_t rhs) {
+    return (uint32_t)((int32_t)lhs >> (rhs & 0x1f));
+}
+
+static inline uint32_t cpulm_shift_lsr(uint32_t lhs, uint32_t rhs) {
+    return lhs >> (rhs & 0x1f);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // !CPULM_AOT_RUNTIME_H
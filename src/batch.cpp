@@ -0,0 +1,340 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+/*
+ * cpulm_batch: runs many programs in parallel, for example to validate the
+ * output of a compiler.
+ *
+ * The jobs are given either by a directory, where each .po file is a job that
+ * uses the .do file of the same name if it exists, or by a manifest with one
+ * job per line:
+ *
+ *     # <rom> [<ram>] [budget=<instructions>] [expect=<rout>]
+ *     fib.po fib.do expect=46368
+ *     sum.po budget=1000000 expect=50005000
+ *
+ * Paths of a manifest are relative to its directory. A job passes if the
+ * program halts within its budget and, when an expected value is given, with
+ * that value in rout. All the VM running the same ROM share its Program.
+ */
+
+#include "thread_pool.hpp"
+#include "vm.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+[[noreturn]] static void error(const std::string& msg) {
+    std::cerr << "\x1b[1;31mERROR:\x1b[0m " << msg << "\n";
+    std::exit(EXIT_FAILURE);
+}
+
+struct Job {
+    fs::path rom_file;
+    fs::path ram_file; ///< Empty if the program has no RAM image.
+    std::uint64_t budget = 0;
+    std::optional<reg_t> expected_rout;
+    std::shared_ptr<const Program> program;
+};
+
+enum class JobStatus {
+    PASS,
+    /// The program halted with an unexpected rout.
+    FAIL,
+    /// The budget was exhausted.
+    TIMEOUT,
+    /// The program stopped on a break instruction.
+    BREAK,
+    /// The machine code is ill-formed.
+    ERROR,
+    /// The ROM or the RAM file cannot be read.
+    IO_ERROR
+};
+
+static const char* job_status_name(JobStatus status) {
+    switch (status) {
+    case JobStatus::PASS:
+        return "PASS";
+    case JobStatus::FAIL:
+        return "FAIL";
+    case JobStatus::TIMEOUT:
+        return "TIMEOUT";
+    case JobStatus::BREAK:
+        return "BREAK";
+    case JobStatus::ERROR:
+        return "ERROR";
+    case JobStatus::IO_ERROR:
+    default:
+        return "IO_ERROR";
+    }
+}
+
+struct JobResult {
+    JobStatus status = JobStatus::IO_ERROR;
+    reg_t rout = 0;
+    std::uint64_t instructions = 0;
+    double seconds = 0;
+    std::string message;
+};
+
+struct CommandLineArgs {
+    std::string input;
+    std::string report_file;
+    std::size_t thread_count = std::thread::hardware_concurrency();
+    std::uint64_t budget = 10'000'000'000;
+    ExecutionEngine engine = ExecutionEngine::INTERPRETER;
+} cmd_line_args = {};
+
+static void show_help_message(const char* argv0) {
+    std::cout << "USAGE: " << argv0 << " [options...] manifest|directory\n"
+              << "  -j <n>              count of threads (default: one per core)\n"
+              << "  --budget <n>        default instruction budget of a job\n"
+              << "  --engine <engine>   interpreter, block or jit\n"
+              << "  --report <file>     write the per-job report to a file instead of stdout\n";
+}
+
+static std::uint64_t parse_number(std::string_view text, const char* what) {
+    try {
+        std::size_t end = 0;
+        const auto value = std::stoull(std::string(text), &end, 0);
+        if (end == text.size())
+            return value;
+    } catch (const std::exception&) {
+    }
+
+    error(std::string("invalid ") + what + " '" + std::string(text) + "'");
+}
+
+static void parse_options(int argc, char* argv[]) {
+    for (int i = 1 /* ignore argv0 */; i < argc; i++) {
+        const std::string_view option = argv[i];
+        if (option == "-h" || option == "--help") {
+            show_help_message(argv[0]);
+            std::exit(EXIT_SUCCESS);
+        } else if (option == "-j" || option == "--budget" || option == "--engine" || option == "--report") {
+            if (i + 1 == argc)
+                error(std::string("missing argument to '") + option.data() + "'");
+
+            const std::string_view value = argv[++i];
+            if (option == "-j") {
+                cmd_line_args.thread_count = parse_number(value, "thread count");
+            } else if (option == "--budget") {
+                cmd_line_args.budget = parse_number(value, "budget");
+            } else if (option == "--report") {
+                cmd_line_args.report_file = value;
+            } else if (value == "interpreter" || value == "interp") {
+                cmd_line_args.engine = ExecutionEngine::INTERPRETER;
+            } else if (value == "block" || value == "blocks") {
+                cmd_line_args.engine = ExecutionEngine::BASIC_BLOCKS;
+            } else if (value == "jit") {
+                cmd_line_args.engine = ExecutionEngine::JIT;
+            } else {
+                error(std::string("unknown engine '") + value.data() + "'");
+            }
+        } else if (option.starts_with("-")) {
+            error(std::string("unknown option '") + option.data() + "'");
+        } else if (cmd_line_args.input.empty()) {
+            cmd_line_args.input = option;
+        } else {
+            error("too many inputs");
+        }
+    }
+
+    if (cmd_line_args.input.empty())
+        error("missing a manifest or a directory");
+}
+
+static std::vector<Job> jobs_from_directory(const fs::path& directory) {
+    std::vector<Job> jobs;
+    for (const auto& entry : fs::directory_iterator(directory)) {
+        if (entry.path().extension() != ".po")
+            continue;
+
+        Job job;
+        job.rom_file = entry.path();
+        job.budget = cmd_line_args.budget;
+        fs::path ram_file = entry.path();
+        ram_file.replace_extension(".do");
+        if (fs::exists(ram_file))
+            job.ram_file = ram_file;
+        jobs.push_back(job);
+    }
+
+    std::sort(jobs.begin(), jobs.end(), [](const Job& lhs, const Job& rhs) { return lhs.rom_file < rhs.rom_file; });
+    return jobs;
+}
+
+static std::vector<Job> jobs_from_manifest(const fs::path& manifest) {
+    std::ifstream stream(manifest);
+    if (!stream)
+        error("failed to read file '" + manifest.string() + "'");
+
+    const fs::path base = manifest.parent_path();
+    std::vector<Job> jobs;
+    std::string line;
+    for (std::size_t line_number = 1; std::getline(stream, line); ++line_number) {
+        line = line.substr(0, line.find('#'));
+
+        // Only built to report an error.
+        const auto where = [&] { return manifest.string() + ":" + std::to_string(line_number) + ": "; };
+
+        Job job;
+        job.budget = cmd_line_args.budget;
+        std::istringstream fields(line);
+        std::string field;
+        bool empty = true;
+        while (fields >> field) {
+            empty = false;
+            if (field.starts_with("budget=")) {
+                job.budget = parse_number(std::string_view(field).substr(7), "budget");
+            } else if (field.starts_with("expect=")) {
+                // Negative values are accepted, as written in the assembly.
+                const std::string_view value = std::string_view(field).substr(7);
+                if (value.starts_with("-"))
+                    job.expected_rout = -(reg_t)parse_number(value.substr(1), "expected value");
+                else
+                    job.expected_rout = (reg_t)parse_number(value, "expected value");
+            } else if (job.rom_file.empty()) {
+                job.rom_file = base / field;
+            } else if (job.ram_file.empty()) {
+                job.ram_file = base / field;
+            } else {
+                error(where() + "unexpected '" + field + "'");
+            }
+        }
+
+        if (empty)
+            continue;
+        if (job.rom_file.empty())
+            error(where() + "missing a ROM");
+        jobs.push_back(job);
+    }
+
+    return jobs;
+}
+
+static JobResult run_job(const Job& job) {
+    JobResult result;
+    if (job.program == nullptr) {
+        result.message = "failed to read file '" + job.rom_file.string() + "'";
+        return result;
+    }
+
+    const auto start_time = std::chrono::steady_clock::now();
+    VM vm(job.program, {}, false);
+    vm.set_engine(cmd_line_args.engine);
+    if (!job.ram_file.empty()) {
+        if (const char* failure = vm.load_ram_file(job.ram_file.string().c_str())) {
+            result.message = "failed to read file '" + job.ram_file.string() + "'; " + failure;
+            return result;
+        }
+    }
+    const StopReason reason = vm.run(job.budget);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    result.instructions = vm.get_instruction_count();
+    result.rout = vm.get_reg(VM::REG_OUT);
+
+    switch (reason) {
+    case StopReason::HALTED:
+        if (job.expected_rout.has_value() && *job.expected_rout != result.rout) {
+            result.status = JobStatus::FAIL;
+            result.message = "expected rout = " + std::to_string((std::int32_t)*job.expected_rout);
+        } else {
+            result.status = JobStatus::PASS;
+        }
+        break;
+    case StopReason::BUDGET_EXHAUSTED:
+        result.status = JobStatus::TIMEOUT;
+        break;
+    case StopReason::BREAKPOINT:
+    case StopReason::WATCHPOINT:
+    case StopReason::DEVICE_WRITE:
+        result.status = JobStatus::BREAK;
+        break;
+    case StopReason::ERROR:
+        result.status = JobStatus::ERROR;
+        result.message = vm.get_error();
+        break;
+    }
+
+    return result;
+}
+
+static double mips(std::uint64_t instructions, double seconds) {
+    return seconds > 0 ? (double)instructions / seconds / 1e6 : 0.0;
+}
+
+int main(int argc, char* argv[]) {
+    parse_options(argc, argv);
+
+    const fs::path input = cmd_line_args.input;
+    std::vector<Job> jobs = fs::is_directory(input) ? jobs_from_directory(input) : jobs_from_manifest(input);
+
+    // Jobs running the same ROM share its decoding.
+    std::map<fs::path, std::shared_ptr<const Program>> programs;
+    for (Job& job : jobs) {
+        auto [it, inserted] = programs.try_emplace(job.rom_file);
+        if (inserted) {
+            MappedFile rom;
+            if (rom.open(job.rom_file.string().c_str(), false) == nullptr)
+                it->second = std::make_shared<const Program>(std::move(rom));
+        }
+        job.program = it->second;
+    }
+
+    std::vector<JobResult> results(jobs.size());
+    const auto start_time = std::chrono::steady_clock::now();
+    {
+        ThreadPool pool(cmd_line_args.thread_count);
+        for (std::size_t i = 0; i < jobs.size(); ++i)
+            pool.submit([&, i] { results[i] = run_job(jobs[i]); });
+        pool.wait();
+    }
+    const double wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+    std::FILE* report = stdout;
+    if (!cmd_line_args.report_file.empty()) {
+        report = std::fopen(cmd_line_args.report_file.c_str(), "w");
+        if (report == nullptr)
+            error("failed to write file '" + cmd_line_args.report_file + "'");
+    }
+
+    std::fprintf(report, "%-9s %-40s %12s %14s %10s %10s\n", "status", "program", "rout", "instructions", "time (s)", "MIPS");
+    std::size_t passed = 0;
+    std::uint64_t total_instructions = 0;
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+        const JobResult& result = results[i];
+        passed += result.status == JobStatus::PASS;
+        total_instructions += result.instructions;
+        std::fprintf(report, "%-9s %-40s %12d %14llu %10.3f %10.2f", job_status_name(result.status),
+            jobs[i].rom_file.string().c_str(), (std::int32_t)result.rout, (unsigned long long)result.instructions,
+            result.seconds, mips(result.instructions, result.seconds));
+        if (!result.message.empty())
+            std::fprintf(report, "  (%s)", result.message.c_str());
+        std::fprintf(report, "\n");
+    }
+
+    if (report != stdout)
+        std::fclose(report);
+
+    std::printf("%zu job(s), %zu passed, %zu failed on %zu thread(s)\n", jobs.size(), passed, jobs.size() - passed,
+        std::max<std::size_t>(cmd_line_args.thread_count, 1));
+    std::printf("%llu instructions in %.3f s, %.2f MIPS\n", (unsigned long long)total_instructions, wall_time,
+        mips(total_instructions, wall_time));
+
+    return passed == jobs.size() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,250 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "alu.hpp"
+#include "jit.hpp"
+#include "vm.hpp"
+
+#include <cstring>
+
+/*
+ * The basic block engine.
+ *
+ * Basic blocks are found the first time their start address is executed and
+ * cached by start address. A whole block is then executed without any of the
+ * per-instruction checks of the interpreter: the tick, the breakpoints, the
+ * budget and the bounds of the program are only checked at block exits.
+ *
+ * Everything that is not a plain block (breakpoints, invalid instructions,
+ * the end of the program or a budget that ends in the middle of a block) is
+ * delegated to the interpreter.
+ *
+ * With the JIT engine, blocks that ran JIT_THRESHOLD times are translated to
+ * native code which is then used instead of the loop below.
+ */
+
+static constexpr std::uint32_t JIT_THRESHOLD = 16;
+
+/// Returns true if the instruction can be part of the body of a block.
+static bool is_block_body(const DecodedInstruction& inst) {
+    switch (inst.base_handler()) {
+#define BINARY_INSTRUCTION(name, func) case H_alu_##name:
+#include "instructions.def"
+    case H_lsl:
+    case H_asr:
+    case H_lsr:
+    case H_load:
+    case H_loadi:
+    case H_store:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_block_terminator(const DecodedInstruction& inst) {
+    switch (inst.base_handler()) {
+    case H_jmp:
+    case H_jmpc:
+    case H_jmpi:
+    case H_jmpic:
+        return true;
+    default:
+        return false;
+    }
+}
+
+BasicBlock& VM::find_block(addr_t addr) {
+    if (m_blocks.empty())
+        m_blocks.resize(m_code_length);
+
+    auto& block = m_blocks[addr];
+    if (block != nullptr)
+        return *block;
+
+    block = std::make_unique<BasicBlock>();
+    std::size_t pc = addr;
+    while (pc < m_code_length && is_block_body(m_program[pc])) {
+        DecodedInstruction inst = m_program[pc++];
+        inst.handler = inst.base_handler();
+        block->body.push_back(inst);
+    }
+
+    if (pc < m_code_length && is_block_terminator(m_program[pc])) {
+        block->terminator = m_program[pc];
+        block->terminator.handler = block->terminator.base_handler();
+        block->has_terminator = true;
+    }
+
+    return *block;
+}
+
+StopReason VM::run_blocks(std::uint64_t budget) {
+    // The stores of the blocks are not checked against the watchpoints and
+    // do not take the lock of a shared RAM.
+    if (!m_watchpoints.empty() || m_ram_lock != nullptr)
+        return run_loop(budget);
+
+    JitContext state;
+    state.ram = ram_ref();
+    state.mmio = &m_mmio;
+    state.written_pages = &m_written_pages;
+    state.track_written_pages = m_track_written_pages;
+    state.copy_on_write = m_copy_on_write.is_active() ? &m_copy_on_write : nullptr;
+    // The stores to the devices go through MmioMap::store() like the others,
+    // the native code only stops before them to report them.
+    state.device_begin = m_mmio.get_begin();
+    state.device_size = m_stop_on_device_write ? m_mmio.get_size() : 0;
+    std::size_t pc;
+    // The native code works on packed flags, the loop below on lazy ones.
+    LazyFlags flags;
+
+    const auto load_state = [&]() {
+        pc = m_pc;
+        std::memcpy(state.regs, m_regs, sizeof(state.regs));
+        flags = m_flags;
+    };
+
+    const auto store_state = [&]() {
+        m_pc = pc;
+        std::memcpy(m_regs, state.regs, sizeof(state.regs));
+        m_flags = flags;
+    };
+
+    reg_t* const regs = state.regs;
+
+    load_state();
+    while (budget > 0) {
+        if (pc >= m_code_length) {
+            // End of the program or jump outside of it.
+            store_state();
+            return run_loop(budget);
+        }
+
+        BasicBlock& block = find_block(pc);
+        if (block.length() > budget) {
+            store_state();
+            return run_loop(budget);
+        }
+
+        if (m_jit != nullptr && block.native_code == nullptr && ++block.hits == JIT_THRESHOLD)
+            block.native_code = m_jit->compile(block, pc);
+
+        if (block.native_code != nullptr) {
+            state.device_exit = false;
+            state.flags = flags.get();
+            const std::size_t next_pc = block.native_code(&state);
+            flags.set(state.flags);
+            if (!state.device_exit) {
+                pc = next_pc;
+                budget -= block.length();
+                retire(block.length());
+                continue;
+            }
+
+            // The native code stopped just before a store to a device.
+            budget -= next_pc - pc;
+            retire(next_pc - pc);
+            pc = next_pc;
+            store_state();
+            if (const StopReason reason = run_loop(1); reason != StopReason::BUDGET_EXHAUSTED)
+                return reason;
+            load_state();
+            budget -= 1;
+            continue;
+        }
+
+        // Without the JIT, a store to a device also ends the block early
+        // when the VM stops on device writes.
+        std::size_t executed = 0;
+        for (const DecodedInstruction& inst : block.body) {
+            if (inst.handler == H_store && m_stop_on_device_write && is_device_address(regs[inst.rs1]))
+                break;
+
+            ++executed;
+            switch (inst.handler) {
+#define BINARY_INSTRUCTION(name, func)                                         \
+    case H_alu_##name:                                                         \
+        regs[inst.rd] = alu_##name(regs[inst.rs1], regs[inst.rs2], flags); \
+        break;
+#include "instructions.def"
+            case H_lsl:
+                regs[inst.rd] = shift_lsl(regs[inst.rs1], regs[inst.rs2]);
+                break;
+            case H_asr:
+                regs[inst.rd] = shift_asr(regs[inst.rs1], regs[inst.rs2]);
+                break;
+            case H_lsr:
+                regs[inst.rd] = shift_lsr(regs[inst.rs1], regs[inst.rs2]);
+                break;
+            case H_load:
+                if (state.copy_on_write != nullptr) [[unlikely]]
+                    m_copy_on_write.access(m_ram, m_written_pages, regs[inst.rs1]);
+                regs[inst.rd] = m_mmio.load(state.ram, regs[inst.rs1]);
+                break;
+            case H_loadi:
+                regs[inst.rd] = regs[inst.rs1] + inst.imm;
+                break;
+            case H_store:
+                if (state.copy_on_write != nullptr) [[unlikely]]
+                    m_copy_on_write.access(m_ram, m_written_pages, regs[inst.rs1]);
+                if (state.track_written_pages)
+                    m_written_pages.add(regs[inst.rs1]);
+                m_mmio.store(state.ram, regs[inst.rs1], regs[inst.rs2]);
+                break;
+            default:
+                break;
+            }
+        }
+
+        if (executed < block.body.size()) {
+            budget -= executed;
+            retire(executed);
+            pc += executed;
+            store_state();
+            if (const StopReason reason = run_loop(1); reason != StopReason::BUDGET_EXHAUSTED)
+                return reason;
+            load_state();
+            budget -= 1;
+            continue;
+        }
+
+        // Counted before the interpreter takes over the instruction after a
+        // block without terminator, which may stop the run.
+        pc += block.body.size();
+        budget -= block.length();
+        retire(block.length());
+
+        if (block.has_terminator) {
+            const DecodedInstruction& inst = block.terminator;
+            switch (inst.handler) {
+            case H_jmp:
+                pc = regs[inst.rs1];
+                break;
+            case H_jmpc:
+                pc = flags.test(inst.select) ? regs[inst.rs1] : pc + 1;
+                break;
+            case H_jmpi:
+                pc = inst.imm;
+                break;
+            case H_jmpic:
+                pc = flags.test(inst.select) ? inst.imm : pc + 1;
+                break;
+            default:
+                break;
+            }
+        } else if (budget > 0) {
+            // A breakpoint or an invalid instruction, only the interpreter
+            // knows how to handle them.
+            store_state();
+            if (const StopReason reason = run_loop(1); reason != StopReason::BUDGET_EXHAUSTED)
+                return reason;
+            load_state();
+            budget -= 1;
+        }
+    }
+
+    store_state();
+    return StopReason::BUDGET_EXHAUSTED;
+}
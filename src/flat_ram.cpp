@@ -0,0 +1,229 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "flat_ram.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define CPULM_FLAT_RAM_MMAP 1
+#else
+#define CPULM_FLAT_RAM_MMAP 0
+#endif
+
+const word_t FlatRam::ZERO_PAGE[PAGE_WORDS] = {};
+
+FlatRam::FlatRam(ram_t* sparse, bool use_huge_pages)
+    : m_sparse(sparse)
+    , m_use_huge_pages(use_huge_pages)
+    , m_directory(std::make_unique<std::unique_ptr<Table>[]>(DIRECTORY_SIZE)) {
+}
+
+FlatRam::~FlatRam() {
+    for (const Chunk& chunk : m_chunks) {
+#if CPULM_FLAT_RAM_MMAP
+        munmap(chunk.memory, chunk.size);
+#else
+        std::free(chunk.memory);
+#endif
+    }
+}
+
+void FlatRam::map_image(MappedFile image) {
+    // The words past the address space are ignored.
+    const std::size_t page_count = std::min((image.size() + PAGE_WORDS - 1) / PAGE_WORDS, DIRECTORY_SIZE * TABLE_SIZE);
+    for (std::size_t i = 0; i < page_count; ++i) {
+        const addr_t page_number = addr_t(i);
+        word_t* const words = image.data() + i * PAGE_WORDS;
+        const std::size_t word_count = std::min<std::size_t>(PAGE_WORDS, image.size() - i * PAGE_WORDS);
+
+        auto& table = m_directory[page_number >> TABLE_BITS];
+        if (table == nullptr)
+            table = std::make_unique<Table>(Table {});
+
+        word_t*& page = (*table)[page_number & (TABLE_SIZE - 1)];
+        if (page == nullptr && word_count == PAGE_WORDS && !m_sparse_pages.contains(page_number)) {
+            page = words;
+            invalidate(page_number);
+            continue;
+        }
+
+        write_range(addr_t(i * PAGE_WORDS), std::span<const word_t>(words, word_count));
+    }
+
+    m_images.push_back(std::move(image));
+}
+
+void FlatRam::add_sparse_range(addr_t begin, addr_t end) {
+    for (std::uint64_t page = begin >> PAGE_BITS; page <= (end >> PAGE_BITS); ++page) {
+        m_sparse_pages.insert(addr_t(page));
+        invalidate(addr_t(page));
+    }
+}
+
+void FlatRam::invalidate(addr_t page) {
+    if (m_read_tlb[page % TLB_SIZE].page == page)
+        m_read_tlb[page % TLB_SIZE] = {};
+    if (m_write_tlb[page % TLB_SIZE].page == page)
+        m_write_tlb[page % TLB_SIZE] = {};
+}
+
+word_t FlatRam::get_slow(addr_t addr) const {
+    const addr_t page_number = addr >> PAGE_BITS;
+    if (m_sparse_pages.contains(page_number))
+        return ram_get(m_sparse, addr);
+
+    // A page never written reads as the zero page until it is created.
+    m_read_tlb[page_number % TLB_SIZE] = { page_number, ZERO_PAGE };
+    return 0;
+}
+
+void FlatRam::set_slow(addr_t addr, word_t word) {
+    const addr_t page_number = addr >> PAGE_BITS;
+    if (m_sparse_pages.contains(page_number)) {
+        ram_set(m_sparse, addr, word);
+        return;
+    }
+
+    // Storing a zero to a page never written changes nothing.
+    if (word == 0)
+        return;
+
+    word_t* page = create_page(page_number);
+    if (page == nullptr)
+        ram_set(m_sparse, addr, word);
+    else
+        page[addr & (PAGE_WORDS - 1)] = word;
+}
+
+word_t* FlatRam::create_page(addr_t page_number) {
+    auto& table = m_directory[page_number >> TABLE_BITS];
+    if (table == nullptr)
+        table = std::make_unique<Table>(Table {});
+
+    word_t* page = allocate_page();
+    if (page == nullptr) {
+        // The host is out of memory, SparseMemory may still find some.
+        m_sparse_pages.insert(page_number);
+        invalidate(page_number);
+        return nullptr;
+    }
+
+    // The read TLB may map the page to the zero page.
+    (*table)[page_number & (TABLE_SIZE - 1)] = page;
+    m_read_tlb[page_number % TLB_SIZE] = { page_number, page };
+    m_write_tlb[page_number % TLB_SIZE] = { page_number, page };
+    return page;
+}
+
+void FlatRam::read_range(addr_t addr, std::span<word_t> words) const {
+    for (std::size_t done = 0; done < words.size();) {
+        const addr_t offset = addr & (PAGE_WORDS - 1);
+        const std::size_t length = std::min<std::size_t>(words.size() - done, PAGE_WORDS - offset);
+        word_t* const out = words.data() + done;
+        if (const word_t* page = find_page(addr)) {
+            std::memcpy(out, page + offset, length * sizeof(word_t));
+        } else if (m_sparse_pages.contains(addr >> PAGE_BITS)) {
+            for (std::size_t i = 0; i < length; ++i)
+                out[i] = ram_get(m_sparse, addr_t(addr + i));
+        } else {
+            std::fill_n(out, length, 0);
+        }
+
+        addr = addr_t(addr + length);
+        done += length;
+    }
+}
+
+void FlatRam::write_range(addr_t addr, std::span<const word_t> words) {
+    for (std::size_t done = 0; done < words.size();) {
+        const addr_t page_number = addr >> PAGE_BITS;
+        const addr_t offset = addr & (PAGE_WORDS - 1);
+        const std::size_t length = std::min<std::size_t>(words.size() - done, PAGE_WORDS - offset);
+        const word_t* const in = words.data() + done;
+        // As for set(), zeroes do not create the page.
+        word_t* page = find_page(addr);
+        if (page == nullptr && !m_sparse_pages.contains(page_number)
+            && std::any_of(in, in + length, [](word_t word) { return word != 0; }))
+            page = create_page(page_number);
+
+        if (page != nullptr) {
+            std::memcpy(page + offset, in, length * sizeof(word_t));
+        } else if (m_sparse_pages.contains(page_number)) {
+            for (std::size_t i = 0; i < length; ++i)
+                ram_set(m_sparse, addr_t(addr + i), in[i]);
+        }
+
+        addr = addr_t(addr + length);
+        done += length;
+    }
+}
+
+void FlatRam::fill(addr_t addr, word_t word, std::size_t count) {
+    for (std::size_t done = 0; done < count;) {
+        const addr_t page_number = addr >> PAGE_BITS;
+        const addr_t offset = addr & (PAGE_WORDS - 1);
+        const std::size_t length = std::min<std::size_t>(count - done, PAGE_WORDS - offset);
+        word_t* page = find_page(addr);
+        if (page == nullptr && !m_sparse_pages.contains(page_number) && word != 0)
+            page = create_page(page_number);
+
+        if (page != nullptr) {
+            std::fill_n(page + offset, length, word);
+        } else if (m_sparse_pages.contains(page_number)) {
+            for (std::size_t i = 0; i < length; ++i)
+                ram_set(m_sparse, addr_t(addr + i), word);
+        }
+
+        addr = addr_t(addr + length);
+        done += length;
+    }
+}
+
+void FlatRam::copy(addr_t destination, addr_t source, std::size_t count) {
+    copy_words(
+        destination, source, count,
+        [this](addr_t addr, std::span<word_t> words) { read_range(addr, words); },
+        [this](addr_t addr, std::span<const word_t> words) { write_range(addr, words); });
+}
+
+word_t* FlatRam::allocate_page() {
+    constexpr std::size_t page_size = PAGE_WORDS * sizeof(word_t);
+    if (m_chunk_used == CHUNK_SIZE) {
+#if CPULM_FLAT_RAM_MMAP
+        // Maps twice the size to align the chunk on a huge page, then gives
+        // back the unaligned ends. The memory is zero until written.
+        void* mapping = mmap(nullptr, 2 * CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+            return nullptr;
+
+        auto* const begin = static_cast<std::uint8_t*>(mapping);
+        auto* const aligned = reinterpret_cast<std::uint8_t*>((reinterpret_cast<std::uintptr_t>(begin) + CHUNK_SIZE - 1) & ~std::uintptr_t(CHUNK_SIZE - 1));
+        if (aligned != begin)
+            munmap(begin, aligned - begin);
+        if (aligned + CHUNK_SIZE != begin + 2 * CHUNK_SIZE)
+            munmap(aligned + CHUNK_SIZE, begin + 2 * CHUNK_SIZE - (aligned + CHUNK_SIZE));
+#ifdef MADV_HUGEPAGE
+        if (m_use_huge_pages)
+            madvise(aligned, CHUNK_SIZE, MADV_HUGEPAGE);
+#endif
+        m_chunks.push_back({ aligned, CHUNK_SIZE });
+#else
+        void* memory = std::calloc(1, CHUNK_SIZE);
+        if (memory == nullptr)
+            return nullptr;
+        m_chunks.push_back({ memory, CHUNK_SIZE });
+#endif
+        m_chunk_used = 0;
+    }
+
+    auto* const page = reinterpret_cast<word_t*>(static_cast<std::uint8_t*>(m_chunks.back().memory) + m_chunk_used);
+    m_chunk_used += page_size;
+    ++m_page_count;
+    return page;
+}
@@ -0,0 +1,289 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#ifndef ASM_VM_FLAT_RAM_HPP
+#define ASM_VM_FLAT_RAM_HPP
+
+#include "mapped_file.hpp"
+#include "memory.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <span>
+#include <vector>
+
+/// A RAM stored as plain host pages, in front of a SparseMemory RAM, see
+/// RamBackend::FLAT.
+///
+/// The address space is split into pages of PAGE_WORDS words (4 KiB) found
+/// through a two-level table: a directory of DIRECTORY_SIZE tables of
+/// TABLE_SIZE pages each, allocated when first touched. A page is allocated
+/// on the first store to it, loads from pages never written return zero.
+///
+/// In front of the table, a small direct-mapped TLB per access kind maps the
+/// page numbers recently accessed to their memory, so that the loads and
+/// stores that hit it are a compare and an indexed access. The read TLB maps
+/// the pages never written to a shared zero page, and is updated when such a
+/// page is created. The pages left to SparseMemory never enter the TLB.
+///
+/// The pages are carved out of chunks of CHUNK_SIZE bytes, aligned so that
+/// the host can back each chunk with one huge page (see madvise(2) on
+/// Linux). The memory of a chunk is only committed by the host when touched.
+///
+/// The pages added with add_sparse_range(), that is the pages that the
+/// devices write through SparseMemory (see time_device.h), are not covered:
+/// their loads and stores go to the SparseMemory RAM, as do the pages that
+/// could not be allocated.
+class FlatRam {
+public:
+    static constexpr unsigned PAGE_BITS = 10;
+    static constexpr addr_t PAGE_WORDS = addr_t(1) << PAGE_BITS;
+    static constexpr unsigned TABLE_BITS = 11;
+    static constexpr std::size_t TABLE_SIZE = std::size_t(1) << TABLE_BITS;
+    static constexpr unsigned DIRECTORY_BITS = 32 - PAGE_BITS - TABLE_BITS;
+    static constexpr std::size_t DIRECTORY_SIZE = std::size_t(1) << DIRECTORY_BITS;
+    /// 2 MiB, the size of a huge page on x86-64 and most AArch64 hosts.
+    static constexpr std::size_t CHUNK_SIZE = std::size_t(2) << 20;
+
+    /// Creates an empty flat RAM in front of @a sparse, which it does not own.
+    /// With @a use_huge_pages, the host is asked to back the chunks with huge
+    /// pages.
+    FlatRam(ram_t* sparse, bool use_huge_pages);
+    ~FlatRam();
+
+    FlatRam(const FlatRam&) = delete;
+    FlatRam& operator=(const FlatRam&) = delete;
+
+    [[nodiscard]] word_t get(addr_t addr) const {
+        const addr_t page = addr >> PAGE_BITS;
+        const TlbEntry<const word_t>& entry = m_read_tlb[page % TLB_SIZE];
+        if (entry.page == page) [[likely]]
+            return entry.memory[addr & (PAGE_WORDS - 1)];
+        return get_miss(addr);
+    }
+
+    void set(addr_t addr, word_t word) {
+        const addr_t page = addr >> PAGE_BITS;
+        const TlbEntry<word_t>& entry = m_write_tlb[page % TLB_SIZE];
+        if (entry.page == page) [[likely]]
+            entry.memory[addr & (PAGE_WORDS - 1)] = word;
+        else
+            set_miss(addr, word);
+    }
+
+    /// Copies the words from @a addr to @a words, a page at a time. The range
+    /// must not wrap around the address space, nor must the ranges of the
+    /// other bulk accesses below.
+    void read_range(addr_t addr, std::span<word_t> words) const;
+    /// Copies @a words to the words from @a addr. The pages never written
+    /// are only allocated if they receive a non zero word.
+    void write_range(addr_t addr, std::span<const word_t> words);
+    /// Sets the @a count words from @a addr to @a word.
+    void fill(addr_t addr, word_t word, std::size_t count);
+    /// Copies the @a count words from @a source to @a destination, the
+    /// ranges may overlap.
+    void copy(addr_t destination, addr_t source, std::size_t count);
+
+    /// Makes the words of @a image, mapped writable, the words of the RAM from
+    /// the address 0. The pages of the image are used in place, so they are
+    /// only read from the file when accessed and only copied, by the host,
+    /// when written. The pages already allocated or left to SparseMemory, and
+    /// a last partial page, are copied instead.
+    void map_image(MappedFile image);
+
+    /// Leaves the pages of the words @a begin to @a end (included) to the
+    /// SparseMemory RAM. Must be called before these pages are written.
+    void add_sparse_range(addr_t begin, addr_t end);
+    /// Returns true if the page @a page is left to the SparseMemory RAM.
+    [[nodiscard]] bool is_sparse(addr_t page) const { return m_sparse_pages.contains(page); }
+
+    [[nodiscard]] ram_t* get_sparse() const { return m_sparse; }
+    /// Returns the count of pages allocated.
+    [[nodiscard]] std::size_t get_page_count() const { return m_page_count; }
+
+private:
+    using Table = std::array<word_t*, TABLE_SIZE>;
+
+    template<class Word>
+    struct TlbEntry {
+        addr_t page = NO_PAGE;
+        Word* memory = nullptr;
+    };
+
+    static constexpr std::size_t TLB_SIZE = 64;
+    /// Page numbers are below 2^22, so this is never a valid one.
+    static constexpr addr_t NO_PAGE = UINT32_MAX;
+    /// The memory of the pages never written, in the read TLB.
+    static const word_t ZERO_PAGE[PAGE_WORDS];
+
+    [[nodiscard]] word_t* find_page(addr_t addr) const {
+        const Table* table = m_directory[addr >> (PAGE_BITS + TABLE_BITS)].get();
+        if (table == nullptr) [[unlikely]]
+            return nullptr;
+        return (*table)[(addr >> PAGE_BITS) & (TABLE_SIZE - 1)];
+    }
+
+    /// Looks the page of @a addr up in the table and fills the TLB.
+    [[nodiscard]] word_t get_miss(addr_t addr) const {
+        const addr_t page_number = addr >> PAGE_BITS;
+        const word_t* page = find_page(addr);
+        if (page == nullptr) [[unlikely]]
+            return get_slow(addr);
+
+        m_read_tlb[page_number % TLB_SIZE] = { page_number, page };
+        return page[addr & (PAGE_WORDS - 1)];
+    }
+
+    void set_miss(addr_t addr, word_t word) {
+        const addr_t page_number = addr >> PAGE_BITS;
+        word_t* page = find_page(addr);
+        if (page == nullptr) [[unlikely]] {
+            set_slow(addr, word);
+            return;
+        }
+
+        m_write_tlb[page_number % TLB_SIZE] = { page_number, page };
+        page[addr & (PAGE_WORDS - 1)] = word;
+    }
+
+    /// For the pages not in the table: pages never written or left to
+    /// SparseMemory.
+    [[nodiscard]] word_t get_slow(addr_t addr) const;
+    void set_slow(addr_t addr, word_t word);
+    /// Removes the page @a page from both TLB.
+    void invalidate(addr_t page);
+    /// Allocates the page @a page_number, never written, and fills both TLB.
+    /// Returns nullptr and leaves the page to SparseMemory if the host has
+    /// no memory left.
+    word_t* create_page(addr_t page_number);
+    /// Returns the memory of a new zeroed page, or nullptr if the host has
+    /// none left.
+    word_t* allocate_page();
+
+    struct Chunk {
+        void* memory;
+        std::size_t size;
+    };
+
+    ram_t* m_sparse;
+    bool m_use_huge_pages;
+    mutable std::array<TlbEntry<const word_t>, TLB_SIZE> m_read_tlb;
+    std::array<TlbEntry<word_t>, TLB_SIZE> m_write_tlb;
+    std::unique_ptr<std::unique_ptr<Table>[]> m_directory;
+    std::set<addr_t> m_sparse_pages;
+    std::vector<Chunk> m_chunks;
+    /// The images that hold some of the pages, see map_image().
+    std::vector<MappedFile> m_images;
+    /// The bytes of m_chunks.back() already given to pages.
+    std::size_t m_chunk_used = CHUNK_SIZE;
+    std::size_t m_page_count = 0;
+};
+
+/// Copies the @a count words from @a source to @a destination by pages,
+/// through a buffer, with @a read(addr, words) and @a write(addr, words) that
+/// take a span. When the ranges overlap, they are walked in the direction
+/// that reads each word before it is overwritten.
+template<class Read, class Write>
+void copy_words(addr_t destination, addr_t source, std::size_t count, Read read, Write write) {
+    word_t buffer[FlatRam::PAGE_WORDS];
+    if (destination <= source || std::uint64_t(source) + count <= destination) {
+        for (std::size_t done = 0; done < count;) {
+            const std::size_t length = std::min<std::size_t>(count - done, FlatRam::PAGE_WORDS);
+            read(addr_t(source + done), std::span<word_t>(buffer, length));
+            write(addr_t(destination + done), std::span<const word_t>(buffer, length));
+            done += length;
+        }
+    } else {
+        for (std::size_t left = count; left > 0;) {
+            const std::size_t length = std::min<std::size_t>(left, FlatRam::PAGE_WORDS);
+            left -= length;
+            read(addr_t(source + left), std::span<word_t>(buffer, length));
+            write(addr_t(destination + left), std::span<const word_t>(buffer, length));
+        }
+    }
+}
+
+/// Calls @a write(offset, words) for each run of non zero words of @a words,
+/// with its offset in @a words. The hosts that copy pages write only these,
+/// as a store of zero allocates the page in SparseMemory like any other.
+template<class Write>
+void for_each_nonzero_run(std::span<const word_t> words, Write write) {
+    std::size_t i = 0;
+    while (i < words.size()) {
+        if (words[i] == 0) {
+            ++i;
+            continue;
+        }
+
+        const std::size_t begin = i;
+        while (i < words.size() && words[i] != 0)
+            ++i;
+        write(begin, words.subspan(begin, i - begin));
+    }
+}
+
+/// The RAM of a VM: its SparseMemory RAM, behind a FlatRam when the flat
+/// backend is selected (see VM::set_ram_backend()).
+///
+/// SparseMemory only has word accesses, so the bulk accesses to it are loops
+/// of ram_get() and ram_set(), and its write listeners see each word.
+struct RamRef {
+    ram_t* sparse = nullptr;
+    FlatRam* flat = nullptr;
+
+    [[nodiscard]] word_t get(addr_t addr) const {
+        return flat != nullptr ? flat->get(addr) : ram_get(sparse, addr);
+    }
+
+    void set(addr_t addr, word_t word) const {
+        if (flat != nullptr)
+            flat->set(addr, word);
+        else
+            ram_set(sparse, addr, word);
+    }
+
+    void read_range(addr_t addr, std::span<word_t> words) const {
+        if (flat != nullptr) {
+            flat->read_range(addr, words);
+            return;
+        }
+        for (std::size_t i = 0; i < words.size(); ++i)
+            words[i] = ram_get(sparse, addr_t(addr + i));
+    }
+
+    void write_range(addr_t addr, std::span<const word_t> words) const {
+        if (flat != nullptr) {
+            flat->write_range(addr, words);
+            return;
+        }
+        for (std::size_t i = 0; i < words.size(); ++i)
+            ram_set(sparse, addr_t(addr + i), words[i]);
+    }
+
+    void fill(addr_t addr, word_t word, std::size_t count) const {
+        if (flat != nullptr) {
+            flat->fill(addr, word, count);
+            return;
+        }
+        for (std::size_t i = 0; i < count; ++i)
+            ram_set(sparse, addr_t(addr + i), word);
+    }
+
+    void copy(addr_t destination, addr_t source, std::size_t count) const {
+        if (flat != nullptr) {
+            flat->copy(destination, source, count);
+            return;
+        }
+        copy_words(
+            destination, source, count,
+            [this](addr_t addr, std::span<word_t> words) { read_range(addr, words); },
+            [this](addr_t addr, std::span<const word_t> words) { write_range(addr, words); });
+    }
+};
+
+#endif // ASM_VM_FLAT_RAM_HPP
@@ -0,0 +1,34 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "guest_scheduler.hpp"
+
+GuestTask run_guest(VM& vm, std::uint64_t slice) {
+    vm.set_stop_on_device_write(true);
+    while (true) {
+        const StopReason reason = vm.run(slice);
+        if (reason == StopReason::HALTED || reason == StopReason::ERROR)
+            co_return reason;
+        co_yield reason;
+    }
+}
+
+std::size_t GuestScheduler::spawn(GuestTask task) {
+    m_guests.push_back(std::move(task));
+    return m_guests.size() - 1;
+}
+
+void GuestScheduler::run() {
+    for (std::size_t i = 0; i < m_guests.size(); ++i)
+        schedule(i);
+    m_pool.wait();
+}
+
+void GuestScheduler::schedule(std::size_t index) {
+    m_pool.submit([this, index] {
+        m_resume_count.fetch_add(1, std::memory_order_relaxed);
+        if (m_guests[index].resume())
+            schedule(index);
+    });
+}
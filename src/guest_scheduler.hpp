@@ -0,0 +1,112 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#ifndef ASM_VM_GUEST_SCHEDULER_HPP
+#define ASM_VM_GUEST_SCHEDULER_HPP
+
+#include "thread_pool.hpp"
+#include "vm.hpp"
+
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <utility>
+#include <vector>
+
+/// A guest program driven as a coroutine.
+///
+/// The coroutine is suspended at its start and each time it yields, it is
+/// the job of the caller (usually a GuestScheduler) to resume it. A task
+/// owns its coroutine and is movable but not copyable.
+class GuestTask {
+public:
+    struct promise_type {
+        StopReason reason = StopReason::BUDGET_EXHAUSTED;
+
+        GuestTask get_return_object() { return GuestTask(handle_type::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(StopReason value) noexcept {
+            reason = value;
+            return {};
+        }
+        void return_value(StopReason value) noexcept { reason = value; }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    GuestTask() = default;
+    GuestTask(GuestTask&& other) noexcept
+        : m_handle(std::exchange(other.m_handle, nullptr)) { }
+    GuestTask& operator=(GuestTask&& other) noexcept {
+        if (this != &other) {
+            if (m_handle)
+                m_handle.destroy();
+            m_handle = std::exchange(other.m_handle, nullptr);
+        }
+        return *this;
+    }
+    ~GuestTask() {
+        if (m_handle)
+            m_handle.destroy();
+    }
+
+    /// Runs the guest until its next yield, returns false once it is done.
+    bool resume() {
+        if (done())
+            return false;
+        m_handle.resume();
+        return !done();
+    }
+
+    [[nodiscard]] bool done() const { return !m_handle || m_handle.done(); }
+    /// Returns the reason of the last yield, or of the end of the guest.
+    [[nodiscard]] StopReason last_reason() const { return m_handle.promise().reason; }
+
+private:
+    explicit GuestTask(handle_type handle)
+        : m_handle(handle) { }
+
+    handle_type m_handle = nullptr;
+};
+
+/// Runs @a vm as a coroutine that yields every @a slice instructions, after
+/// each store to a device and on breakpoints and watchpoints. It ends when
+/// the program halts or on an error. The VM must outlive the task.
+GuestTask run_guest(VM& vm, std::uint64_t slice);
+
+/// Multiplexes many guests over a fixed-size ThreadPool.
+///
+/// Each time a guest yields it goes back to the end of the queue of its
+/// worker, so the guests of a worker are run round-robin and a single
+/// thread can interleave thousands of them without any context switch of
+/// the host. Idle workers steal guests from the busy ones.
+class GuestScheduler {
+public:
+    explicit GuestScheduler(std::size_t thread_count = std::thread::hardware_concurrency())
+        : m_pool(thread_count) { }
+
+    /// Adds a guest, returns its index. Must not be called during run().
+    std::size_t spawn(GuestTask task);
+    /// Runs all the guests until they are done.
+    void run();
+
+    [[nodiscard]] std::size_t size() const { return m_guests.size(); }
+    [[nodiscard]] std::size_t get_thread_count() const { return m_pool.size(); }
+    /// Returns how the guest @a index ended, once run() returned.
+    [[nodiscard]] StopReason get_result(std::size_t index) const { return m_guests[index].last_reason(); }
+    /// Returns the count of times a guest was resumed during run().
+    [[nodiscard]] std::uint64_t get_resume_count() const { return m_resume_count.load(std::memory_order_relaxed); }
+
+private:
+    void schedule(std::size_t index);
+
+    ThreadPool m_pool;
+    std::vector<GuestTask> m_guests;
+    std::atomic<std::uint64_t> m_resume_count = 0;
+};
+
+#endif // ASM_VM_GUEST_SCHEDULER_HPP
@@ -0,0 +1,276 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "history.hpp"
+#include "time_device.h"
+
+#include <algorithm>
+#include <cstring>
+
+void ExecutionHistory::record_store_slow(RamRef ram, addr_t addr) {
+    if (VM::is_time_device_address(addr)) {
+        for (addr_t device_addr = VM::TIME_DEVICE_BEGIN; device_addr <= VM::TIME_DEVICE_END; ++device_addr)
+            push_store({ device_addr, ram.get(device_addr) });
+    } else {
+        push_store({ addr, ram.get(addr) });
+    }
+}
+
+void ExecutionHistory::push_store(StoreRecord record) {
+    if (m_store_tail == m_store_chunk_end) {
+        m_store_chunks.push_back(std::make_unique<StoreRecord[]>(STORE_CHUNK_SIZE));
+        m_store_tail = m_store_chunks.back().get();
+        m_store_chunk_end = m_store_tail + STORE_CHUNK_SIZE;
+    }
+
+    *m_store_tail++ = record;
+}
+
+std::size_t ExecutionHistory::get_store_count() const {
+    if (m_store_chunks.empty())
+        return 0;
+
+    return (m_store_chunks.size() - 1) * STORE_CHUNK_SIZE + (m_store_tail - m_store_chunks.back().get()) - m_store_head;
+}
+
+void ExecutionHistory::add_checkpoint(Checkpoint checkpoint) {
+    checkpoint.first_store = m_first_store + get_store_count();
+    if (!m_checkpoints.empty() && m_checkpoints.back().instruction_count == checkpoint.instruction_count) {
+        // Only the registers may have changed since, the stores and the tick
+        // already logged stay after the checkpoint.
+        Checkpoint& last = m_checkpoints.back();
+        checkpoint.first_store = last.first_store;
+        checkpoint.tick_checked = last.tick_checked;
+        checkpoint.ticked = last.ticked;
+        last = checkpoint;
+        return;
+    }
+
+    m_checkpoints.push_back(checkpoint);
+    while (m_checkpoints.size() > 1 && get_memory_usage() > m_memory_limit) {
+        m_checkpoints.pop_front();
+        const std::uint64_t first_kept = m_checkpoints.front().first_store;
+        m_store_head += first_kept - m_first_store;
+        m_first_store = first_kept;
+        while (m_store_head >= STORE_CHUNK_SIZE && m_store_chunks.size() > 1) {
+            m_store_chunks.pop_front();
+            m_store_head -= STORE_CHUNK_SIZE;
+        }
+    }
+}
+
+std::size_t ExecutionHistory::find_checkpoint(std::uint64_t instruction_count) const {
+    const auto it = std::upper_bound(m_checkpoints.begin(), m_checkpoints.end(), instruction_count,
+        [](std::uint64_t count, const Checkpoint& checkpoint) { return count < checkpoint.instruction_count; });
+    return it == m_checkpoints.begin() ? 0 : std::size_t(it - m_checkpoints.begin() - 1);
+}
+
+bool ExecutionHistory::pop_store(std::size_t index, StoreRecord& record) {
+    if (m_first_store + get_store_count() <= m_checkpoints[index].first_store)
+        return false;
+
+    if (m_store_tail == m_store_chunks.back().get()) {
+        m_store_chunks.pop_back();
+        m_store_chunk_end = m_store_chunks.back().get() + STORE_CHUNK_SIZE;
+        m_store_tail = m_store_chunk_end;
+    }
+
+    record = *--m_store_tail;
+    return true;
+}
+
+void ExecutionHistory::truncate(std::size_t index, std::uint64_t replay_end) {
+    m_replay_ticks.clear();
+    for (std::size_t i = index; i < m_checkpoints.size(); ++i) {
+        const Checkpoint& checkpoint = m_checkpoints[i];
+        if (checkpoint.ticked && checkpoint.instruction_count < replay_end)
+            m_replay_ticks.push_back(checkpoint.instruction_count);
+    }
+
+    m_checkpoints.erase(m_checkpoints.begin() + index + 1, m_checkpoints.end());
+    m_checkpoints.back().tick_checked = false;
+    m_checkpoints.back().ticked = false;
+}
+
+bool ExecutionHistory::take_replay_tick(std::uint64_t instruction_count) {
+    const auto it = std::lower_bound(m_replay_ticks.begin(), m_replay_ticks.end(), instruction_count);
+    if (it == m_replay_ticks.end() || *it != instruction_count)
+        return false;
+
+    m_replay_ticks.erase(it);
+    return true;
+}
+
+namespace {
+/// Replays the program as it was executed: the breakpoints, the watchpoints
+/// and the stops on device writes are ignored and the ticks come from the
+/// history.
+class ReplayScope {
+public:
+    ReplayScope(ExecutionHistory& history, const DecodedInstruction*& program, const DecodedInstruction* original_program,
+        std::set<addr_t>& watchpoints, bool& stop_on_device_write)
+        : m_history(history)
+        , m_program(program)
+        , m_saved_program(program)
+        , m_watchpoints(watchpoints)
+        , m_saved_watchpoints(std::move(watchpoints))
+        , m_stop_on_device_write(stop_on_device_write)
+        , m_saved_stop_on_device_write(stop_on_device_write) {
+        m_history.set_replaying(true);
+        m_program = original_program;
+        m_watchpoints.clear();
+        m_stop_on_device_write = false;
+    }
+
+    ~ReplayScope() {
+        m_history.set_replaying(false);
+        m_program = m_saved_program;
+        m_watchpoints = std::move(m_saved_watchpoints);
+        m_stop_on_device_write = m_saved_stop_on_device_write;
+    }
+
+    ReplayScope(const ReplayScope&) = delete;
+    ReplayScope& operator=(const ReplayScope&) = delete;
+
+private:
+    ExecutionHistory& m_history;
+    const DecodedInstruction*& m_program;
+    const DecodedInstruction* m_saved_program;
+    std::set<addr_t>& m_watchpoints;
+    std::set<addr_t> m_saved_watchpoints;
+    bool& m_stop_on_device_write;
+    bool m_saved_stop_on_device_write;
+};
+} // namespace
+
+const char* VM::enable_history(std::size_t memory_limit) {
+    if (m_input_log != nullptr)
+        return "the execution history cannot be recorded while the inputs are logged";
+    if (m_virtual_clock != 0)
+        return "the execution history is not supported with the virtual clock";
+
+    m_history = std::make_unique<ExecutionHistory>(memory_limit);
+    take_checkpoint();
+    return nullptr;
+}
+
+void VM::disable_history() {
+    m_history.reset();
+}
+
+StopReason VM::run_recorded(std::uint64_t budget) {
+    constexpr std::uint64_t interval = ExecutionHistory::CHECKPOINT_INTERVAL;
+    while (budget > 0) {
+        if (m_instruction_count % interval == 0 || !m_history->last_checkpoint().tick_checked)
+            take_checkpoint();
+
+        const std::uint64_t instruction_count = m_instruction_count;
+        const StopReason reason = run_loop(std::min(budget, interval - instruction_count % interval));
+        budget -= m_instruction_count - instruction_count;
+        if (reason != StopReason::BUDGET_EXHAUSTED)
+            return reason;
+    }
+
+    return StopReason::BUDGET_EXHAUSTED;
+}
+
+void VM::take_checkpoint() {
+    ExecutionHistory::Checkpoint checkpoint;
+    checkpoint.instruction_count = m_instruction_count;
+    checkpoint.pc = m_pc;
+    std::memcpy(checkpoint.regs, m_regs, sizeof(m_regs));
+    checkpoint.flags = m_flags;
+    m_history->add_checkpoint(checkpoint);
+
+    ExecutionHistory::Checkpoint& last = m_history->last_checkpoint();
+    if (last.tick_checked)
+        return;
+
+    last.tick_checked = true;
+    if (!m_drives_clock)
+        return;
+
+    const bool tick = m_history->is_replaying() ? m_history->take_replay_tick(m_instruction_count) : second_elapsed();
+    if (tick) {
+        m_history->record_store(ram_ref(), TIME_DEVICE_BEGIN);
+        time_device_tick(m_ram);
+        last.ticked = true;
+    }
+}
+
+void VM::rewind_to_checkpoint(std::size_t index, std::uint64_t replay_end) {
+    ExecutionHistory::StoreRecord record;
+    while (m_history->pop_store(index, record)) {
+        if (m_copy_on_write.is_active())
+            m_copy_on_write.access(m_ram, m_written_pages, record.addr);
+        ram_ref().set(record.addr, record.old_word);
+    }
+
+    const ExecutionHistory::Checkpoint& checkpoint = m_history->get_checkpoint(index);
+    m_instruction_count = checkpoint.instruction_count;
+    m_pc = checkpoint.pc;
+    std::memcpy(m_regs, checkpoint.regs, sizeof(m_regs));
+    m_flags = checkpoint.flags;
+    m_history->truncate(index, replay_end);
+}
+
+void VM::seek(std::uint64_t instruction_count) {
+    // The oldest checkpoints may have been dropped during a replay.
+    instruction_count = std::max(instruction_count, m_history->get_oldest_instruction_count());
+    rewind_to_checkpoint(m_history->find_checkpoint(instruction_count), instruction_count);
+
+    // A break of the ROM stops the replay without counting, carry on past it.
+    ReplayScope scope(*m_history, m_program, m_rom->get_decoded().data(), m_watchpoints, m_stop_on_device_write);
+    while (m_instruction_count < instruction_count) {
+        const StopReason reason = run_recorded(instruction_count - m_instruction_count);
+        if (reason == StopReason::ERROR || reason == StopReason::HALTED)
+            break;
+    }
+}
+
+std::uint64_t VM::step_back(std::uint64_t count) {
+    if (m_history == nullptr)
+        return 0;
+
+    const std::uint64_t oldest = m_history->get_oldest_instruction_count();
+    const std::uint64_t target = m_instruction_count - std::min(count, m_instruction_count - oldest);
+    const std::uint64_t undone = m_instruction_count - target;
+    if (undone > 0)
+        seek(target);
+    return undone;
+}
+
+bool VM::reverse_continue() {
+    if (m_history == nullptr)
+        return false;
+
+    // Replays the history one checkpoint at a time, from the newest one,
+    // looking for the last instruction at a breakpoint.
+    std::uint64_t end = m_instruction_count;
+    while (end > m_history->get_oldest_instruction_count()) {
+        const std::size_t index = m_history->find_checkpoint(end - 1);
+        const std::uint64_t begin = m_history->get_checkpoint(index).instruction_count;
+        rewind_to_checkpoint(index, end);
+
+        std::uint64_t hit = UINT64_MAX;
+        {
+            ReplayScope scope(*m_history, m_program, m_rom->get_decoded().data(), m_watchpoints, m_stop_on_device_write);
+            while (m_instruction_count < end) {
+                if (m_breakpoints.contains(m_pc))
+                    hit = m_instruction_count;
+                run_recorded(1);
+            }
+        }
+
+        if (hit != UINT64_MAX) {
+            seek(hit);
+            return true;
+        }
+
+        end = begin;
+    }
+
+    seek(end);
+    return false;
+}
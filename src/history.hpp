@@ -0,0 +1,126 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#ifndef ASM_VM_HISTORY_HPP
+#define ASM_VM_HISTORY_HPP
+
+#include "vm.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+/// The undo log of a VM, for reverse execution (see VM::enable_history()).
+///
+/// While the history is enabled, the VM takes a checkpoint of its pc,
+/// registers and flags every CHECKPOINT_INTERVAL instructions and logs the
+/// previous value of every RAM word it stores to. To go back to an earlier
+/// instruction, the logged RAM words are restored in reverse order down to
+/// the newest checkpoint before that instruction, then the program is
+/// replayed forward from the checkpoint. A step back thus replays at most
+/// CHECKPOINT_INTERVAL instructions.
+///
+/// The tick of the time device is only set at the checkpoints while the
+/// history is enabled, and the checkpoints remember it so that the replay
+/// sees the same ticks as the original execution.
+///
+/// The log is a ring: when it takes more memory than its limit, the oldest
+/// checkpoint and the stores logged after it are dropped.
+class ExecutionHistory {
+public:
+    static constexpr std::uint32_t CHECKPOINT_INTERVAL = VM::TICK_CHECK_INTERVAL;
+    static constexpr std::size_t DEFAULT_MEMORY_LIMIT = std::size_t(64) << 20;
+
+    struct Checkpoint {
+        std::uint64_t instruction_count = 0;
+        std::size_t pc = 0;
+        reg_t regs[VM::REG_SLOTS] = {};
+        LazyFlags flags;
+        /// The sequence number of the first store logged after this
+        /// checkpoint.
+        std::uint64_t first_store = 0;
+        /// The tick of the time device is checked once per checkpoint, right
+        /// after it is taken.
+        bool tick_checked = false;
+        bool ticked = false;
+    };
+
+    struct StoreRecord {
+        addr_t addr;
+        word_t old_word;
+    };
+
+    explicit ExecutionHistory(std::size_t memory_limit)
+        : m_memory_limit(memory_limit) { }
+
+    [[nodiscard]] std::size_t get_memory_limit() const { return m_memory_limit; }
+    /// Returns the memory taken by the checkpoints and the logged stores.
+    [[nodiscard]] std::size_t get_memory_usage() const {
+        return m_checkpoints.size() * sizeof(Checkpoint) + m_store_chunks.size() * STORE_CHUNK_SIZE * sizeof(StoreRecord);
+    }
+
+    /// Logs the value of the word @a addr of @a ram before a store to it.
+    void record_store(RamRef ram, addr_t addr) {
+        if (m_store_tail == m_store_chunk_end || VM::is_time_device_address(addr)) [[unlikely]]
+            record_store_slow(ram, addr);
+        else
+            *m_store_tail++ = { addr, ram.get(addr) };
+    }
+
+    /// Appends @a checkpoint, or replaces the last one if it has the same
+    /// instruction count. Drops the oldest checkpoints if the memory limit is
+    /// exceeded.
+    void add_checkpoint(Checkpoint checkpoint);
+    [[nodiscard]] Checkpoint& last_checkpoint() { return m_checkpoints.back(); }
+    [[nodiscard]] const Checkpoint& get_checkpoint(std::size_t index) const { return m_checkpoints[index]; }
+    [[nodiscard]] bool empty() const { return m_checkpoints.empty(); }
+    /// Returns the instruction count of the oldest instruction that can be
+    /// reached.
+    [[nodiscard]] std::uint64_t get_oldest_instruction_count() const { return m_checkpoints.front().instruction_count; }
+    /// Returns the index of the newest checkpoint at or before the
+    /// instruction count @a instruction_count, which must be reachable.
+    [[nodiscard]] std::size_t find_checkpoint(std::uint64_t instruction_count) const;
+
+    /// Pops the newest store logged after the checkpoint @a index into
+    /// @a record, returns false if there is none.
+    bool pop_store(std::size_t index, StoreRecord& record);
+    /// Forgets the checkpoints after @a index (once their stores are popped)
+    /// and remembers the ticks set before @a replay_end to replay them.
+    void truncate(std::size_t index, std::uint64_t replay_end);
+
+    /// While replaying, the ticks come from the log instead of the clock.
+    [[nodiscard]] bool is_replaying() const { return m_replaying; }
+    void set_replaying(bool replaying) { m_replaying = replaying; }
+    /// Returns true if the tick was set at the checkpoint of the instruction
+    /// count @a instruction_count in the replayed execution.
+    bool take_replay_tick(std::uint64_t instruction_count);
+
+private:
+    /// Logs a store to a device, which may change all of its words, or
+    /// starts a new chunk of records.
+    void record_store_slow(RamRef ram, addr_t addr);
+    void push_store(StoreRecord record);
+    [[nodiscard]] std::size_t get_store_count() const;
+
+    static constexpr std::size_t STORE_CHUNK_SIZE = 8192;
+
+    std::deque<Checkpoint> m_checkpoints;
+    /// The logged stores, in chunks of STORE_CHUNK_SIZE records so that
+    /// logging a store is only a bounds check and a write.
+    std::deque<std::unique_ptr<StoreRecord[]>> m_store_chunks;
+    /// The index of the oldest record in the first chunk.
+    std::size_t m_store_head = 0;
+    /// Where the next record goes, in the last chunk.
+    StoreRecord* m_store_tail = nullptr;
+    StoreRecord* m_store_chunk_end = nullptr;
+    /// The sequence number of the oldest record.
+    std::uint64_t m_first_store = 0;
+    std::size_t m_memory_limit;
+    /// The instruction counts of the ticks to replay, sorted.
+    std::vector<std::uint64_t> m_replay_ticks;
+    bool m_replaying = false;
+};
+
+#endif // ASM_VM_HISTORY_HPP
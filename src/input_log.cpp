@@ -0,0 +1,225 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "input_log.hpp"
+#include "time_device.h"
+
+#include <algorithm>
+#include <cstring>
+
+static constexpr std::uint32_t INPUT_LOG_MAGIC = 0x4c495043; // "CPIL"
+static constexpr std::uint32_t INPUT_LOG_VERSION = 1;
+static constexpr std::size_t INPUT_LOG_HEADER_WORDS = 6;
+static constexpr unsigned EVENT_KIND_BITS = 2;
+
+InputLog::~InputLog() {
+    if (m_file != nullptr)
+        std::fclose(m_file);
+}
+
+const char* InputLog::start_recording(const char* filename, std::uint64_t rom_hash, std::uint64_t start) {
+    m_file = std::fopen(filename, "wb");
+    if (m_file == nullptr)
+        return "cannot create the input log file";
+
+    const std::uint32_t header[INPUT_LOG_HEADER_WORDS] = {
+        INPUT_LOG_MAGIC, INPUT_LOG_VERSION,
+        std::uint32_t(rom_hash), std::uint32_t(rom_hash >> 32),
+        std::uint32_t(start), std::uint32_t(start >> 32)
+    };
+    if (std::fwrite(header, sizeof(std::uint32_t), INPUT_LOG_HEADER_WORDS, m_file) != INPUT_LOG_HEADER_WORDS
+        || std::fflush(m_file) != 0)
+        return "cannot write the input log file";
+
+    m_last_count = start;
+    return nullptr;
+}
+
+/// Reads a LEB128 varint from [it, end), returns false if it is truncated.
+static bool read_varint(const std::uint8_t*& it, const std::uint8_t* end, std::uint64_t& value) {
+    value = 0;
+    for (unsigned shift = 0; it != end && shift < 64; shift += 7) {
+        const std::uint8_t byte = *it++;
+        value |= std::uint64_t(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+const char* InputLog::start_replay(const char* filename, std::uint64_t rom_hash, std::uint64_t start) {
+    std::FILE* file = std::fopen(filename, "rb");
+    if (file == nullptr)
+        return "cannot read the input log file";
+
+    std::vector<std::uint8_t> bytes;
+    std::uint8_t buffer[4096];
+    std::size_t read_bytes;
+    while ((read_bytes = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+        bytes.insert(bytes.end(), buffer, buffer + read_bytes);
+    std::fclose(file);
+
+    std::uint32_t header[INPUT_LOG_HEADER_WORDS];
+    if (bytes.size() < sizeof(header))
+        return "not an input log file";
+    std::memcpy(header, bytes.data(), sizeof(header));
+    if (header[0] != INPUT_LOG_MAGIC)
+        return "not an input log file";
+    if (header[1] != INPUT_LOG_VERSION)
+        return "unsupported input log version";
+    if ((std::uint64_t(header[3]) << 32 | header[2]) != rom_hash)
+        return "the input log was recorded with another ROM";
+    if ((std::uint64_t(header[5]) << 32 | header[4]) != start)
+        return "the input log was recorded from another instruction count";
+
+    // An event cut by a crash of the recording is ignored.
+    const std::uint8_t* it = bytes.data() + sizeof(header);
+    const std::uint8_t* const end = bytes.data() + bytes.size();
+    std::vector<Event> events;
+    std::uint64_t count = start;
+    while (it != end) {
+        std::uint64_t value;
+        if (!read_varint(it, end, value))
+            break;
+
+        Event event;
+        event.kind = EventKind(value & ((1u << EVENT_KIND_BITS) - 1));
+        event.instruction_count = count += value >> EVENT_KIND_BITS;
+        if (event.kind > EventKind::END)
+            return "invalid event in the input log file";
+
+        if (event.kind == EventKind::CALENDAR) {
+            std::uint64_t mask;
+            bool complete = read_varint(it, end, mask);
+            if (complete && mask >= (1u << CALENDAR_WORDS))
+                return "invalid event in the input log file";
+
+            for (std::size_t i = 0; i < CALENDAR_WORDS && complete; ++i) {
+                if (mask & (1u << i)) {
+                    complete = read_varint(it, end, value);
+                    m_calendar[i] = word_t(value);
+                }
+            }
+            if (!complete)
+                break;
+            std::memcpy(event.calendar, m_calendar, sizeof(m_calendar));
+        }
+
+        events.push_back(event);
+        if (event.kind == EventKind::END)
+            break;
+    }
+
+    m_events = std::move(events);
+    m_next = 0;
+    return nullptr;
+}
+
+void InputLog::write_varint(std::uint64_t value) {
+    while (value >= 0x80) {
+        std::fputc(int(value & 0x7f) | 0x80, m_file);
+        value >>= 7;
+    }
+    std::fputc(int(value), m_file);
+}
+
+void InputLog::record(const Event& event) {
+    write_varint((event.instruction_count - m_last_count) << EVENT_KIND_BITS | std::uint64_t(event.kind));
+    m_last_count = event.instruction_count;
+    if (event.kind != EventKind::CALENDAR) {
+        std::fflush(m_file);
+        return;
+    }
+
+    std::uint32_t mask = 0;
+    for (std::size_t i = 0; i < CALENDAR_WORDS; ++i) {
+        if (event.calendar[i] != m_calendar[i])
+            mask |= 1u << i;
+    }
+
+    write_varint(mask);
+    for (std::size_t i = 0; i < CALENDAR_WORDS; ++i) {
+        if (mask & (1u << i))
+            write_varint(event.calendar[i]);
+    }
+    std::memcpy(m_calendar, event.calendar, sizeof(m_calendar));
+
+    // The calendar changes at most once a second, like the tick, so flushing
+    // the changes costs nothing.
+    if (mask != 0)
+        std::fflush(m_file);
+}
+
+void InputLog::close(std::uint64_t instruction_count) {
+    if (m_file == nullptr)
+        return;
+
+    Event event;
+    event.instruction_count = instruction_count;
+    event.kind = EventKind::END;
+    record(event);
+    std::fclose(m_file);
+    m_file = nullptr;
+    // Nothing is left to replay.
+    m_next = m_events.size();
+}
+
+const char* VM::record_inputs(const char* filename) {
+    if (!m_owns_ram)
+        return "the inputs of a hart cannot be logged";
+    if (m_history != nullptr)
+        return "the inputs cannot be logged with the execution history";
+
+    close_input_log();
+    auto log = std::make_unique<InputLog>();
+    if (const char* failure = log->start_recording(filename, m_rom->get_hash(), m_instruction_count))
+        return failure;
+
+    m_input_log = std::move(log);
+    return nullptr;
+}
+
+const char* VM::replay_inputs(const char* filename) {
+    if (!m_owns_ram)
+        return "the inputs of a hart cannot be logged";
+    if (m_history != nullptr)
+        return "the inputs cannot be logged with the execution history";
+
+    auto log = std::make_unique<InputLog>();
+    if (const char* failure = log->start_replay(filename, m_rom->get_hash(), m_instruction_count))
+        return failure;
+
+    close_input_log();
+    m_input_log = std::move(log);
+    return nullptr;
+}
+
+void VM::close_input_log() {
+    if (m_input_log == nullptr)
+        return;
+
+    m_input_log->close(m_instruction_count);
+    m_input_log.reset();
+}
+
+bool VM::log_calendar() {
+    if (!m_input_log->is_replaying()) {
+        InputLog::Event event;
+        event.instruction_count = m_instruction_count;
+        event.kind = InputLog::EventKind::CALENDAR;
+        RamRef { m_ram, nullptr }.read_range(InputLog::CALENDAR_BEGIN, event.calendar);
+        m_input_log->record(event);
+        return true;
+    }
+
+    const InputLog::Event* event = m_input_log->peek();
+    if (event == nullptr || event->kind != InputLog::EventKind::CALENDAR || event->instruction_count != m_instruction_count)
+        return false;
+
+    // Overwrites what the calendar just read from the host clock.
+    RamRef { m_ram, nullptr }.write_range(InputLog::CALENDAR_BEGIN, event->calendar);
+    m_input_log->pop();
+    return true;
+}
@@ -0,0 +1,94 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#ifndef ASM_VM_INPUT_LOG_HPP
+#define ASM_VM_INPUT_LOG_HPP
+
+#include "vm.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+/// The log of the nondeterministic inputs of a run, see VM::record_inputs().
+///
+/// Everything a program computes follows from its ROM, its RAM and the time
+/// device, which is the only input that depends on the host: the tick, set
+/// at TIME_DEVICE_BEGIN once a second, and the calendar, written to the words
+/// CALENDAR_BEGIN to TIME_DEVICE_END from the host clock when the program
+/// stores to CALENDAR_BEGIN. The log holds each of these events with the
+/// instruction count at which the program sees it, so that replaying them at
+/// the same counts reproduces the run exactly, whatever the engine and the
+/// speed of the host.
+///
+/// The file starts with six 32-bit words in the byte order of the host:
+/// INPUT_LOG_MAGIC, INPUT_LOG_VERSION, the hash of the ROM and the
+/// instruction count at which the recording started (both low word first).
+/// Then each event is a LEB128 varint holding the instruction count since the
+/// previous event shifted left by two bits, with its EventKind in the low
+/// bits. A CALENDAR is followed by a varint mask of the words that differ
+/// from the previous calendar (bit `i` for the word `CALENDAR_BEGIN + i`) and
+/// by these words as varints, so the calendars read again within the same
+/// second take two bytes. A recording completed by close() ends with an END
+/// event.
+///
+/// The events that change the inputs are flushed as they are recorded, so
+/// the log of a run that crashed replays up to about the crash.
+class InputLog {
+public:
+    static constexpr addr_t CALENDAR_BEGIN = VM::TIME_DEVICE_BEGIN + 1;
+    static constexpr std::size_t CALENDAR_WORDS = VM::TIME_DEVICE_END - CALENDAR_BEGIN + 1;
+
+    enum class EventKind : std::uint8_t {
+        /// The tick of the time device was set.
+        TICK,
+        /// The calendar was written, after the store that requested it.
+        CALENDAR,
+        /// The recording stopped.
+        END
+    };
+
+    struct Event {
+        std::uint64_t instruction_count = 0;
+        EventKind kind = EventKind::END;
+        word_t calendar[CALENDAR_WORDS] = {};
+    };
+
+    InputLog() = default;
+    ~InputLog();
+
+    InputLog(const InputLog&) = delete;
+    InputLog& operator=(const InputLog&) = delete;
+
+    /// Creates the file @a filename to record the inputs of a run of the ROM
+    /// @a rom_hash from the instruction count @a start. Returns nullptr on
+    /// success, otherwise the reason of the failure.
+    const char* start_recording(const char* filename, std::uint64_t rom_hash, std::uint64_t start);
+    /// Reads the log @a filename to replay it on a run of the ROM @a rom_hash
+    /// that is at the instruction count @a start. Returns nullptr on success,
+    /// otherwise the reason of the failure.
+    const char* start_replay(const char* filename, std::uint64_t rom_hash, std::uint64_t start);
+    /// Completes the recording with an END event at @a instruction_count.
+    void close(std::uint64_t instruction_count);
+
+    [[nodiscard]] bool is_replaying() const { return m_file == nullptr; }
+
+    void record(const Event& event);
+
+    /// Returns the next event to replay, or nullptr if there is none left.
+    [[nodiscard]] const Event* peek() const { return m_next < m_events.size() ? &m_events[m_next] : nullptr; }
+    void pop() { ++m_next; }
+
+private:
+    void write_varint(std::uint64_t value);
+
+    std::FILE* m_file = nullptr;
+    std::uint64_t m_last_count = 0;
+    /// The previous calendar, the next one is encoded relative to it.
+    word_t m_calendar[CALENDAR_WORDS] = {};
+    std::vector<Event> m_events;
+    std::size_t m_next = 0;
+};
+
+#endif // ASM_VM_INPUT_LOG_HPP
@@ -0,0 +1,300 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "alu.hpp"
+#include "history.hpp"
+#include "vm.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+/*
+ * The threaded interpreter.
+ *
+ * With GCC and Clang, every handler jumps directly to the handler of the next
+ * instruction through a table of label addresses (computed goto). Other
+ * compilers use a portable switch. In both cases, the handler table is
+ * generated from instructions.def.
+ *
+ * The pc, the registers and the flags are kept in locals for the whole run
+ * and are only written back to the VM when the execution stops.
+ */
+
+#ifndef CPULM_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define CPULM_COMPUTED_GOTO 1
+#else
+#define CPULM_COMPUTED_GOTO 0
+#endif
+#endif
+
+StopReason VM::run_loop(std::uint64_t budget) {
+    const std::uint64_t initial_budget = budget;
+    StopReason reason = StopReason::BUDGET_EXHAUSTED;
+    // Stores to the range of the watchpoints (and of the devices, if the VM
+    // stops on device writes) are checked precisely.
+    addr_t check_begin = m_watchpoints.empty() ? 1 : *m_watchpoints.begin();
+    addr_t check_end = m_watchpoints.empty() ? 0 : *m_watchpoints.rbegin();
+    if (m_stop_on_device_write && !m_mmio.empty()) {
+        check_begin = std::min(check_begin, m_mmio.get_begin());
+        check_end = std::max(check_end, m_mmio.get_begin() + m_mmio.get_size() - 1);
+    }
+    addr_t store_addr = 0;
+    const RamRef ram = ram_ref();
+    const MmioMap& mmio = m_mmio;
+    std::mutex* const ram_lock = m_ram_lock;
+    const bool copy_on_write = m_copy_on_write.is_active();
+    const bool track_written_pages = m_track_written_pages;
+    ExecutionHistory* const history = m_history.get();
+    // The stores with anything more to do than the store itself take a
+    // single branch out of the common path.
+    const bool store_side_work = copy_on_write || track_written_pages || history != nullptr || ram_lock != nullptr
+        || check_begin <= check_end;
+    const DecodedInstruction* const program = m_program;
+    const std::size_t code_length = m_code_length;
+    const DecodedInstruction* inst = nullptr;
+    std::size_t pc = m_pc;
+
+    reg_t regs[REG_SLOTS];
+    std::memcpy(regs, m_regs, sizeof(regs));
+
+    LazyFlags flags = m_flags;
+    std::uint32_t tick_countdown = m_tick_countdown;
+
+#if CPULM_COMPUTED_GOTO
+    static void* const handlers[H_COUNT] = {
+#define INSTRUCTION(name, opcode) &&do_##name,
+#define BINARY_INSTRUCTION(name, func) &&do_alu_##name,
+#include "instructions.def"
+        &&do_invalid,
+#define SUPERINSTRUCTION(name) &&do_##name,
+#include "superinstructions.def"
+    };
+
+#define DISPATCH() goto* handlers[inst->handler]
+#else
+#define DISPATCH() goto dispatch
+#endif
+
+// Fetches the next instruction and jumps to its handler.
+#define NEXT()                                    \
+    do {                                          \
+        if (budget == 0)                          \
+            goto stop;                            \
+        if (--tick_countdown == 0) {              \
+            tick_countdown = TICK_CHECK_INTERVAL; \
+            update_tick();                        \
+        }                                         \
+        if (pc >= code_length)                    \
+            goto out_of_program;                  \
+        --budget;                                 \
+        inst = &program[pc++];                    \
+        DISPATCH();                               \
+    } while (0)
+
+// Stops on an ill-formed instruction, which is not executed.
+#define FAIL(msg)                   \
+    do {                            \
+        m_error = msg;              \
+        reason = StopReason::ERROR; \
+        --pc;                       \
+        ++budget;                   \
+        goto stop;                  \
+    } while (0)
+
+// Moves to the second instruction of a superinstruction, unless the budget
+// only allows the first one: single steps still see every instruction. The
+// second instruction counts for the tick and is checked as by NEXT().
+#define NEXT_FUSED()                              \
+    do {                                          \
+        if (budget == 0)                          \
+            goto stop;                            \
+        if (--tick_countdown == 0) {              \
+            tick_countdown = TICK_CHECK_INTERVAL; \
+            update_tick();                        \
+        }                                         \
+        if (pc >= code_length)                    \
+            goto out_of_program;                  \
+        --budget;                                 \
+        inst = &program[pc++];                    \
+    } while (0)
+
+    NEXT();
+
+#if !CPULM_COMPUTED_GOTO
+dispatch:
+    switch (inst->handler) {
+#define INSTRUCTION(name, opcode) \
+    case H_##name:                \
+        goto do_##name;
+#define BINARY_INSTRUCTION(name, func) \
+    case H_alu_##name:                 \
+        goto do_alu_##name;
+#include "instructions.def"
+#define SUPERINSTRUCTION(name) \
+    case H_##name:             \
+        goto do_##name;
+#include "superinstructions.def"
+    default:
+        goto do_invalid;
+    }
+#endif
+
+#define BINARY_INSTRUCTION(name, func)                                     \
+    do_alu_##name:                                                         \
+    regs[inst->rd] = alu_##name(regs[inst->rs1], regs[inst->rs2], flags); \
+    NEXT();
+#include "instructions.def"
+
+do_alu:
+    FAIL("invalid ALU code");
+
+do_lsl:
+    regs[inst->rd] = shift_lsl(regs[inst->rs1], regs[inst->rs2]);
+    NEXT();
+
+do_asr:
+    regs[inst->rd] = shift_asr(regs[inst->rs1], regs[inst->rs2]);
+    NEXT();
+
+do_lsr:
+    regs[inst->rd] = shift_lsr(regs[inst->rs1], regs[inst->rs2]);
+    NEXT();
+
+do_load:
+    if (copy_on_write) [[unlikely]]
+        m_copy_on_write.access(m_ram, m_written_pages, regs[inst->rs1]);
+    if (ram_lock != nullptr) [[unlikely]] {
+        std::lock_guard lock(*ram_lock);
+        regs[inst->rd] = mmio.load(ram, regs[inst->rs1]);
+    } else {
+        regs[inst->rd] = mmio.load(ram, regs[inst->rs1]);
+    }
+    NEXT();
+
+do_loadi:
+    regs[inst->rd] = regs[inst->rs1] + inst->imm;
+    NEXT();
+
+do_store:
+    store_addr = regs[inst->rs1];
+    if (store_side_work) [[unlikely]]
+        goto store_with_side_work;
+    mmio.store(ram, store_addr, regs[inst->rs2]);
+    NEXT();
+
+store_with_side_work:
+    if (copy_on_write)
+        m_copy_on_write.access(m_ram, m_written_pages, store_addr);
+    if (track_written_pages)
+        m_written_pages.add(store_addr);
+    if (history != nullptr)
+        history->record_store(ram, store_addr);
+    if (ram_lock != nullptr) {
+        std::lock_guard lock(*ram_lock);
+        mmio.store(ram, store_addr, regs[inst->rs2]);
+    } else {
+        mmio.store(ram, store_addr, regs[inst->rs2]);
+    }
+    if (store_addr >= check_begin && store_addr <= check_end) {
+        if (m_watchpoints.contains(store_addr)) {
+            reason = StopReason::WATCHPOINT;
+            goto stop;
+        } else if (m_stop_on_device_write && is_device_address(store_addr)) {
+            reason = StopReason::DEVICE_WRITE;
+            goto stop;
+        }
+    }
+    NEXT();
+
+do_jmp:
+    pc = regs[inst->rs1];
+    NEXT();
+
+do_jmpc:
+    if (flags.test(inst->select))
+        pc = regs[inst->rs1];
+    NEXT();
+
+do_jmpi:
+    pc = inst->imm;
+    NEXT();
+
+do_jmpic:
+    if (flags.test(inst->select))
+        pc = inst->imm;
+    NEXT();
+
+do_break:
+    // The break itself is not executed.
+    reason = StopReason::BREAKPOINT;
+    ++budget;
+    goto stop;
+
+do_invalid:
+    FAIL("invalid opcode");
+
+do_sub_jmpc:
+    regs[inst->rd] = alu_sub(regs[inst->rs1], regs[inst->rs2], flags);
+    NEXT_FUSED();
+    if (flags.test(inst->select))
+        pc = regs[inst->rs1];
+    NEXT();
+
+do_sub_jmpic:
+    regs[inst->rd] = alu_sub(regs[inst->rs1], regs[inst->rs2], flags);
+    NEXT_FUSED();
+    if (flags.test(inst->select))
+        pc = inst->imm;
+    NEXT();
+
+do_loadi_loadi:
+    regs[inst->rd] = regs[inst->rs1] + inst->imm;
+    NEXT_FUSED();
+    regs[inst->rd] = regs[inst->rs1] + inst->imm;
+    NEXT();
+
+do_add_jmpi:
+    regs[inst->rd] = alu_add(regs[inst->rs1], regs[inst->rs2], flags);
+    NEXT_FUSED();
+    pc = inst->imm;
+    NEXT();
+
+do_sub_jmpi:
+    regs[inst->rd] = alu_sub(regs[inst->rs1], regs[inst->rs2], flags);
+    NEXT_FUSED();
+    pc = inst->imm;
+    NEXT();
+
+out_of_program:
+    if (pc == 0xffffffff) {
+        reason = StopReason::HALTED;
+    } else {
+        m_error = "jumping outside of program.";
+        reason = StopReason::ERROR;
+    }
+
+stop:
+    m_pc = pc;
+    std::memcpy(m_regs, regs, sizeof(regs));
+    m_flags = flags;
+    m_tick_countdown = tick_countdown;
+    m_instruction_count += initial_budget - budget;
+
+    if (reason == StopReason::BREAKPOINT)
+        reach_breakpoint();
+    else if (reason == StopReason::WATCHPOINT)
+        reach_watchpoint(store_addr);
+    else if (reason == StopReason::DEVICE_WRITE) {
+        m_device_write_addr = store_addr;
+        m_device_write_word = regs[inst->rs2];
+    }
+
+    return reason;
+
+#undef NEXT_FUSED
+#undef FAIL
+#undef NEXT
+#undef DISPATCH
+}
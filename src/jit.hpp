@@ -0,0 +1,75 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#ifndef ASM_VM_JIT_HPP
+#define ASM_VM_JIT_HPP
+
+#include "alu.hpp"
+#include "vm.hpp"
+
+#include <cstdint>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define CPULM_HAS_JIT 1
+#else
+#define CPULM_HAS_JIT 0
+#endif
+
+/// The state shared by the basic block engine and the native code.
+struct JitContext {
+    reg_t regs[VM::REG_SLOTS];
+    RamRef ram;
+    const MmioMap* mmio;
+    /// The pages written by the stores, see VM::save_snapshot(). They are
+    /// only added while track_written_pages.
+    PageSet* written_pages;
+    bool track_written_pages;
+    /// Null unless the RAM shares pages with a frozen one, see VM::clone().
+    CopyOnWrite* copy_on_write;
+    packed_flags_t flags;
+    /// The native code stops before the stores to the @a device_size words
+    /// from @a device_begin (see MmioMap::may_contain()), 0 to never stop.
+    addr_t device_begin;
+    addr_t device_size;
+    /// Set by the native code when it stopped just before a store to a
+    /// device, the returned pc is then the address of that store.
+    bool device_exit;
+};
+
+/// Translates basic blocks to x86-64 code.
+///
+/// The registers and flags stay in the JitContext, loads and stores go
+/// through small helpers that call MmioMap::load() and MmioMap::store() (and
+/// handle the copy-on-write pages and the written pages). The CPUlm flags are
+/// taken from the host flags set by the equivalent x86 instruction (except
+/// for mul).
+class Jit {
+public:
+    Jit() = default;
+    ~Jit();
+
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    /// Returns true if the JIT can run on this host.
+    static bool is_supported();
+
+    /// Translates the @a block that starts at @a addr. Returns nullptr if the
+    /// translation failed.
+    JitBlockFn compile(const BasicBlock& block, addr_t addr);
+    /// Frees all the translated code.
+    void reset();
+
+private:
+    struct Chunk {
+        std::uint8_t* memory;
+        std::size_t size;
+        std::size_t used;
+    };
+
+    std::vector<Chunk> m_chunks;
+};
+
+#endif // ASM_VM_JIT_HPP
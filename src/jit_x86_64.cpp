@@ -0,0 +1,460 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "jit.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+
+#if CPULM_HAS_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/*
+ * The x86-64 backend of the JIT.
+ *
+ * Each hot basic block is translated to a function `size_t block(JitContext*)`
+ * that executes the whole block and returns the next pc. The context pointer
+ * is kept in rbx for the whole block, the CPUlm registers are accessed as
+ * memory operands of the context.
+ *
+ * Flags: add, sub, and, or and xor set the x86 ZF, SF, CF and OF exactly like
+ * the CPUlm Z, N, C and V flags (for sub, CF is the borrow). They are read
+ * back with setcc and packed into JitContext::flags only for the last ALU
+ * instruction before an exit of the block. A conditional jump right after
+ * such an instruction uses the host flags directly.
+ *
+ * Loads and stores call jit_load() and jit_store(), which handle the pages
+ * shared copy-on-write and record the written pages. When the VM stops on
+ * the device writes, a store to a device leaves the native code so that the
+ * VM executes it.
+ */
+
+#if CPULM_HAS_JIT
+
+namespace {
+
+enum HostReg : std::uint8_t {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSI = 6,
+    RDI = 7,
+    R8 = 8,
+    R9 = 9,
+    R10 = 10,
+    R11 = 11,
+};
+
+/// The x86 condition codes (the low nibble of Jcc, SETcc and CMOVcc).
+enum HostCond : std::uint8_t {
+    CC_O = 0x0,
+    CC_B = 0x2,
+    CC_Z = 0x4,
+    CC_NZ = 0x5,
+    CC_S = 0x8,
+};
+
+constexpr std::int32_t reg_offset(reg_index_t reg) {
+    return offsetof(JitContext, regs) + reg * sizeof(reg_t);
+}
+
+class Emitter {
+public:
+    std::vector<std::uint8_t> code;
+
+    void byte(std::uint8_t value) { code.push_back(value); }
+
+    void dword(std::uint32_t value) {
+        for (int i = 0; i < 4; ++i)
+            byte(value >> (8 * i));
+    }
+
+    void qword(std::uint64_t value) {
+        for (int i = 0; i < 8; ++i)
+            byte(value >> (8 * i));
+    }
+
+    void rex(bool wide, std::uint8_t reg, std::uint8_t index, std::uint8_t base) {
+        const std::uint8_t prefix = 0x40 | (wide << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+        if (prefix != 0x40)
+            byte(prefix);
+    }
+
+    /// `op reg, [rbx + disp]` (or the reverse, depending on the opcode).
+    void op_mem(std::initializer_list<std::uint8_t> opcode, std::uint8_t reg, std::int32_t disp, bool wide = false) {
+        rex(wide, reg, 0, RBX);
+        for (auto op : opcode)
+            byte(op);
+        byte(0x80 | ((reg & 7) << 3) | RBX);
+        dword(disp);
+    }
+
+    /// `op reg, rm` with two registers.
+    void op_reg(std::initializer_list<std::uint8_t> opcode, std::uint8_t reg, std::uint8_t rm, bool wide = false) {
+        rex(wide, reg, 0, rm);
+        for (auto op : opcode)
+            byte(op);
+        byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    void load_reg(std::uint8_t host, reg_index_t reg) { op_mem({ 0x8b }, host, reg_offset(reg)); }
+    void store_reg(reg_index_t reg, std::uint8_t host) { op_mem({ 0x89 }, host, reg_offset(reg)); }
+
+    void mov_imm(std::uint8_t host, std::uint32_t value) {
+        rex(false, 0, 0, host);
+        byte(0xb8 | (host & 7));
+        dword(value);
+    }
+
+    void xor_self(std::uint8_t host) { op_reg({ 0x31 }, host, host); }
+    void test_eax() { op_reg({ 0x85 }, RAX, RAX); }
+    void setcc(HostCond cond, std::uint8_t host) { op_reg({ 0x0f, std::uint8_t(0x90 | cond) }, 0, host); }
+    void cmovcc(HostCond cond, std::uint8_t dst, std::uint8_t src) { op_reg({ 0x0f, std::uint8_t(0x40 | cond) }, dst, src); }
+
+    /// `lea dst, [dst + index * scale]` with 32-bit operands.
+    void lea_scaled(std::uint8_t dst, std::uint8_t index, std::uint8_t scale_log2) {
+        rex(false, dst, index, dst);
+        byte(0x8d);
+        byte(0x04 | ((dst & 7) << 3));
+        byte((scale_log2 << 6) | ((index & 7) << 3) | (dst & 7));
+    }
+
+    void call(const void* function) {
+        // mov rax, imm64; call rax
+        byte(0x48);
+        byte(0xb8);
+        qword((std::uint64_t)function);
+        byte(0xff);
+        byte(0xd0);
+    }
+
+    void prologue() {
+        byte(0x53); // push rbx
+        op_reg({ 0x89 }, RDI, RBX, true); // mov rbx, rdi
+    }
+
+    /// Returns the value already in eax.
+    void epilogue() {
+        byte(0x5b); // pop rbx
+        byte(0xc3); // ret
+    }
+
+    void return_pc(std::uint32_t pc) {
+        mov_imm(RAX, pc);
+        epilogue();
+    }
+};
+
+word_t jit_load(JitContext* context, addr_t addr) {
+    if (context->copy_on_write != nullptr) [[unlikely]]
+        context->copy_on_write->access(context->ram.sparse, *context->written_pages, addr);
+    return context->mmio->load(context->ram, addr);
+}
+
+void jit_store(JitContext* context, addr_t addr, word_t word) {
+    if (context->copy_on_write != nullptr) [[unlikely]]
+        context->copy_on_write->access(context->ram.sparse, *context->written_pages, addr);
+    if (context->track_written_pages)
+        context->written_pages->add(addr);
+    context->mmio->store(context->ram, addr, word);
+}
+
+bool is_alu(const DecodedInstruction& inst) {
+    return inst.opcode == OP_alu;
+}
+
+/// Emits an ALU instruction, eax receives the result. If @a materialize is
+/// true, the packed flags are also written to the context. Returns true if
+/// the host flags match the CPUlm flags after the instruction.
+bool emit_alu(Emitter& e, const DecodedInstruction& inst, bool materialize) {
+    if (materialize) {
+        e.xor_self(R8);
+        e.xor_self(R9);
+        e.xor_self(R10);
+        e.xor_self(R11);
+    }
+
+    bool host_flags = true;
+    e.load_reg(RAX, inst.rs1);
+    switch (inst.alucode) {
+    case BF_and:
+        e.op_mem({ 0x23 }, RAX, reg_offset(inst.rs2));
+        break;
+    case BF_or:
+        e.op_mem({ 0x0b }, RAX, reg_offset(inst.rs2));
+        break;
+    case BF_nor:
+        e.op_mem({ 0x0b }, RAX, reg_offset(inst.rs2));
+        e.op_reg({ 0xf7 }, 2, RAX); // not eax
+        e.test_eax();
+        break;
+    case BF_xor:
+        e.op_mem({ 0x33 }, RAX, reg_offset(inst.rs2));
+        break;
+    case BF_add:
+        e.op_mem({ 0x03 }, RAX, reg_offset(inst.rs2));
+        break;
+    case BF_sub:
+        e.op_mem({ 0x2b }, RAX, reg_offset(inst.rs2));
+        break;
+    case BF_mul:
+        // imul gives the signed overflow, mul the unsigned one.
+        e.op_mem({ 0x0f, 0xaf }, RAX, reg_offset(inst.rs2));
+        if (materialize) {
+            e.setcc(CC_O, R11);
+            e.load_reg(RAX, inst.rs1);
+            e.op_mem({ 0xf7 }, 4, reg_offset(inst.rs2)); // mul
+            e.setcc(CC_B, R10);
+            e.test_eax();
+        }
+        host_flags = false;
+        break;
+    case BF_div:
+        e.xor_self(RDX);
+        e.op_mem({ 0xf7 }, 6, reg_offset(inst.rs2)); // div
+        e.test_eax();
+        break;
+    default:
+        break;
+    }
+
+    e.store_reg(inst.rd, RAX);
+
+    if (materialize) {
+        e.setcc(CC_Z, R8);
+        e.setcc(CC_S, R9);
+        if (inst.alucode != BF_mul) {
+            e.setcc(CC_B, R10);
+            e.setcc(CC_O, R11);
+        }
+
+        // lea does not change the host flags.
+        e.lea_scaled(R8, R9, 1);
+        e.lea_scaled(R8, R10, 2);
+        e.lea_scaled(R8, R11, 3);
+        e.op_mem({ 0x88 }, R8, offsetof(JitContext, flags));
+    }
+
+    return host_flags;
+}
+
+/// Returns the host condition equivalent to a flags select, if any.
+bool host_condition(std::uint8_t select, HostCond& cond) {
+    switch (select) {
+    case flag_bit(FLAG_ZERO):
+        cond = CC_Z;
+        return true;
+    case flag_bit(FLAG_NEGATIVE):
+        cond = CC_S;
+        return true;
+    case flag_bit(FLAG_CARRY):
+        cond = CC_B;
+        return true;
+    case flag_bit(FLAG_OVERFLOW):
+        cond = CC_O;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/// Emits the code that sets eax to the jump target if the condition holds.
+void emit_condition(Emitter& e, std::uint8_t select, bool host_flags) {
+    HostCond cond;
+    if (!host_flags || !host_condition(select, cond)) {
+        // test byte [rbx + flags], select
+        e.op_mem({ 0xf6 }, 0, offsetof(JitContext, flags));
+        e.byte(select);
+        cond = CC_NZ;
+    }
+
+    e.cmovcc(cond, RAX, RCX);
+}
+
+bool translate(Emitter& e, const BasicBlock& block, addr_t addr) {
+    const auto& body = block.body;
+
+    // Only the flags of the last ALU instruction before an exit of the block
+    // (a store, that may leave to the VM, or the end) are observable.
+    std::vector<bool> materialize(body.size(), false);
+    bool flags_live = true;
+    for (std::size_t i = body.size(); i-- > 0;) {
+        if (is_alu(body[i])) {
+            materialize[i] = flags_live;
+            flags_live = false;
+        } else if (body[i].opcode == OP_store) {
+            flags_live = true;
+        }
+    }
+
+    struct DeviceExit {
+        std::size_t jump_at;
+        addr_t pc;
+    };
+    std::vector<DeviceExit> device_exits;
+
+    e.prologue();
+
+    bool host_flags = false;
+    for (std::size_t i = 0; i < body.size(); ++i) {
+        const DecodedInstruction& inst = body[i];
+        switch (inst.opcode) {
+        case OP_alu:
+            host_flags = emit_alu(e, inst, materialize[i]);
+            continue;
+        case OP_lsl:
+        case OP_asr:
+        case OP_lsr: {
+            const std::uint8_t ext = inst.opcode == OP_lsl ? 4 : (inst.opcode == OP_asr ? 7 : 5);
+            e.load_reg(RAX, inst.rs1);
+            e.load_reg(RCX, inst.rs2);
+            e.op_reg({ 0xd3 }, ext, RAX); // shl/sar/shr eax, cl
+            e.store_reg(inst.rd, RAX);
+        } break;
+        case OP_loadi:
+            e.load_reg(RAX, inst.rs1);
+            e.byte(0x05); // add eax, imm32
+            e.dword(inst.imm);
+            e.store_reg(inst.rd, RAX);
+            break;
+        case OP_load:
+            e.op_reg({ 0x89 }, RBX, RDI, true); // mov rdi, rbx
+            e.load_reg(RSI, inst.rs1);
+            e.call((const void*)&jit_load);
+            e.store_reg(inst.rd, RAX);
+            break;
+        case OP_store:
+            e.load_reg(RSI, inst.rs1);
+            // mov eax, esi; sub eax, [rbx + device_begin];
+            // cmp eax, [rbx + device_size]; jb device_exit
+            e.op_reg({ 0x89 }, RSI, RAX);
+            e.op_mem({ 0x2b }, RAX, offsetof(JitContext, device_begin));
+            e.op_mem({ 0x3b }, RAX, offsetof(JitContext, device_size));
+            e.byte(0x0f);
+            e.byte(0x80 | CC_B);
+            device_exits.push_back({ e.code.size(), addr_t(addr + i) });
+            e.dword(0);
+
+            e.op_reg({ 0x89 }, RBX, RDI, true); // mov rdi, rbx
+            e.load_reg(RDX, inst.rs2);
+            e.call((const void*)&jit_store);
+            break;
+        default:
+            return false;
+        }
+
+        host_flags = false;
+    }
+
+    const addr_t end = addr + body.size();
+    if (!block.has_terminator) {
+        e.return_pc(end);
+    } else {
+        const DecodedInstruction& inst = block.terminator;
+        switch (inst.opcode) {
+        case OP_jmp:
+            e.load_reg(RAX, inst.rs1);
+            break;
+        case OP_jmpi:
+            e.mov_imm(RAX, inst.imm);
+            break;
+        case OP_jmpc:
+            e.mov_imm(RAX, end + 1);
+            e.load_reg(RCX, inst.rs1);
+            emit_condition(e, inst.select, host_flags);
+            break;
+        case OP_jmpic:
+            e.mov_imm(RAX, end + 1);
+            e.mov_imm(RCX, inst.imm);
+            emit_condition(e, inst.select, host_flags);
+            break;
+        default:
+            return false;
+        }
+
+        e.epilogue();
+    }
+
+    for (const auto& exit : device_exits) {
+        const std::int32_t rel = e.code.size() - (exit.jump_at + 4);
+        std::memcpy(&e.code[exit.jump_at], &rel, sizeof(rel));
+        // mov byte [rbx + device_exit], 1
+        e.op_mem({ 0xc6 }, 0, offsetof(JitContext, device_exit));
+        e.byte(1);
+        e.return_pc(exit.pc);
+    }
+
+    return true;
+}
+
+constexpr std::size_t CHUNK_SIZE = 256 * 1024;
+
+} // namespace
+
+Jit::~Jit() {
+    reset();
+}
+
+bool Jit::is_supported() {
+    return true;
+}
+
+JitBlockFn Jit::compile(const BasicBlock& block, addr_t addr) {
+    Emitter emitter;
+    if (!translate(emitter, block, addr))
+        return nullptr;
+
+    const std::size_t size = emitter.code.size();
+    if (m_chunks.empty() || m_chunks.back().used + size > m_chunks.back().size) {
+        const std::size_t page_size = sysconf(_SC_PAGESIZE);
+        const std::size_t chunk_size = std::max(CHUNK_SIZE, (size + page_size - 1) / page_size * page_size);
+        void* memory = mmap(nullptr, chunk_size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return nullptr;
+
+        m_chunks.push_back({ (std::uint8_t*)memory, chunk_size, 0 });
+    }
+
+    // The code memory is never writable and executable at the same time.
+    Chunk& chunk = m_chunks.back();
+    if (mprotect(chunk.memory, chunk.size, PROT_READ | PROT_WRITE) != 0)
+        return nullptr;
+
+    std::uint8_t* code = chunk.memory + chunk.used;
+    std::memcpy(code, emitter.code.data(), size);
+    chunk.used += (size + 15) & ~std::size_t(15);
+
+    if (mprotect(chunk.memory, chunk.size, PROT_READ | PROT_EXEC) != 0)
+        return nullptr;
+
+    return (JitBlockFn)code;
+}
+
+void Jit::reset() {
+    for (const auto& chunk : m_chunks)
+        munmap(chunk.memory, chunk.size);
+    m_chunks.clear();
+}
+
+#else
+
+Jit::~Jit() = default;
+
+bool Jit::is_supported() {
+    return false;
+}
+
+JitBlockFn Jit::compile(const BasicBlock&, addr_t) {
+    return nullptr;
+}
+
+void Jit::reset() {
+}
+
+#endif
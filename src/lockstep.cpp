@@ -0,0 +1,341 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "lockstep.hpp"
+#include "time_device.h"
+
+#include <algorithm>
+
+/*
+ * The instructions have the same semantics as in the interpreter, see
+ * interpreter.cpp and alu.hpp, but on a whole vector of lanes. The flags are
+ * computed eagerly as, unlike in the scalar VM, each lane may have last run
+ * a different ALU operation.
+ *
+ * The helpers below are always inlined: passing vectors wider than the
+ * enabled instruction set to a function goes through memory.
+ */
+
+#define LANES_INLINE [[gnu::always_inline]] inline
+
+template <typename Vector>
+LANES_INLINE static Vector splat(reg_t value) {
+    return Vector {} + value;
+}
+
+template <typename Vector, typename Mask>
+LANES_INLINE static Vector select(const Mask& mask, const Vector& if_true, const Vector& if_false) {
+    return (if_true & (Vector)mask) | (if_false & ~(Vector)mask);
+}
+
+/// Returns the Z and N flags of ALU results, as alu_zn_flags().
+template <typename Vector>
+LANES_INLINE static Vector zn_flags(const Vector& result) {
+    return ((Vector)(result == 0) & flag_bit(FLAG_ZERO)) | ((result >> 31) << (unsigned)FLAG_NEGATIVE);
+}
+
+/// Returns the vector whose lane `i` is `1 << i`.
+template <typename Vector, std::size_t Lanes = sizeof(Vector) / sizeof(reg_t)>
+LANES_INLINE static Vector lane_bits() {
+    Vector bits;
+    for (std::size_t lane = 0; lane < Lanes; ++lane)
+        bits[lane] = reg_t(1) << lane;
+    return bits;
+}
+
+template <typename Mask>
+LANES_INLINE static Mask mask_of(std::uint32_t lanes) {
+    using Vector = decltype((reg_t)0 + Mask {});
+    return (splat<Vector>(lanes) & lane_bits<Vector>()) != 0;
+}
+
+template <typename Mask, std::size_t Lanes = sizeof(Mask) / sizeof(std::int32_t)>
+LANES_INLINE static std::uint32_t lanes_of(const Mask& mask) {
+    std::uint32_t lanes = 0;
+    for (std::size_t lane = 0; lane < Lanes; ++lane)
+        lanes |= std::uint32_t(mask[lane]) & (std::uint32_t(1) << lane);
+    return lanes;
+}
+
+template <std::size_t Lanes>
+LockstepVM<Lanes>::LockstepVM(std::shared_ptr<const Program> program, const std::vector<std::vector<std::uint32_t>>& ram_data)
+    : m_lane_count(std::min(ram_data.size(), Lanes))
+    , m_rom(std::move(program)) {
+    const inst_t* code = m_rom->get_code();
+    m_program.reserve(m_rom->get_length());
+    for (addr_t addr = 0; addr < m_rom->get_length(); ++addr)
+        m_program.push_back(DecodedInstruction::decode(code[addr], addr));
+
+    m_regs[1] = splat<Vector>(1);
+    m_reasons.fill(StopReason::BUDGET_EXHAUSTED);
+    for (std::size_t lane = 0; lane < m_lane_count; ++lane) {
+        m_rams[lane] = ram_create();
+        ram_init(m_rams[lane], ram_data[lane].data(), ram_data[lane].size());
+        time_device_install(m_rams[lane]);
+        m_live |= LaneSet(1) << lane;
+    }
+
+    // All the lanes start at the address 0.
+    reschedule();
+    m_previous_cycle_time = std::chrono::steady_clock::now();
+}
+
+template <std::size_t Lanes>
+LockstepVM<Lanes>::~LockstepVM() {
+    for (std::size_t lane = 0; lane < m_lane_count; ++lane)
+        ram_destroy(m_rams[lane]);
+}
+
+template <std::size_t Lanes>
+void LockstepVM<Lanes>::set_reg(std::size_t lane, reg_index_t reg, reg_t value) {
+    if (reg > 1)
+        m_regs[reg][lane] = value;
+}
+
+template <std::size_t Lanes>
+void LockstepVM<Lanes>::write_reg(reg_index_t rd, const Vector& value) {
+    m_regs[rd] = select(m_active_mask, value, m_regs[rd]);
+}
+
+template <std::size_t Lanes>
+void LockstepVM<Lanes>::write_flags(const Vector& flags) {
+    m_flags = select(m_active_mask, flags, m_flags);
+}
+
+template <std::size_t Lanes>
+void LockstepVM<Lanes>::flush_instruction_counts() {
+    for (LaneSet lanes = m_active; lanes != 0; lanes &= lanes - 1)
+        m_instruction_counts[__builtin_ctz(lanes)] += m_pending_steps;
+    m_pending_steps = 0;
+}
+
+template <std::size_t Lanes>
+void LockstepVM<Lanes>::stop_active(StopReason reason, const char* error) {
+    m_pcs = select(m_active_mask, splat<Vector>((reg_t)m_pc), m_pcs);
+    flush_instruction_counts();
+    for (LaneSet lanes = m_active; lanes != 0; lanes &= lanes - 1) {
+        const std::size_t lane = __builtin_ctz(lanes);
+        m_reasons[lane] = reason;
+        m_errors[lane] = error;
+    }
+
+    m_live &= ~m_active;
+    m_active = 0;
+    reschedule();
+}
+
+template <std::size_t Lanes>
+void LockstepVM<Lanes>::reschedule() {
+    flush_instruction_counts();
+
+    // Lanes that jumped outside of the program stop there.
+    const LaneSet out = m_live & lanes_of(m_pcs >= splat<Vector>((reg_t)m_program.size()));
+    for (LaneSet lanes = out; lanes != 0; lanes &= lanes - 1) {
+        const std::size_t lane = __builtin_ctz(lanes);
+        if (m_pcs[lane] == 0xffffffff) {
+            m_reasons[lane] = StopReason::HALTED;
+        } else {
+            m_reasons[lane] = StopReason::ERROR;
+            m_errors[lane] = "jumping outside of program.";
+        }
+    }
+    m_live &= ~out;
+
+    // The group of the lowest PC runs first, the others wait for it.
+    m_pc = SIZE_MAX;
+    for (LaneSet lanes = m_live; lanes != 0; lanes &= lanes - 1)
+        m_pc = std::min<std::size_t>(m_pc, m_pcs[__builtin_ctz(lanes)]);
+
+    m_active = 0;
+    m_merge_pc = SIZE_MAX;
+    for (LaneSet lanes = m_live; lanes != 0; lanes &= lanes - 1) {
+        const std::size_t lane = __builtin_ctz(lanes);
+        if (m_pcs[lane] == m_pc)
+            m_active |= LaneSet(1) << lane;
+        else
+            m_merge_pc = std::min<std::size_t>(m_merge_pc, m_pcs[lane]);
+    }
+    m_active_mask = mask_of<Mask>(m_active);
+}
+
+template <std::size_t Lanes>
+void LockstepVM<Lanes>::jump(std::size_t target) {
+    m_pc = target;
+    // Jumping over the parked lanes would leave them behind.
+    if (target > m_merge_pc || target >= m_program.size()) {
+        m_pcs = select(m_active_mask, splat<Vector>((reg_t)target), m_pcs);
+        reschedule();
+    }
+}
+
+template <std::size_t Lanes>
+void LockstepVM<Lanes>::jump(const Vector& targets) {
+    m_pcs = select(m_active_mask, targets, m_pcs);
+    reschedule();
+}
+
+template <std::size_t Lanes>
+void LockstepVM<Lanes>::update_tick() {
+    auto now = std::chrono::steady_clock::now();
+    auto dur = std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_previous_cycle_time).count();
+    if (dur >= 1'000'000'000) {
+        // 1 second has elapsed
+        for (LaneSet lanes = m_live; lanes != 0; lanes &= lanes - 1)
+            time_device_tick(m_rams[__builtin_ctz(lanes)]);
+        m_previous_cycle_time = now;
+    }
+}
+
+template <std::size_t Lanes>
+StopReason LockstepVM<Lanes>::run(std::uint64_t budget) {
+    using U64 = typename LaneVectors<Lanes>::u64;
+    using I64 = typename LaneVectors<Lanes>::i64;
+    using I32 = typename LaneVectors<Lanes>::i32;
+
+    while (m_live != 0 && budget > 0) {
+        if (m_pc == m_merge_pc) {
+            // The active group caught up with parked lanes.
+            m_pcs = select(m_active_mask, splat<Vector>((reg_t)m_pc), m_pcs);
+            reschedule();
+            continue;
+        }
+
+        if (--m_tick_countdown == 0) {
+            m_tick_countdown = VM::TICK_CHECK_INTERVAL;
+            update_tick();
+        }
+
+        --budget;
+        ++m_step_count;
+        ++m_pending_steps;
+
+        const DecodedInstruction& inst = m_program[m_pc];
+        const Vector lhs = m_regs[inst.rs1];
+        const Vector rhs = m_regs[inst.rs2];
+        switch (inst.handler) {
+        case H_alu_and:
+        case H_alu_or:
+        case H_alu_nor:
+        case H_alu_xor: {
+            Vector result;
+            if (inst.handler == H_alu_and)
+                result = lhs & rhs;
+            else if (inst.handler == H_alu_or)
+                result = lhs | rhs;
+            else if (inst.handler == H_alu_nor)
+                result = ~(lhs | rhs);
+            else
+                result = lhs ^ rhs;
+            write_flags(zn_flags(result));
+            write_reg(inst.rd, result);
+        } break;
+        case H_alu_add: {
+            const Vector result = lhs + rhs;
+            write_flags(zn_flags(result)
+                | ((Vector)(result < lhs) & flag_bit(FLAG_CARRY))
+                | ((((lhs ^ result) & (rhs ^ result)) >> 31) << (unsigned)FLAG_OVERFLOW));
+            write_reg(inst.rd, result);
+        } break;
+        case H_alu_sub: {
+            const Vector result = lhs - rhs;
+            write_flags(zn_flags(result)
+                | ((Vector)(lhs < rhs) & flag_bit(FLAG_CARRY))
+                | ((((lhs ^ rhs) & (lhs ^ result)) >> 31) << (unsigned)FLAG_OVERFLOW));
+            write_reg(inst.rd, result);
+        } break;
+        case H_alu_mul: {
+            const Vector result = lhs * rhs;
+            // The overflows are found on the 64-bits products.
+            const U64 unsigned_product = __builtin_convertvector(lhs, U64) * __builtin_convertvector(rhs, U64);
+            const I64 signed_product = __builtin_convertvector((I32)lhs, I64) * __builtin_convertvector((I32)rhs, I64);
+            const Mask carry = __builtin_convertvector((unsigned_product >> 32) != 0, Mask);
+            const Mask overflow = __builtin_convertvector(signed_product != __builtin_convertvector((I32)result, I64), Mask);
+            write_flags(zn_flags(result)
+                | ((Vector)carry & flag_bit(FLAG_CARRY))
+                | ((Vector)overflow & flag_bit(FLAG_OVERFLOW)));
+            write_reg(inst.rd, result);
+        } break;
+        case H_alu_div: {
+            // The parked lanes must not divide by whatever is in their rhs.
+            const Vector result = lhs / select(m_active_mask, rhs, splat<Vector>(1));
+            write_flags(zn_flags(result));
+            write_reg(inst.rd, result);
+        } break;
+        case H_lsl:
+            write_reg(inst.rd, lhs << (rhs & 0b11111));
+            break;
+        case H_asr:
+            write_reg(inst.rd, (Vector)((I32)lhs >> (I32)(rhs & 0b11111)));
+            break;
+        case H_lsr:
+            write_reg(inst.rd, lhs >> (rhs & 0b11111));
+            break;
+        case H_load: {
+            Vector result = m_regs[inst.rd];
+            for (LaneSet lanes = m_active; lanes != 0; lanes &= lanes - 1) {
+                const std::size_t lane = __builtin_ctz(lanes);
+                result[lane] = ram_get(m_rams[lane], lhs[lane]);
+            }
+            m_regs[inst.rd] = result;
+        } break;
+        case H_loadi:
+            write_reg(inst.rd, lhs + inst.imm);
+            break;
+        case H_store:
+            for (LaneSet lanes = m_active; lanes != 0; lanes &= lanes - 1) {
+                const std::size_t lane = __builtin_ctz(lanes);
+                ram_set(m_rams[lane], lhs[lane], rhs[lane]);
+            }
+            break;
+        case H_jmp:
+            jump(lhs);
+            continue;
+        case H_jmpc:
+        case H_jmpic: {
+            const LaneSet taken = m_active & lanes_of((m_flags & inst.select) != 0);
+            if (taken == 0)
+                break;
+
+            if (taken == m_active && inst.handler == H_jmpic) {
+                jump(inst.imm);
+            } else {
+                const Vector target = inst.handler == H_jmpic ? splat<Vector>(inst.imm) : lhs;
+                jump(select(mask_of<Mask>(taken), target, splat<Vector>((reg_t)m_pc + 1)));
+            }
+            continue;
+        }
+        case H_jmpi:
+            jump(inst.imm);
+            continue;
+        case H_break:
+            // Same as the VM, the lanes stop after the break instruction
+            // which is not executed, so not counted.
+            ++budget;
+            --m_step_count;
+            --m_pending_steps;
+            m_pc += 1;
+            stop_active(StopReason::BREAKPOINT, nullptr);
+            continue;
+        case H_alu:
+            --m_pending_steps;
+            stop_active(StopReason::ERROR, "invalid ALU code");
+            continue;
+        default:
+            --m_pending_steps;
+            stop_active(StopReason::ERROR, "invalid opcode");
+            continue;
+        }
+
+        if (++m_pc >= m_program.size()) {
+            m_pcs = select(m_active_mask, splat<Vector>((reg_t)m_pc), m_pcs);
+            reschedule();
+        }
+    }
+
+    flush_instruction_counts();
+    return m_live == 0 ? StopReason::HALTED : StopReason::BUDGET_EXHAUSTED;
+}
+
+template class LockstepVM<8>;
+template class LockstepVM<16>;
@@ -0,0 +1,159 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#ifndef ASM_VM_LOCKSTEP_HPP
+#define ASM_VM_LOCKSTEP_HPP
+
+#include "vm.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/// The vector types used by LockstepVM<Lanes>, one element per lane.
+///
+/// These are the GCC and Clang vector extensions, the compiler lowers them
+/// to the widest vector instructions enabled for the host (SSE, AVX2 or
+/// AVX-512) or to scalar code.
+template <std::size_t Lanes>
+struct LaneVectors;
+
+template <>
+struct LaneVectors<8> {
+    typedef std::uint32_t u32 __attribute__((vector_size(32)));
+    typedef std::int32_t i32 __attribute__((vector_size(32)));
+    typedef std::uint64_t u64 __attribute__((vector_size(64)));
+    typedef std::int64_t i64 __attribute__((vector_size(64)));
+};
+
+template <>
+struct LaneVectors<16> {
+    typedef std::uint32_t u32 __attribute__((vector_size(64)));
+    typedef std::int32_t i32 __attribute__((vector_size(64)));
+    typedef std::uint64_t u64 __attribute__((vector_size(128)));
+    typedef std::int64_t i64 __attribute__((vector_size(128)));
+};
+
+/// Runs up to @a Lanes instances of the same program in lockstep.
+///
+/// Each instance (a lane) has its own registers, flags and RAM, for example
+/// to run a parameter sweep over different RAM images. The registers are
+/// stored as a struct of arrays, so the ALU and shift instructions execute
+/// for all the lanes at once with vector instructions. Loads and stores are
+/// done lane by lane.
+///
+/// The lanes that are at the same PC form the active group, the only one to
+/// execute. When a conditional or register jump sends the lanes of the group
+/// to different addresses, the group is split: the lanes are parked at their
+/// own PC and the group of the lowest PC becomes active. Parked lanes join
+/// the active group again as soon as it reaches their PC, which is usually
+/// the end of the if/else or of the loop that made them diverge.
+///
+/// There is no screen, no breakpoint and no watchpoint. A lane that executes
+/// a break instruction stops with StopReason::BREAKPOINT for good.
+template <std::size_t Lanes>
+class LockstepVM {
+public:
+    using Vector = typename LaneVectors<Lanes>::u32;
+    using Mask = typename LaneVectors<Lanes>::i32;
+    /// One bit per lane.
+    using LaneSet = std::uint32_t;
+
+    static constexpr std::size_t LANES = Lanes;
+    static_assert(Lanes <= sizeof(LaneSet) * 8);
+
+    /// Creates one lane per RAM image of @a ram_data, at most LANES (the
+    /// others are ignored), all running @a program.
+    LockstepVM(std::shared_ptr<const Program> program, const std::vector<std::vector<std::uint32_t>>& ram_data);
+    ~LockstepVM();
+
+    LockstepVM(const LockstepVM&) = delete;
+    LockstepVM& operator=(const LockstepVM&) = delete;
+
+    [[nodiscard]] std::size_t get_lane_count() const { return m_lane_count; }
+
+    [[nodiscard]] reg_t get_reg(std::size_t lane, reg_index_t reg) const { return m_regs[reg][lane]; }
+    /// Sets a register of a lane before running it, writes to r0 and r1 are
+    /// ignored.
+    void set_reg(std::size_t lane, reg_index_t reg, reg_t value);
+    [[nodiscard]] packed_flags_t get_flags(std::size_t lane) const { return (packed_flags_t)m_flags[lane]; }
+    [[nodiscard]] ram_t* get_ram(std::size_t lane) const { return m_rams[lane]; }
+    /// Returns the PC of a lane, where it stopped once it did.
+    [[nodiscard]] addr_t get_pc(std::size_t lane) const { return (m_active >> lane) & 1 ? m_pc : m_pcs[lane]; }
+
+    /// Returns HALTED, BREAKPOINT or ERROR if the lane stopped, otherwise
+    /// BUDGET_EXHAUSTED.
+    [[nodiscard]] StopReason get_lane_reason(std::size_t lane) const { return m_reasons[lane]; }
+    [[nodiscard]] const char* get_error(std::size_t lane) const { return m_errors[lane]; }
+    /// Returns the count of instructions executed by a lane.
+    [[nodiscard]] std::uint64_t get_instruction_count(std::size_t lane) const { return m_instruction_counts[lane]; }
+    /// Returns the count of steps, a step executes one instruction for all
+    /// the lanes of the active group. The lanes were fully used if the sum
+    /// of their instruction counts is LANES times this count.
+    [[nodiscard]] std::uint64_t get_step_count() const { return m_step_count; }
+
+    /// Runs all the lanes until they stop, at most @a budget steps. Returns
+    /// HALTED once no lane is running (whatever the reason of each lane),
+    /// BUDGET_EXHAUSTED otherwise.
+    StopReason run(std::uint64_t budget = UINT64_MAX);
+
+private:
+    /// Writes @a value to the register slot @a rd of the active lanes.
+    void write_reg(reg_index_t rd, const Vector& value);
+    /// Writes @a flags to the flags of the active lanes.
+    void write_flags(const Vector& flags);
+
+    /// Moves the active lanes to @a target, a single address.
+    void jump(std::size_t target);
+    /// Moves each active lane to its own target in @a targets.
+    void jump(const Vector& targets);
+    /// Stops the active lanes with @a reason, at the PC of the group.
+    void stop_active(StopReason reason, const char* error);
+    /// Accounts the steps done by the active group since the last call.
+    void flush_instruction_counts();
+    /// Stops the lanes that left the program, then makes the lanes of the
+    /// lowest PC the active group. All the live lanes must be in m_pcs.
+    void reschedule();
+    void update_tick();
+
+    /// The registers of all the lanes, r0 and r1 always hold their constant
+    /// value.
+    Vector m_regs[VM::REG_SLOTS] = {};
+    /// The flags of each lane, packed as in the select of jmpc and jmpic.
+    Vector m_flags = {};
+    /// The PC of the lanes out of the active group.
+    Vector m_pcs = {};
+    Mask m_active_mask = {};
+
+    /// The PC of the active group.
+    std::size_t m_pc = 0;
+    /// The lowest PC of the parked lanes, where they join the active group.
+    std::size_t m_merge_pc = SIZE_MAX;
+    LaneSet m_active = 0;
+    /// The lanes that did not stop.
+    LaneSet m_live = 0;
+    /// The steps done by the active group since its lanes were accounted.
+    std::uint64_t m_pending_steps = 0;
+    std::uint64_t m_step_count = 0;
+
+    std::size_t m_lane_count = 0;
+    std::array<ram_t*, Lanes> m_rams = {};
+    std::array<StopReason, Lanes> m_reasons = {};
+    std::array<const char*, Lanes> m_errors = {};
+    std::array<std::uint64_t, Lanes> m_instruction_counts = {};
+
+    std::shared_ptr<const Program> m_rom;
+    /// The decoded ROM, without superinstructions.
+    std::vector<DecodedInstruction> m_program;
+
+    std::chrono::steady_clock::time_point m_previous_cycle_time;
+    std::uint32_t m_tick_countdown = VM::TICK_CHECK_INTERVAL;
+};
+
+extern template class LockstepVM<8>;
+extern template class LockstepVM<16>;
+
+#endif // ASM_VM_LOCKSTEP_HPP
@@ -0,0 +1,133 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "machine.hpp"
+#include "time_device.h"
+
+#include <algorithm>
+#include <thread>
+#include <utility>
+
+/// The write listener of the atomic device, see Machine. It runs inside the
+/// store that triggered it, so with the lock of the RAM already held.
+static void atomic_device_write(ram_t* ram, addr_t addr, word_t word) {
+    const addr_t offset = (addr - Machine::ATOMIC_BEGIN) % Machine::ATOMIC_BANK_SIZE;
+    const addr_t bank = addr - offset;
+    if (offset != Machine::ATOMIC_CAS && offset != Machine::ATOMIC_ADD)
+        return; // ATOMIC_ADDR and ATOMIC_VALUE are plain words.
+
+    const addr_t target = ram_get(ram, bank + Machine::ATOMIC_ADDR);
+    const word_t old_value = ram_get(ram, target);
+    if (offset == Machine::ATOMIC_ADD)
+        ram_set(ram, target, old_value + word);
+    else if (old_value == ram_get(ram, bank + Machine::ATOMIC_VALUE))
+        ram_set(ram, target, word);
+    ram_set(ram, bank + Machine::ATOMIC_VALUE, old_value);
+}
+
+Machine::Machine(std::shared_ptr<const Program> program, std::span<const std::uint32_t> ram_data,
+    unsigned hart_count, HartScheduling scheduling)
+    : m_ram(ram_create())
+    , m_scheduling(scheduling) {
+    hart_count = std::clamp(hart_count, 1u, MAX_HARTS);
+
+    ram_init(m_ram, ram_data.data(), ram_data.size());
+    time_device_install(m_ram);
+    ram_install_write_listener(m_ram, ATOMIC_BEGIN, ATOMIC_END, &atomic_device_write);
+    ram_set(m_ram, HART_COUNT_ADDRESS, hart_count);
+
+    // The harts of the round-robin scheduling never run at the same time,
+    // and the machine sets the tick of the time device.
+    const bool threads = scheduling == HartScheduling::THREADS;
+    std::mutex* ram_lock = threads ? &m_ram_lock : nullptr;
+    for (unsigned id = 0; id < hart_count; ++id) {
+        m_harts.push_back(std::make_unique<VM>(program, m_ram, ram_lock, threads && id == 0));
+        m_harts.back()->set_reg(VM::REG_HART_ID, id);
+        // The devices are listeners of the shared RAM. They are mapped
+        // without callbacks, so that their stores reach the RAM as before
+        // and still count as device writes.
+        for (const auto [begin, end] : { std::pair(VM::TIME_DEVICE_BEGIN, VM::TIME_DEVICE_END), std::pair(ATOMIC_BEGIN, ATOMIC_END) }) {
+            MmioDevice device;
+            device.begin = begin;
+            device.end = end;
+            m_harts.back()->map_device(device);
+        }
+        // The calendar is rewritten after the stores that request it.
+        m_harts.back()->set_stop_on_device_write(!threads);
+    }
+
+    m_results.resize(hart_count, StopReason::BUDGET_EXHAUSTED);
+}
+
+Machine::~Machine() {
+    m_harts.clear();
+    ram_destroy(m_ram);
+}
+
+void Machine::run() {
+    if (m_scheduling == HartScheduling::THREADS)
+        run_threads();
+    else
+        run_round_robin();
+}
+
+void Machine::run_threads() {
+    std::vector<std::thread> threads;
+    for (std::size_t id = 0; id < m_harts.size(); ++id)
+        threads.emplace_back([this, id] { m_results[id] = m_harts[id]->run(); });
+    for (auto& thread : threads)
+        thread.join();
+}
+
+void Machine::run_round_robin() {
+    std::vector<std::size_t> running(m_harts.size());
+    for (std::size_t id = 0; id < m_harts.size(); ++id)
+        running[id] = id;
+
+    while (!running.empty()) {
+        for (std::size_t i = 0; i < running.size();) {
+            const std::size_t id = running[i];
+            const StopReason reason = run_quantum(*m_harts[id]);
+            if (reason == StopReason::BUDGET_EXHAUSTED) {
+                ++i;
+                continue;
+            }
+
+            m_results[id] = reason;
+            running.erase(running.begin() + i);
+        }
+    }
+}
+
+StopReason Machine::run_quantum(VM& hart) {
+    std::uint64_t budget = m_quantum;
+    while (budget > 0) {
+        // One tick every m_virtual_clock instructions of all the harts, exactly.
+        const std::uint64_t chunk = std::min(budget, m_virtual_clock - m_clock % m_virtual_clock);
+        const std::uint64_t instruction_count = hart.get_instruction_count();
+        const StopReason reason = hart.run(chunk);
+        const std::uint64_t executed = hart.get_instruction_count() - instruction_count;
+        budget -= std::min(budget, executed);
+        m_clock += executed;
+        if (executed > 0 && m_clock % m_virtual_clock == 0)
+            time_device_tick(m_ram);
+
+        if (reason == StopReason::DEVICE_WRITE) {
+            // The listener of the time device just wrote the host time.
+            if (hart.get_device_write_addr() == TIME_DEVICE_SYNC && hart.get_device_write_word() > 0)
+                time_device_write_calendar(m_ram, (long long)(m_clock / m_virtual_clock));
+        } else if (reason != StopReason::BUDGET_EXHAUSTED) {
+            return reason;
+        }
+    }
+
+    return StopReason::BUDGET_EXHAUSTED;
+}
+
+std::uint64_t Machine::get_instruction_count() const {
+    std::uint64_t count = 0;
+    for (const auto& hart : m_harts)
+        count += hart->get_instruction_count();
+    return count;
+}
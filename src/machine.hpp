@@ -0,0 +1,123 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#ifndef ASM_VM_MACHINE_HPP
+#define ASM_VM_MACHINE_HPP
+
+#include "vm.hpp"
+
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+
+/// How the harts of a Machine are run.
+enum class HartScheduling {
+    /// Each hart runs on its own host thread.
+    THREADS,
+    /// The harts run one after the other on the calling thread, a quantum of
+    /// instructions each, so that two runs of a program interleave the harts
+    /// the same way. The time device follows the virtual clock of the
+    /// machine, see Machine::set_virtual_clock().
+    ROUND_ROBIN
+};
+
+/// A CPUlm machine with several harts (cores) that share one RAM.
+///
+/// Each hart is a VM with its own registers, flags and PC, all starting at
+/// the address 0 with the id of the hart (0 to hart count - 1) in the
+/// register VM::REG_HART_ID. The count of harts is in the RAM word
+/// HART_COUNT_ADDRESS. The harts always run on the interpreter and the
+/// screen is not mapped. With threads, only the hart 0 sets the tick of the
+/// time device, from the host clock.
+///
+/// Memory model: the RAM is sequentially consistent. With threads, each load
+/// and store holds the lock of the RAM, so all the harts observe one order of
+/// all the memory accesses, consistent with the program order of each hart.
+/// With the round-robin scheduling only one hart runs at a time. The
+/// registers and flags are private to each hart.
+///
+/// Atomic operations go through the atomic device, a bank of
+/// ATOMIC_BANK_SIZE words per hart from ATOMIC_BEGIN (the bank of the hart
+/// `i` is at `ATOMIC_BEGIN + i * ATOMIC_BANK_SIZE`):
+///
+///   - ATOMIC_ADDR: the address of the word to operate on;
+///   - ATOMIC_VALUE: the expected value of a compare-and-swap, receives the
+///     previous value of the word after an operation;
+///   - ATOMIC_CAS: storing `v` here writes `v` to the word if it is equal to
+///     the expected value;
+///   - ATOMIC_ADD: storing `v` here adds `v` to the word.
+///
+/// An operation is a single store, so it is atomic with respect to all the
+/// other loads and stores. A compare-and-swap succeeded if ATOMIC_VALUE was
+/// left unchanged. Each hart must only use its own bank.
+class Machine {
+public:
+    static constexpr unsigned MAX_HARTS = 64;
+    static constexpr addr_t HART_COUNT_ADDRESS = 1040;
+    static constexpr addr_t ATOMIC_BEGIN = 1044;
+    static constexpr addr_t ATOMIC_BANK_SIZE = 4;
+    static constexpr addr_t ATOMIC_END = ATOMIC_BEGIN + MAX_HARTS * ATOMIC_BANK_SIZE - 1;
+    /// The words of an atomic bank, relative to its start.
+    static constexpr addr_t ATOMIC_ADDR = 0;
+    static constexpr addr_t ATOMIC_VALUE = 1;
+    static constexpr addr_t ATOMIC_CAS = 2;
+    static constexpr addr_t ATOMIC_ADD = 3;
+    /// The instructions per second of the virtual clock, by default.
+    static constexpr std::uint64_t DEFAULT_VIRTUAL_CLOCK = 100'000'000;
+
+    /// Creates @a hart_count harts (at most MAX_HARTS) running @a program
+    /// on a RAM initialized with @a ram_data.
+    Machine(std::shared_ptr<const Program> program, std::span<const std::uint32_t> ram_data, unsigned hart_count,
+        HartScheduling scheduling);
+    ~Machine();
+
+    Machine(const Machine&) = delete;
+    Machine& operator=(const Machine&) = delete;
+
+    [[nodiscard]] unsigned get_hart_count() const { return (unsigned)m_harts.size(); }
+    [[nodiscard]] VM& get_hart(unsigned id) { return *m_harts[id]; }
+    [[nodiscard]] ram_t* get_ram() const { return m_ram; }
+
+    /// Sets the count of instructions a hart runs before the next one, with
+    /// the round-robin scheduling.
+    void set_quantum(std::uint64_t quantum) { m_quantum = quantum > 0 ? quantum : 1; }
+    /// Sets the instructions per second of the virtual clock of the
+    /// round-robin scheduling: the tick of the time device is set every
+    /// @a instructions_per_second instructions of all the harts, and the
+    /// calendar reads the time `instructions / instructions_per_second`
+    /// seconds after the Unix epoch, as with VM::set_virtual_clock(). The
+    /// harts then run the same way whatever the host.
+    void set_virtual_clock(std::uint64_t instructions_per_second) {
+        m_virtual_clock = instructions_per_second > 0 ? instructions_per_second : 1;
+    }
+
+    /// Runs all the harts until each one halts or stops on a breakpoint or
+    /// an error, see get_result().
+    void run();
+    /// Returns why the hart @a id stopped.
+    [[nodiscard]] StopReason get_result(unsigned id) const { return m_results[id]; }
+    /// Returns the count of instructions executed by all the harts.
+    [[nodiscard]] std::uint64_t get_instruction_count() const;
+
+private:
+    void run_threads();
+    void run_round_robin();
+    /// Runs @a hart for a quantum, or until it stops, and drives the time
+    /// device from the virtual clock.
+    StopReason run_quantum(VM& hart);
+
+    ram_t* m_ram;
+    std::mutex m_ram_lock;
+    HartScheduling m_scheduling;
+    std::uint64_t m_quantum = 1000;
+    std::uint64_t m_virtual_clock = DEFAULT_VIRTUAL_CLOCK;
+    /// The count of instructions executed by all the harts, with the
+    /// round-robin scheduling.
+    std::uint64_t m_clock = 0;
+    std::vector<std::unique_ptr<VM>> m_harts;
+    std::vector<StopReason> m_results;
+};
+
+#endif // ASM_VM_MACHINE_HPP
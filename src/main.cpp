@@ -3,11 +3,15 @@
 // See file LICENSE.txt for full license details.
 
 #include "linenoise.h"
+#include "machine.hpp"
 #include "repl.hpp"
 #include "vm.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 
 #include "disassembler.h"
@@ -20,6 +24,30 @@ struct CommandLineArgs {
     std::vector<std::string> ram_files;
     std::vector<std::string> rom_files;
     bool use_screen = true;
+    /// Runs the program without the REPL, see run_headless().
+    bool run = false;
+    /// Prints the count of executed instructions and the time taken.
+    bool show_time = false;
+    ExecutionEngine engine = ExecutionEngine::INTERPRETER;
+    RamBackend ram_backend = RamBackend::SPARSE;
+    /// With --run, the count of harts sharing the RAM, see run_machine().
+    unsigned harts = 1;
+    /// Runs the harts round-robin with this quantum instead of on threads.
+    std::uint64_t round_robin_quantum = 0;
+    /// The snapshot restored before the program starts.
+    std::string snapshot_in;
+    /// The snapshot saved when the program stops (--run) or the REPL exits.
+    std::string snapshot_out;
+    /// The memory limit of the execution history in MiB, 0 to not record
+    /// it, see VM::enable_history().
+    std::size_t history_mib = 0;
+    /// The file the inputs of the time device are logged to.
+    std::string record_inputs;
+    /// The file of inputs replayed instead of the host clock.
+    std::string replay_inputs;
+    /// The instructions per second of the virtual clock, 0 for the host
+    /// clock.
+    std::uint64_t virtual_clock = 0;
 } cmd_line_args = {};
 
 void show_help_message(const char* argv0) {
@@ -37,6 +65,97 @@ void parse_options(int argc, char* argv[]) {
             } else if (option == "--no-screen") {
                 cmd_line_args.use_screen = false;
                 continue;
+            } else if (option == "--run") {
+                cmd_line_args.run = true;
+                continue;
+            } else if (option == "--time") {
+                cmd_line_args.show_time = true;
+                continue;
+            } else if (option == "--engine") {
+                if (i + 1 == argc)
+                    error("missing argument to '--engine'");
+
+                const std::string_view engine = argv[++i];
+                if (engine == "interpreter" || engine == "interp") {
+                    cmd_line_args.engine = ExecutionEngine::INTERPRETER;
+                } else if (engine == "block" || engine == "blocks") {
+                    cmd_line_args.engine = ExecutionEngine::BASIC_BLOCKS;
+                } else if (engine == "jit") {
+                    cmd_line_args.engine = ExecutionEngine::JIT;
+                } else {
+                    error(std::string("unknown engine '") + engine.data() + "'");
+                }
+                continue;
+            } else if (option == "--ram-backend") {
+                if (i + 1 == argc)
+                    error("missing argument to '--ram-backend'");
+
+                const std::string_view backend = argv[++i];
+                if (backend == "sparse") {
+                    cmd_line_args.ram_backend = RamBackend::SPARSE;
+                } else if (backend == "flat") {
+                    cmd_line_args.ram_backend = RamBackend::FLAT;
+                } else {
+                    error(std::string("unknown RAM backend '") + backend.data() + "'");
+                }
+                continue;
+            } else if (option == "--harts" || option == "--round-robin") {
+                if (i + 1 == argc)
+                    error(std::string("missing argument to '") + option.data() + "'");
+
+                const char* value = argv[++i];
+                char* end = nullptr;
+                const auto number = std::strtoull(value, &end, 0);
+                if (*end != '\0' || number == 0)
+                    error(std::string("invalid argument to '") + option.data() + "'");
+
+                if (option == "--harts")
+                    cmd_line_args.harts = (unsigned)std::min<unsigned long long>(number, Machine::MAX_HARTS);
+                else
+                    cmd_line_args.round_robin_quantum = number;
+                continue;
+            } else if (option == "--history") {
+                if (i + 1 == argc)
+                    error("missing argument to '--history'");
+
+                const char* value = argv[++i];
+                char* end = nullptr;
+                cmd_line_args.history_mib = std::strtoull(value, &end, 0);
+                if (*end != '\0')
+                    error("invalid argument to '--history'");
+                continue;
+            } else if (option == "--snapshot-in" || option == "--snapshot-out") {
+                if (i + 1 == argc)
+                    error(std::string("missing argument to '") + option.data() + "'");
+
+                if (option == "--snapshot-in")
+                    cmd_line_args.snapshot_in = argv[++i];
+                else
+                    cmd_line_args.snapshot_out = argv[++i];
+                continue;
+            } else if (option == "--virtual-clock" || option.starts_with("--virtual-clock=")) {
+                const char* value = nullptr;
+                if (option.starts_with("--virtual-clock="))
+                    value = option.data() + std::strlen("--virtual-clock=");
+                else if (i + 1 < argc)
+                    value = argv[++i];
+                else
+                    error("missing argument to '--virtual-clock'");
+
+                char* end = nullptr;
+                cmd_line_args.virtual_clock = std::strtoull(value, &end, 0);
+                if (*end != '\0' || cmd_line_args.virtual_clock == 0)
+                    error("invalid argument to '--virtual-clock'");
+                continue;
+            } else if (option == "--record-inputs" || option == "--replay-inputs") {
+                if (i + 1 == argc)
+                    error(std::string("missing argument to '") + option.data() + "'");
+
+                if (option == "--record-inputs")
+                    cmd_line_args.record_inputs = argv[++i];
+                else
+                    cmd_line_args.replay_inputs = argv[++i];
+                continue;
             } else if (option == "--rom") {
                 if (i == argc)
                     error("missing argument to '--rom'");
@@ -69,20 +188,12 @@ void parse_options(int argc, char* argv[]) {
     }
 }
 
-static std::vector<std::uint32_t> read_file(const std::string& filename) {
-    std::FILE* file = std::fopen(filename.c_str(), "rb");
-    if (file == nullptr)
-        error(std::string("failed to read file '") + filename + "'");
-
-    std::vector<std::uint32_t> result;
-    std::uint32_t buffer[1024];
-    size_t read_words;
-    while ((read_words = std::fread(buffer, sizeof(std::uint32_t), sizeof(buffer) / sizeof(std::uint32_t), file)) > 0) {
-        result.insert(result.end(), buffer, buffer + read_words);
-    }
-
-    std::fclose(file);
-    return result;
+/// Maps the file @a filename, see MappedFile.
+static MappedFile map_file(const std::string& filename, bool writable) {
+    MappedFile file;
+    if (const char* failure = file.open(filename.c_str(), writable))
+        error(std::string("failed to read file '") + filename + "'; " + failure);
+    return file;
 }
 
 void term_show_cursor() {
@@ -110,12 +221,89 @@ void term_clear_until_end() {
         printf("\x1b[0J");
 }
 
-int main(int argc, char* argv[]) {
-    linenoiseClearScreen();
+static void save_snapshot(const VM& vm) {
+    if (cmd_line_args.snapshot_out.empty())
+        return;
+
+    if (const char* failure = vm.save_snapshot(cmd_line_args.snapshot_out.c_str()))
+        error(std::string("failed to save the snapshot '") + cmd_line_args.snapshot_out + "'; " + failure);
+}
+
+/// Runs the program to its end without the REPL. The exit status of the
+/// process is the low byte of rout.
+static int run_headless(VM& vm) {
+    const auto start_time = std::chrono::steady_clock::now();
+    const StopReason reason = vm.run();
+    const auto end_time = std::chrono::steady_clock::now();
+    save_snapshot(vm);
+
+    if (cmd_line_args.show_time) {
+        const double seconds = std::chrono::duration<double>(end_time - start_time).count();
+        const auto instructions = vm.get_instruction_count();
+        std::fprintf(stderr, "instructions: %llu\n", (unsigned long long)instructions);
+        std::fprintf(stderr, "time: %.3f s\n", seconds);
+        std::fprintf(stderr, "MIPS: %.2f\n", seconds > 0 ? (double)instructions / seconds / 1e6 : 0.0);
+    }
+
+    switch (reason) {
+    case StopReason::HALTED:
+        break;
+    case StopReason::ERROR:
+        error(std::string("machine code ill-formed; ") + vm.get_error());
+    default:
+        error("the program stopped on a breakpoint");
+    }
 
+    return (int)(vm.get_reg(VM::REG_OUT) & 0xff);
+}
+
+/// Runs the program on a Machine with several harts, without the REPL. The
+/// exit status of the process is the low byte of rout of the hart 0.
+static int run_machine(std::shared_ptr<const Program> program, const MappedFile& ram_file) {
+    const auto scheduling = cmd_line_args.round_robin_quantum > 0 ? HartScheduling::ROUND_ROBIN : HartScheduling::THREADS;
+    Machine machine(std::move(program), { ram_file.data(), ram_file.size() }, cmd_line_args.harts, scheduling);
+    if (scheduling == HartScheduling::ROUND_ROBIN) {
+        machine.set_quantum(cmd_line_args.round_robin_quantum);
+        if (cmd_line_args.virtual_clock > 0)
+            machine.set_virtual_clock(cmd_line_args.virtual_clock);
+    }
+
+    const auto start_time = std::chrono::steady_clock::now();
+    machine.run();
+    const auto end_time = std::chrono::steady_clock::now();
+
+    if (cmd_line_args.show_time) {
+        const double seconds = std::chrono::duration<double>(end_time - start_time).count();
+        const auto instructions = machine.get_instruction_count();
+        std::fprintf(stderr, "instructions: %llu\n", (unsigned long long)instructions);
+        std::fprintf(stderr, "time: %.3f s\n", seconds);
+        std::fprintf(stderr, "MIPS: %.2f\n", seconds > 0 ? (double)instructions / seconds / 1e6 : 0.0);
+    }
+
+    for (unsigned id = 0; id < machine.get_hart_count(); ++id) {
+        switch (machine.get_result(id)) {
+        case StopReason::HALTED:
+            break;
+        case StopReason::ERROR:
+            error("hart " + std::to_string(id) + ": machine code ill-formed; " + machine.get_hart(id).get_error());
+        default:
+            error("hart " + std::to_string(id) + ": the program stopped on a breakpoint");
+        }
+    }
+
+    return (int)(machine.get_hart(0).get_reg(VM::REG_OUT) & 0xff);
+}
+
+int main(int argc, char* argv[]) {
     std::ostream::sync_with_stdio(true);
 
     parse_options(argc, argv);
+    // The headless mode never touches the terminal.
+    if (cmd_line_args.run)
+        cmd_line_args.use_screen = false;
+
+    if (!cmd_line_args.run)
+        linenoiseClearScreen();
 
     if (cmd_line_args.rom_files.empty())
         error("missing a rom file");
@@ -124,14 +312,77 @@ int main(int argc, char* argv[]) {
     if (cmd_line_args.ram_files.size() > 1)
         error("too many ram file");
 
-    std::vector<std::uint32_t> rom_data = read_file(cmd_line_args.rom_files[0]);
-    std::vector<std::uint32_t> ram_data;
-    if (!cmd_line_args.ram_files.empty())
-        ram_data = read_file(cmd_line_args.ram_files[0]);
+    // The ROM is executed in place and the RAM image loaded lazily, see
+    // VM::load_ram_file().
+    auto program = std::make_shared<const Program>(map_file(cmd_line_args.rom_files[0], false));
+
+    if (cmd_line_args.harts > 1 || cmd_line_args.round_robin_quantum > 0) {
+        if (!cmd_line_args.run)
+            error("several harts are only supported with '--run'");
+        if (!cmd_line_args.snapshot_in.empty() || !cmd_line_args.snapshot_out.empty())
+            error("snapshots are not supported with several harts");
+        if (cmd_line_args.history_mib > 0)
+            error("the execution history is not supported with several harts");
+        if (!cmd_line_args.record_inputs.empty() || !cmd_line_args.replay_inputs.empty())
+            error("the inputs cannot be logged with several harts");
+        if (cmd_line_args.virtual_clock > 0 && cmd_line_args.round_robin_quantum == 0)
+            error("the virtual clock needs '--round-robin' with several harts");
+        if (cmd_line_args.engine != ExecutionEngine::INTERPRETER)
+            error("several harts only run on the interpreter");
+        if (cmd_line_args.ram_backend != RamBackend::SPARSE)
+            error("the flat RAM backend is not supported with several harts");
+        MappedFile ram_file;
+        if (!cmd_line_args.ram_files.empty())
+            ram_file = map_file(cmd_line_args.ram_files[0], false);
+        return run_machine(std::move(program), ram_file);
+    }
+
+    if (cmd_line_args.ram_backend == RamBackend::FLAT && cmd_line_args.use_screen)
+        error("the flat RAM backend needs '--no-screen'");
+
+    VM vm(std::move(program), {}, cmd_line_args.use_screen, cmd_line_args.rom_files[0].c_str());
+    vm.set_engine(cmd_line_args.engine);
+    vm.set_ram_backend(cmd_line_args.ram_backend);
+    if (!cmd_line_args.ram_files.empty()) {
+        if (const char* failure = vm.load_ram_file(cmd_line_args.ram_files[0].c_str()))
+            error(std::string("failed to read file '") + cmd_line_args.ram_files[0] + "'; " + failure);
+    }
+    if (!cmd_line_args.snapshot_in.empty()) {
+        if (const char* failure = vm.load_snapshot(cmd_line_args.snapshot_in.c_str()))
+            error(std::string("failed to load the snapshot '") + cmd_line_args.snapshot_in + "'; " + failure);
+    }
+
+    if (!cmd_line_args.record_inputs.empty() && !cmd_line_args.replay_inputs.empty())
+        error("'--record-inputs' and '--replay-inputs' are exclusive");
+    if ((!cmd_line_args.record_inputs.empty() || !cmd_line_args.replay_inputs.empty()) && cmd_line_args.history_mib > 0)
+        error("the inputs cannot be logged with the execution history");
+    if (cmd_line_args.virtual_clock > 0 && cmd_line_args.history_mib > 0)
+        error("the virtual clock is not supported with the execution history");
+    vm.set_virtual_clock(cmd_line_args.virtual_clock);
+
+    if (!cmd_line_args.record_inputs.empty()) {
+        if (const char* failure = vm.record_inputs(cmd_line_args.record_inputs.c_str()))
+            error(std::string("failed to record the inputs to '") + cmd_line_args.record_inputs + "'; " + failure);
+    } else if (!cmd_line_args.replay_inputs.empty()) {
+        if (const char* failure = vm.replay_inputs(cmd_line_args.replay_inputs.c_str()))
+            error(std::string("failed to replay the inputs of '") + cmd_line_args.replay_inputs + "'; " + failure);
+    }
+
+    if (cmd_line_args.history_mib > 0) {
+        if (const char* failure = vm.enable_history(cmd_line_args.history_mib << 20))
+            error(std::string("failed to record the execution history; ") + failure);
+    }
+
+    if (cmd_line_args.run) {
+        // Nothing reads the written pages but the snapshot.
+        if (cmd_line_args.snapshot_out.empty())
+            vm.stop_tracking_written_pages();
+        return run_headless(vm);
+    }
 
-    VM vm(rom_data, ram_data, cmd_line_args.use_screen, cmd_line_args.rom_files[0].c_str());
     REPL repl(vm);
     repl.run();
+    save_snapshot(vm);
 
     return 0;
 }
@@ -0,0 +1,102 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "mapped_file.hpp"
+
+#include <cstdio>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CPULM_MAPPED_FILE_MMAP 1
+#else
+#define CPULM_MAPPED_FILE_MMAP 0
+#endif
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+    : m_data(std::exchange(other.m_data, nullptr))
+    , m_size(std::exchange(other.m_size, 0))
+    , m_mapped_bytes(std::exchange(other.m_mapped_bytes, 0))
+    , m_words(std::move(other.m_words)) {
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    if (this != &other) {
+        close();
+        m_data = std::exchange(other.m_data, nullptr);
+        m_size = std::exchange(other.m_size, 0);
+        m_mapped_bytes = std::exchange(other.m_mapped_bytes, 0);
+        m_words = std::move(other.m_words);
+    }
+
+    return *this;
+}
+
+void MappedFile::close() {
+#if CPULM_MAPPED_FILE_MMAP
+    if (m_mapped_bytes != 0)
+        munmap(m_data, m_mapped_bytes);
+#endif
+    m_data = nullptr;
+    m_size = 0;
+    m_mapped_bytes = 0;
+    m_words.clear();
+}
+
+const char* MappedFile::open(const char* filename, bool writable) {
+    close();
+
+#if CPULM_MAPPED_FILE_MMAP
+    const int fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+        return "cannot open the file";
+
+    struct stat status;
+    if (fstat(fd, &status) != 0) {
+        ::close(fd);
+        return "cannot open the file";
+    }
+
+    // Pipes and other special files are read instead.
+    if (S_ISREG(status.st_mode)) {
+        const std::size_t bytes = std::size_t(status.st_size);
+        if (bytes >= sizeof(std::uint32_t)) {
+            const int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+            void* memory = mmap(nullptr, bytes, protection, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (memory == MAP_FAILED)
+                return "cannot map the file";
+
+            m_data = static_cast<std::uint32_t*>(memory);
+            m_size = bytes / sizeof(std::uint32_t);
+            m_mapped_bytes = bytes;
+            return nullptr;
+        }
+    }
+    ::close(fd);
+#else
+    (void)writable;
+#endif
+
+    std::FILE* file = std::fopen(filename, "rb");
+    if (file == nullptr)
+        return "cannot open the file";
+
+    std::uint32_t buffer[1024];
+    std::size_t read_words;
+    while ((read_words = std::fread(buffer, sizeof(std::uint32_t), sizeof(buffer) / sizeof(std::uint32_t), file)) > 0)
+        m_words.insert(m_words.end(), buffer, buffer + read_words);
+    std::fclose(file);
+
+    m_data = m_words.data();
+    m_size = m_words.size();
+    return nullptr;
+}
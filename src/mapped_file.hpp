@@ -0,0 +1,48 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#ifndef ASM_VM_MAPPED_FILE_HPP
+#define ASM_VM_MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// A file of 32-bit words (a ROM or a RAM image) mapped into memory.
+///
+/// The pages of the file are only read from the disk (or the page cache) when
+/// they are first accessed, so opening even a large image costs almost
+/// nothing. A writable mapping is private: the pages written are copied and
+/// the file is never modified. Hosts without mmap() read the whole file
+/// instead. A trailing partial word is ignored.
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /// Maps the file @a filename, copy-on-write if @a writable. Returns
+    /// nullptr on success, otherwise the reason of the failure.
+    const char* open(const char* filename, bool writable);
+
+    [[nodiscard]] std::uint32_t* data() { return m_data; }
+    [[nodiscard]] const std::uint32_t* data() const { return m_data; }
+    /// Returns the count of words.
+    [[nodiscard]] std::size_t size() const { return m_size; }
+
+private:
+    void close();
+
+    std::uint32_t* m_data = nullptr;
+    std::size_t m_size = 0;
+    /// The bytes mapped, 0 if the file was read into m_words.
+    std::size_t m_mapped_bytes = 0;
+    std::vector<std::uint32_t> m_words;
+};
+
+#endif // ASM_VM_MAPPED_FILE_HPP
@@ -0,0 +1,138 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "mmio.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+
+bool MmioMap::add(const MmioDevice& device) {
+    if (device.begin > device.end)
+        return false;
+
+    const auto it = std::lower_bound(m_devices.begin(), m_devices.end(), device.begin,
+        [](const MmioDevice& mapped, addr_t begin) { return mapped.begin < begin; });
+    if (it != m_devices.end() && it->begin <= device.end)
+        return false;
+    if (it != m_devices.begin() && std::prev(it)->end >= device.begin)
+        return false;
+
+    m_devices.insert(it, device);
+    m_begin = m_devices.front().begin;
+    // The size of the whole address space does not fit, the last word is then
+    // missed by may_contain() and found by no device.
+    m_size = std::min<std::uint64_t>(std::uint64_t(m_devices.back().end) - m_begin + 1, UINT32_MAX);
+    return true;
+}
+
+void MmioMap::remove(addr_t begin) {
+    const auto it = std::find_if(m_devices.begin(), m_devices.end(),
+        [begin](const MmioDevice& device) { return device.begin == begin; });
+    if (it == m_devices.end())
+        return;
+
+    m_devices.erase(it);
+    m_begin = m_devices.empty() ? 0 : m_devices.front().begin;
+    m_size = m_devices.empty() ? 0 : std::min<std::uint64_t>(std::uint64_t(m_devices.back().end) - m_begin + 1, UINT32_MAX);
+}
+
+const MmioDevice* MmioMap::find(addr_t addr) const {
+    // The last device that starts at or before addr.
+    const auto it = std::upper_bound(m_devices.begin(), m_devices.end(), addr,
+        [](addr_t addr, const MmioDevice& device) { return addr < device.begin; });
+    if (it == m_devices.begin() || std::prev(it)->end < addr)
+        return nullptr;
+    return &*std::prev(it);
+}
+
+word_t MmioMap::load_slow(RamRef ram, addr_t addr) const {
+    const MmioDevice* device = find(addr);
+    if (device == nullptr || device->read == nullptr)
+        return ram.get(addr);
+    return device->read(device->context, ram, addr);
+}
+
+void MmioMap::store_slow(RamRef ram, addr_t addr, word_t word) const {
+    const MmioDevice* device = find(addr);
+    if (device == nullptr || device->write == nullptr)
+        ram.set(addr, word);
+    else
+        device->write(device->context, ram, addr, word);
+}
+
+template<class OnRam, class OnDevice>
+void MmioMap::split_range(addr_t addr, std::size_t count, OnRam on_ram, OnDevice on_device) const {
+    const std::uint64_t end = std::uint64_t(addr) + count;
+    if (m_size == 0 || end <= m_begin || addr >= std::uint64_t(m_begin) + m_size) {
+        on_ram(addr, 0, count);
+        return;
+    }
+
+    // The first device that ends at or after addr, the next ones follow.
+    auto it = std::lower_bound(m_devices.begin(), m_devices.end(), addr,
+        [](const MmioDevice& device, addr_t addr) { return device.end < addr; });
+    std::uint64_t position = addr;
+    while (position < end) {
+        const std::uint64_t part_end = it != m_devices.end() ? std::min<std::uint64_t>(it->begin, end) : end;
+        if (part_end > position) {
+            on_ram(addr_t(position), std::size_t(position - addr), std::size_t(part_end - position));
+            position = part_end;
+        }
+
+        if (it == m_devices.end())
+            break;
+        const std::uint64_t device_end = std::min<std::uint64_t>(std::uint64_t(it->end) + 1, end);
+        for (; position < device_end; ++position)
+            on_device(*it, addr_t(position), std::size_t(position - addr));
+        ++it;
+    }
+}
+
+void MmioMap::read_range(RamRef ram, addr_t addr, std::span<word_t> words) const {
+    split_range(
+        addr, words.size(),
+        [&](addr_t part, std::size_t offset, std::size_t length) { ram.read_range(part, words.subspan(offset, length)); },
+        [&](const MmioDevice& device, addr_t word, std::size_t offset) {
+            words[offset] = device.read != nullptr ? device.read(device.context, ram, word) : ram.get(word);
+        });
+}
+
+void MmioMap::write_range(RamRef ram, addr_t addr, std::span<const word_t> words) const {
+    split_range(
+        addr, words.size(),
+        [&](addr_t part, std::size_t offset, std::size_t length) { ram.write_range(part, words.subspan(offset, length)); },
+        [&](const MmioDevice& device, addr_t word, std::size_t offset) {
+            if (device.write != nullptr)
+                device.write(device.context, ram, word, words[offset]);
+            else
+                ram.set(word, words[offset]);
+        });
+}
+
+void MmioMap::fill(RamRef ram, addr_t addr, word_t word, std::size_t count) const {
+    split_range(
+        addr, count,
+        [&](addr_t part, std::size_t, std::size_t length) { ram.fill(part, word, length); },
+        [&](const MmioDevice& device, addr_t device_word, std::size_t) {
+            if (device.write != nullptr)
+                device.write(device.context, ram, device_word, word);
+            else
+                ram.set(device_word, word);
+        });
+}
+
+void MmioMap::copy(RamRef ram, addr_t destination, addr_t source, std::size_t count) const {
+    copy_words(
+        destination, source, count,
+        [&](addr_t addr, std::span<word_t> words) { read_range(ram, addr, words); },
+        [&](addr_t addr, std::span<const word_t> words) { write_range(ram, addr, words); });
+}
+
+void MmioMap::restore(RamRef ram) const {
+    for (const MmioDevice& device : m_devices) {
+        if (device.restore != nullptr)
+            device.restore(device.context, ram);
+    }
+}
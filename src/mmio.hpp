@@ -0,0 +1,104 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#ifndef ASM_VM_MMIO_HPP
+#define ASM_VM_MMIO_HPP
+
+#include "flat_ram.hpp"
+
+#include <cstddef>
+#include <span>
+#include <vector>
+
+/// A device mapped into the RAM of a VM, see MmioMap.
+struct MmioDevice {
+    /// The first and the last (included) words of the device.
+    addr_t begin = 0;
+    addr_t end = 0;
+    /// Returns the word loaded from @a addr. When null, the loads read the
+    /// RAM.
+    word_t (*read)(void* context, RamRef ram, addr_t addr) = nullptr;
+    /// Called for each store of @a word to @a addr, instead of the store.
+    /// When null, the stores write the RAM.
+    void (*write)(void* context, RamRef ram, addr_t addr, word_t word) = nullptr;
+    /// Called after the host restored the words of the device in the RAM
+    /// behind its back (see VM::load_snapshot()), so that the device resyncs
+    /// its own state with them. May be null.
+    void (*restore)(void* context, RamRef ram) = nullptr;
+    /// Passed to @a read, @a write and @a restore.
+    void* context = nullptr;
+};
+
+/// The devices mapped into the RAM of a VM (memory-mapped I/O).
+///
+/// The devices are kept sorted by address, and the range from the first word
+/// of the first device to the last word of the last one is cached, so that
+/// deciding if an access goes to the RAM or maybe to a device is a single
+/// unsigned compare. Only the accesses within that range look up the device
+/// in the table.
+class MmioMap {
+public:
+    [[nodiscard]] bool empty() const { return m_devices.empty(); }
+
+    /// Maps @a device. Returns false if its range overlaps the range of a
+    /// device already mapped.
+    bool add(const MmioDevice& device);
+    /// Unmaps the device that starts at @a begin, if any.
+    void remove(addr_t begin);
+
+    /// Returns the device that holds the word @a addr, or nullptr.
+    [[nodiscard]] const MmioDevice* find(addr_t addr) const;
+    /// Returns true if @a addr may be the word of a device.
+    [[nodiscard]] bool may_contain(addr_t addr) const { return addr - m_begin < m_size; }
+    /// Returns the range from the first word of the first device, of
+    /// get_size() words, 0 while there is no device.
+    [[nodiscard]] addr_t get_begin() const { return m_begin; }
+    [[nodiscard]] addr_t get_size() const { return m_size; }
+
+    [[nodiscard]] word_t load(RamRef ram, addr_t addr) const {
+        if (may_contain(addr)) [[unlikely]]
+            return load_slow(ram, addr);
+        return ram.get(addr);
+    }
+
+    void store(RamRef ram, addr_t addr, word_t word) const {
+        if (may_contain(addr)) [[unlikely]]
+            store_slow(ram, addr, word);
+        else
+            ram.set(addr, word);
+    }
+
+    /// The bulk accesses of RamRef, for the host (snapshots, loaders, DMA).
+    /// The parts of the range outside of the devices are accessed in bulk,
+    /// and each word of a device within it goes through the device, as a
+    /// load() or store() would, in order.
+    void read_range(RamRef ram, addr_t addr, std::span<word_t> words) const;
+    void write_range(RamRef ram, addr_t addr, std::span<const word_t> words) const;
+    void fill(RamRef ram, addr_t addr, word_t word, std::size_t count) const;
+    void copy(RamRef ram, addr_t destination, addr_t source, std::size_t count) const;
+
+    /// Calls the restore callback of each device, after the host wrote the
+    /// RAM words of the devices directly.
+    void restore(RamRef ram) const;
+
+private:
+    /// Splits the @a count words from @a addr into the parts outside of the
+    /// devices, passed to @a on_ram(addr, offset, length), and the words of
+    /// the devices, passed to @a on_device(device, addr, offset). The offset
+    /// is the one of the part from @a addr.
+    template<class OnRam, class OnDevice>
+    void split_range(addr_t addr, std::size_t count, OnRam on_ram, OnDevice on_device) const;
+
+    [[nodiscard]] word_t load_slow(RamRef ram, addr_t addr) const;
+    void store_slow(RamRef ram, addr_t addr, word_t word) const;
+
+    /// Sorted by address.
+    std::vector<MmioDevice> m_devices;
+    /// The range of all the devices, `addr - m_begin < m_size` never holds
+    /// while there are none.
+    addr_t m_begin = 0;
+    addr_t m_size = 0;
+};
+
+#endif // ASM_VM_MMIO_HPP
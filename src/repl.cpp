@@ -34,10 +34,15 @@ enum class CommandID {
     REGS,
     FLAGS,
     BREAK,
+    WATCH,
     PC,
     DIS,
     STEP,
     EXECUTE,
+    RSTEP,
+    RCONTINUE,
+    SAVE,
+    LOAD,
     CLEAR
 };
 
@@ -58,6 +63,8 @@ public:
             return CommandID::FLAGS;
         } else if (ident == "b" || ident == "break") {
             return CommandID::BREAK;
+        } else if (ident == "w" || ident == "watch") {
+            return CommandID::WATCH;
         } else if (ident == "pc") {
             return CommandID::PC;
         } else if (ident == "d" || ident == "dis" || ident == "disassembler") {
@@ -66,6 +73,14 @@ public:
             return CommandID::STEP;
         } else if (ident == "e" || ident == "execute" || ident == "exec" || ident == "continue" || ident == "cont") {
             return CommandID::EXECUTE;
+        } else if (ident == "rs" || ident == "rstep") {
+            return CommandID::RSTEP;
+        } else if (ident == "rc" || ident == "rcontinue") {
+            return CommandID::RCONTINUE;
+        } else if (ident == "save") {
+            return CommandID::SAVE;
+        } else if (ident == "load") {
+            return CommandID::LOAD;
         } else if (ident == "clear") {
             return CommandID::CLEAR;
         } else {
@@ -92,6 +107,18 @@ public:
         return std::string_view(begin, std::distance(begin, m_it));
     }
 
+    /// Returns the rest of the command without the surrounding whitespace.
+    std::string parse_path() {
+        skip_whitespace();
+        const char* begin = m_it;
+        m_it += strlen(m_it);
+        const char* end = m_it;
+        while (end != begin && is_whitespace(end[-1]))
+            --end;
+
+        return std::string(begin, end);
+    }
+
     std::optional<uint32_t> parse_uint() {
         skip_whitespace();
 
@@ -137,12 +164,17 @@ static void completion_callback(const char* line, linenoiseCompletions* lc) {
         "regs",
         "flags",
         "break",
+        "watch",
         "pc",
         "dis",
         "disassembler",
         "step",
         "execute",
         "continue",
+        "rstep",
+        "rcontinue",
+        "save",
+        "load",
         "clear"
     };
 
@@ -185,6 +217,7 @@ static char* hints_callback(const char* line, int* color, int* bold) {
         }
     } break;
     case CommandID::BREAK:
+    case CommandID::WATCH:
         if (!parser.at_end())
             return nullptr;
 
@@ -201,6 +234,7 @@ static char* hints_callback(const char* line, int* color, int* bold) {
         else
             return (char*)" file";
     case CommandID::STEP:
+    case CommandID::RSTEP:
         if (!parser.at_end())
             return nullptr;
 
@@ -208,6 +242,15 @@ static char* hints_callback(const char* line, int* color, int* bold) {
             return (char*)"<n>";
         else
             return (char*)" <n>";
+    case CommandID::SAVE:
+    case CommandID::LOAD:
+        if (!parser.at_end())
+            return nullptr;
+
+        if (line[line_len - 1] == ' ')
+            return (char*)"<file>";
+        else
+            return (char*)" <file>";
     default:
         return nullptr;
     }
@@ -240,6 +283,12 @@ void REPL::run() {
     linenoiseHistorySave("/tmp/cpulm_vm_hist.txt");
 }
 
+void REPL::report_stop(StopReason reason) {
+    // Breakpoints and watchpoints are already reported by the VM.
+    if (reason == StopReason::ERROR)
+        printf("\x1b[1;31mERROR:\x1b[0m machine code ill-formed; %s\n", m_vm.get_error());
+}
+
 bool REPL::execute(const char* command) {
     CommandParser parser(command);
     CommandID command_id = parser.parse_command();
@@ -319,9 +368,20 @@ bool REPL::execute(const char* command) {
             if (!parser.expect_end())
                 goto error;
 
-            m_vm.add_breakpoint(addr.value());
+            if (!m_vm.add_breakpoint(addr.value()))
+                printf("\x1b[1;31mERROR:\x1b[0m address %#x is outside of the program\n", addr.value());
         }
     } break;
+    case CommandID::WATCH: {
+        auto addr = parser.parse_uint();
+        if (!parser.expect_end())
+            goto error;
+
+        if (!addr.has_value())
+            m_vm.print_watchpoints();
+        else
+            m_vm.add_watchpoint(addr.value());
+    } break;
     case CommandID::PC:
         if (!parser.expect_end())
             goto error;
@@ -350,10 +410,7 @@ bool REPL::execute(const char* command) {
         if (m_vm.at_end()) {
             printf("Program already terminated.\n");
         } else {
-            while (steps > 0 && !m_vm.at_end()) {
-                m_vm.step();
-                steps--;
-            }
+            report_stop(m_vm.run(steps));
         }
     } break;
     case CommandID::EXECUTE:
@@ -363,10 +420,54 @@ bool REPL::execute(const char* command) {
         if (m_vm.at_end()) {
             printf("Program already terminated.\n");
         } else {
-            m_vm.execute();
+            report_stop(m_vm.run());
         }
 
         break;
+    case CommandID::RSTEP: {
+        auto steps = parser.parse_uint().value_or(1);
+        if (!parser.expect_end())
+            goto error;
+
+        if (!m_vm.has_history()) {
+            printf("\x1b[1;31mERROR:\x1b[0m no execution history, run with --history\n");
+            break;
+        }
+
+        if (m_vm.step_back(steps) < steps)
+            printf("Oldest point of the history reached.\n");
+        printf("PC: %#x (%u)\n", m_vm.get_pc(), m_vm.get_pc());
+    } break;
+    case CommandID::RCONTINUE:
+        if (!parser.expect_end())
+            goto error;
+
+        if (!m_vm.has_history()) {
+            printf("\x1b[1;31mERROR:\x1b[0m no execution history, run with --history\n");
+            break;
+        }
+
+        if (m_vm.reverse_continue())
+            printf("Breakpoint at PC = %#x (%u) reached.\n", m_vm.get_pc(), m_vm.get_pc());
+        else
+            printf("Oldest point of the history reached, PC = %#x\n", m_vm.get_pc());
+
+        break;
+    case CommandID::SAVE:
+    case CommandID::LOAD: {
+        const std::string filename = parser.parse_path();
+        if (filename.empty())
+            goto error;
+
+        const char* failure = command_id == CommandID::SAVE ? m_vm.save_snapshot(filename.c_str())
+                                                            : m_vm.load_snapshot(filename.c_str());
+        if (failure != nullptr)
+            printf("\x1b[1;31mERROR:\x1b[0m %s\n", failure);
+        else if (command_id == CommandID::SAVE)
+            printf("Snapshot saved to '%s'\n", filename.c_str());
+        else
+            printf("Snapshot loaded from '%s', PC = %#x\n", filename.c_str(), m_vm.get_pc());
+    } break;
     case CommandID::CLEAR:
         linenoiseClearScreen();
         break;
@@ -15,6 +15,7 @@ public:
 
 private:
     bool execute(const char* command);
+    void report_stop(StopReason reason);
     void print_regs();
     void print_reg(uint32_t index);
 
@@ -0,0 +1,347 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "history.hpp"
+#include "vm.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+/*
+ * Snapshots of a VM.
+ *
+ * A snapshot is a sequence of 32-bit words in the byte order of the host,
+ * like the ROM and RAM files:
+ *
+ *   - SNAPSHOT_MAGIC and SNAPSHOT_VERSION;
+ *   - the hash of the ROM (two words, low first) and its length;
+ *   - the pc, the packed flags and the count of executed instructions (two
+ *     words, low first);
+ *   - the registers r0 to r31;
+ *   - the count of breakpoints, then the address of each breakpoint and 1 if
+ *     it is enabled, 0 otherwise;
+ *   - the count of pages, then for each page its number, the count of words
+ *     of its packed content and the packed content.
+ *
+ * Only the pages written by the VM (or shared with the frozen RAM it was
+ * cloned from) that are not all zeroes are saved. Their
+ * content is run-length encoded as packets that start with a header word:
+ * if the bit PACKET_RUN is set, the next word is repeated (header & COUNT)
+ * times, otherwise the next (header & COUNT) words are copied as is.
+ *
+ * Loading writes the words to the RAM directly, the words of the devices
+ * included, then lets the devices mapped into the RAM (see MmioMap) resync
+ * with them. The zero words are skipped when the page was never written,
+ * which makes restoring a snapshot into a fresh VM (for example to skip the
+ * boot of a program) only as costly as its non-zero words.
+ */
+
+static constexpr std::uint32_t SNAPSHOT_MAGIC = 0x4e535043; // "CPSN"
+static constexpr std::uint32_t SNAPSHOT_VERSION = 1;
+static constexpr std::uint32_t PACKET_RUN = 0x80000000;
+static constexpr std::uint32_t PACKET_COUNT = ~PACKET_RUN;
+/// Shorter runs are cheaper as part of a literal packet.
+static constexpr std::size_t MIN_RUN_LENGTH = 3;
+
+/// Appends the packets of the @a size words of @a words to @a out.
+static void pack_words(const word_t* words, std::size_t size, std::vector<std::uint32_t>& out) {
+    std::size_t literal_begin = 0;
+    const auto flush_literal = [&](std::size_t end) {
+        if (end == literal_begin)
+            return;
+        out.push_back(std::uint32_t(end - literal_begin));
+        out.insert(out.end(), words + literal_begin, words + end);
+    };
+
+    std::size_t i = 0;
+    while (i < size) {
+        std::size_t run_end = i + 1;
+        while (run_end < size && words[run_end] == words[i])
+            ++run_end;
+
+        if (run_end - i >= MIN_RUN_LENGTH) {
+            flush_literal(i);
+            out.push_back(PACKET_RUN | std::uint32_t(run_end - i));
+            out.push_back(words[i]);
+            literal_begin = run_end;
+        }
+
+        i = run_end;
+    }
+
+    flush_literal(size);
+}
+
+const char* VM::save_snapshot(const char* filename) const {
+    if (!m_track_written_pages)
+        return "the written pages are not tracked";
+
+    std::vector<std::uint32_t> out = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION };
+    const std::uint64_t hash = m_rom->get_hash();
+    out.push_back(std::uint32_t(hash));
+    out.push_back(std::uint32_t(hash >> 32));
+    out.push_back(std::uint32_t(m_code_length));
+    out.push_back(std::uint32_t(m_pc));
+    out.push_back(m_flags.get());
+    out.push_back(std::uint32_t(m_instruction_count));
+    out.push_back(std::uint32_t(m_instruction_count >> 32));
+    out.insert(out.end(), m_regs, m_regs + MachineCodeInfo::REG_COUNT);
+
+    out.push_back(std::uint32_t(m_breakpoints.size()));
+    for (const auto& [addr, breakpoint] : m_breakpoints) {
+        out.push_back(addr);
+        out.push_back(breakpoint.is_enabled);
+    }
+
+    // The pages still shared with a frozen RAM (see VM::clone()) are read
+    // from it.
+    std::set<addr_t> pages = m_written_pages.get_pages();
+    for (const FrozenRam* layer = m_copy_on_write.get_base().get(); layer != nullptr; layer = layer->below.get())
+        pages.insert(layer->pages.begin(), layer->pages.end());
+
+    const std::size_t page_count_index = out.size();
+    out.push_back(0);
+    word_t page[PageSet::PAGE_WORDS];
+    for (addr_t page_number : pages) {
+        const addr_t base = page_number << PageSet::PAGE_BITS;
+        RamRef ram = ram_ref();
+        if (!m_written_pages.contains(page_number))
+            ram = { m_copy_on_write.get_base()->find(page_number), nullptr };
+
+        ram.read_range(base, page);
+        if (std::all_of(page, page + PageSet::PAGE_WORDS, [](word_t word) { return word == 0; }))
+            continue;
+
+        out[page_count_index] += 1;
+        out.push_back(page_number);
+        const std::size_t length_index = out.size();
+        out.push_back(0);
+        pack_words(page, PageSet::PAGE_WORDS, out);
+        out[length_index] = std::uint32_t(out.size() - length_index - 1);
+    }
+
+    std::FILE* file = std::fopen(filename, "wb");
+    if (file == nullptr)
+        return "cannot open the snapshot file";
+
+    const bool written = std::fwrite(out.data(), sizeof(std::uint32_t), out.size(), file) == out.size();
+    if (std::fclose(file) != 0 || !written)
+        return "cannot write the snapshot file";
+
+    return nullptr;
+}
+
+namespace {
+/// Reads the words of a snapshot, with bounds checks.
+class SnapshotReader {
+public:
+    SnapshotReader(const std::uint32_t* begin, const std::uint32_t* end)
+        : m_it(begin)
+        , m_end(end) { }
+
+    [[nodiscard]] const std::uint32_t* position() const { return m_it; }
+    [[nodiscard]] std::size_t remaining() const { return m_end - m_it; }
+
+    bool read(std::uint32_t& value) {
+        if (m_it == m_end)
+            return false;
+        value = *m_it++;
+        return true;
+    }
+
+    bool read(std::uint64_t& value) {
+        std::uint32_t low, high;
+        if (!read(low) || !read(high))
+            return false;
+        value = (std::uint64_t(high) << 32) | low;
+        return true;
+    }
+
+    bool skip(std::size_t count) {
+        if (remaining() < count)
+            return false;
+        m_it += count;
+        return true;
+    }
+
+private:
+    const std::uint32_t* m_it;
+    const std::uint32_t* m_end;
+};
+} // namespace
+
+/// Returns true if the @a length words of @a packed unpack to exactly one
+/// page.
+static bool check_packed_page(const std::uint32_t* packed, std::size_t length) {
+    SnapshotReader reader(packed, packed + length);
+    std::size_t size = 0;
+    std::uint32_t header;
+    while (reader.read(header)) {
+        const std::size_t count = header & PACKET_COUNT;
+        if (count == 0 || !reader.skip((header & PACKET_RUN) ? 1 : count))
+            return false;
+        size += count;
+        if (size > PageSet::PAGE_WORDS)
+            return false;
+    }
+
+    return size == PageSet::PAGE_WORDS;
+}
+
+static bool read_snapshot_file(const char* filename, std::vector<std::uint32_t>& words) {
+    std::FILE* file = std::fopen(filename, "rb");
+    if (file == nullptr)
+        return false;
+
+    bool ok = std::fseek(file, 0, SEEK_END) == 0;
+    const long size = ok ? std::ftell(file) : -1;
+    ok = size >= 0 && size % sizeof(std::uint32_t) == 0 && std::fseek(file, 0, SEEK_SET) == 0;
+    if (ok) {
+        words.resize(size / sizeof(std::uint32_t));
+        ok = std::fread(words.data(), sizeof(std::uint32_t), words.size(), file) == words.size();
+    }
+
+    std::fclose(file);
+    return ok;
+}
+
+const char* VM::load_snapshot(const char* filename) {
+    if (!m_track_written_pages)
+        return "the written pages are not tracked";
+
+    std::vector<std::uint32_t> words;
+    if (!read_snapshot_file(filename, words))
+        return "cannot read the snapshot file";
+
+    // Check the whole snapshot before changing anything.
+    SnapshotReader reader(words.data(), words.data() + words.size());
+    std::uint32_t magic, version, rom_length, pc, flags, breakpoint_count, page_count;
+    std::uint64_t rom_hash, instruction_count;
+    if (!reader.read(magic) || magic != SNAPSHOT_MAGIC || !reader.read(version))
+        return "not a snapshot file";
+    if (version != SNAPSHOT_VERSION)
+        return "unsupported snapshot version";
+    if (!reader.read(rom_hash) || !reader.read(rom_length))
+        return "truncated snapshot file";
+    if (rom_hash != m_rom->get_hash() || rom_length != m_code_length)
+        return "the snapshot was taken with another ROM";
+
+    if (!reader.read(pc) || !reader.read(flags) || !reader.read(instruction_count))
+        return "truncated snapshot file";
+    const std::uint32_t* const regs = reader.position();
+    if (!reader.skip(MachineCodeInfo::REG_COUNT) || !reader.read(breakpoint_count))
+        return "truncated snapshot file";
+
+    const std::uint32_t* const breakpoints = reader.position();
+    if (breakpoint_count > reader.remaining() / 2)
+        return "truncated snapshot file";
+    reader.skip(breakpoint_count * 2);
+    for (std::uint32_t i = 0; i < breakpoint_count; ++i) {
+        if (breakpoints[2 * i] >= m_code_length)
+            return "invalid breakpoint in the snapshot file";
+    }
+
+    if (!reader.read(page_count))
+        return "truncated snapshot file";
+    const std::uint32_t* const pages = reader.position();
+    std::set<addr_t> snapshot_pages;
+    for (std::uint32_t i = 0; i < page_count; ++i) {
+        std::uint32_t page_number, length;
+        if (!reader.read(page_number) || !reader.read(length) || page_number >= (1u << (32 - PageSet::PAGE_BITS)))
+            return "truncated snapshot file";
+        if (length > reader.remaining() || !check_packed_page(reader.position(), length))
+            return "invalid page in the snapshot file";
+        reader.skip(length);
+        snapshot_pages.insert(page_number);
+    }
+
+    // The RAM: stop sharing the pages of a frozen RAM, as the snapshot
+    // replaces all of them, clear the written pages that are not in the
+    // snapshot, then unpack the others. The words of the devices are
+    // restored as they were saved, raw, without the side effects of a store
+    // (a store to TIME_DEVICE_SYNC would read the host clock), and the
+    // devices resync once everything is restored.
+    m_copy_on_write.reset(m_ram, nullptr);
+    m_frozen_at = UINT64_MAX;
+    const RamRef ram = ram_ref();
+    word_t page[PageSet::PAGE_WORDS];
+    for (addr_t page_number : m_written_pages.get_pages()) {
+        if (snapshot_pages.contains(page_number))
+            continue;
+
+        const addr_t base = page_number << PageSet::PAGE_BITS;
+        ram.read_range(base, page);
+        if (std::any_of(page, page + PageSet::PAGE_WORDS, [](word_t word) { return word != 0; }))
+            ram.fill(base, 0, PageSet::PAGE_WORDS);
+    }
+
+    reader = SnapshotReader(pages, words.data() + words.size());
+    for (std::uint32_t i = 0; i < page_count; ++i) {
+        std::uint32_t page_number, length;
+        reader.read(page_number);
+        reader.read(length);
+        // A page never written only holds zeroes.
+        const bool was_written = m_written_pages.get_pages().contains(page_number);
+        m_written_pages.add_page(page_number);
+
+        addr_t addr = page_number << PageSet::PAGE_BITS;
+        const std::uint32_t* packed = reader.position();
+        const std::uint32_t* const packed_end = packed + length;
+        reader.skip(length);
+        while (packed != packed_end) {
+            const std::uint32_t header = *packed++;
+            const std::uint32_t count = header & PACKET_COUNT;
+            if (header & PACKET_RUN) {
+                const word_t word = *packed++;
+                if (word != 0 || was_written)
+                    ram.fill(addr, word, count);
+            } else {
+                const std::span<const word_t> literal(packed, count);
+                if (was_written) {
+                    ram.write_range(addr, literal);
+                } else {
+                    for_each_nonzero_run(literal, [ram, addr](std::size_t offset, std::span<const word_t> run) {
+                        ram.write_range(addr_t(addr + offset), run);
+                    });
+                }
+                packed += count;
+            }
+            addr += count;
+        }
+    }
+
+    m_mmio.restore(ram);
+
+    // The breakpoints, patched into the program again.
+    for (auto& [addr, breakpoint] : m_breakpoints) {
+        breakpoint.disable(patchable_program());
+        program_changed(addr);
+    }
+    m_breakpoints.clear();
+    for (std::uint32_t i = 0; i < breakpoint_count; ++i) {
+        Breakpoint breakpoint;
+        breakpoint.addr = breakpoints[2 * i];
+        if (breakpoints[2 * i + 1] != 0) {
+            breakpoint.enable(patchable_program());
+            program_changed(breakpoint.addr);
+        }
+        m_breakpoints.insert({ breakpoint.addr, breakpoint });
+    }
+
+    m_pc = pc;
+    m_flags.set(flags);
+    m_instruction_count = instruction_count;
+    std::memcpy(m_regs, regs, MachineCodeInfo::REG_COUNT * sizeof(reg_t));
+    m_regs[0] = 0;
+    m_regs[1] = 1;
+
+    // The inputs logged before the load would not replay.
+    close_input_log();
+    // The history cannot go back through the load. The input log was just
+    // closed and the clock was not virtual, so it starts again.
+    if (m_history != nullptr)
+        enable_history(m_history->get_memory_limit());
+    return nullptr;
+}
@@ -0,0 +1,109 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "thread_pool.hpp"
+
+/// The pool and queue of the worker running on this thread, if any.
+static thread_local const ThreadPool* current_pool = nullptr;
+static thread_local std::size_t current_queue = 0;
+
+ThreadPool::ThreadPool(std::size_t thread_count) {
+    if (thread_count == 0)
+        thread_count = 1;
+
+    for (std::size_t i = 0; i < thread_count; ++i)
+        m_queues.push_back(std::make_unique<Queue>());
+    for (std::size_t i = 0; i < thread_count; ++i)
+        m_threads.emplace_back(&ThreadPool::worker_loop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    wait();
+
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+    }
+
+    m_task_available.notify_all();
+    for (auto& thread : m_threads)
+        thread.join();
+}
+
+void ThreadPool::submit(Task task) {
+    const std::size_t index = current_pool == this
+        ? current_queue
+        : m_next_queue.fetch_add(1, std::memory_order_relaxed) % m_queues.size();
+
+    // Queued before being counted so that a worker woken by the count finds
+    // the task. A worker may still take it before it is counted, m_queued
+    // is then negative for a moment.
+    m_unfinished.fetch_add(1);
+    {
+        std::lock_guard lock(m_queues[index]->mutex);
+        m_queues[index]->tasks.push_back(std::move(task));
+    }
+
+    {
+        std::lock_guard lock(m_mutex);
+        m_queued.fetch_add(1);
+    }
+
+    m_task_available.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock lock(m_mutex);
+    m_all_done.wait(lock, [this] { return m_unfinished.load() == 0; });
+}
+
+bool ThreadPool::pop_task(std::size_t index, Task& task) {
+    {
+        Queue& queue = *m_queues[index];
+        std::lock_guard lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            return true;
+        }
+    }
+
+    for (std::size_t i = 1; i < m_queues.size(); ++i) {
+        Queue& victim = *m_queues[(index + i) % m_queues.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ThreadPool::worker_loop(std::size_t index) {
+    current_pool = this;
+    current_queue = index;
+
+    while (true) {
+        {
+            std::unique_lock lock(m_mutex);
+            m_task_available.wait(lock, [this] { return m_stopping || m_queued.load() > 0; });
+            if (m_stopping && m_queued.load() <= 0)
+                return;
+        }
+
+        Task task;
+        if (!pop_task(index, task))
+            continue; // Another worker was faster.
+
+        m_queued.fetch_sub(1);
+        task();
+
+        if (m_unfinished.fetch_sub(1) == 1) {
+            std::lock_guard lock(m_mutex);
+            m_all_done.notify_all();
+        }
+    }
+}
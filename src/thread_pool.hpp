@@ -0,0 +1,69 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#ifndef ASM_VM_THREAD_POOL_HPP
+#define ASM_VM_THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// A fixed-size pool of threads with work stealing.
+///
+/// Each worker has its own queue of tasks. A worker takes the oldest task of
+/// its own queue and, when it is empty, steals the most recent task of
+/// another worker. Tasks submitted from outside of the pool are spread over
+/// the queues, tasks submitted by a task go to the back of the queue of its
+/// worker: a task that resubmits itself lets the other tasks of the queue
+/// run first, which is what GuestScheduler relies on.
+class ThreadPool {
+public:
+    using Task = std::function<void()>;
+
+    /// Creates @a thread_count workers, by default one per host core.
+    explicit ThreadPool(std::size_t thread_count = std::thread::hardware_concurrency());
+    /// Waits for all the submitted tasks then stops the workers.
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    [[nodiscard]] std::size_t size() const { return m_threads.size(); }
+
+    void submit(Task task);
+    /// Blocks until all the submitted tasks are done.
+    void wait();
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void worker_loop(std::size_t index);
+    /// Takes a task from the queue @a index or steals one from another queue.
+    bool pop_task(std::size_t index, Task& task);
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_mutex;
+    std::condition_variable m_task_available;
+    std::condition_variable m_all_done;
+    /// The count of tasks in the queues, only increased with m_mutex held and
+    /// after the task was queued, see submit().
+    std::atomic<std::ptrdiff_t> m_queued = 0;
+    /// The count of tasks submitted and not yet finished.
+    std::atomic<std::size_t> m_unfinished = 0;
+    std::atomic<std::size_t> m_next_queue = 0;
+    bool m_stopping = false;
+};
+
+#endif // ASM_VM_THREAD_POOL_HPP
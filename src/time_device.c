@@ -0,0 +1,57 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "time_device.h"
+
+#include <time.h>
+
+static void write_calendar(ram_t* ram, const struct tm* tm) {
+    ram_set(ram, 1025, 0);
+    ram_set(ram, 1026, 1);
+    ram_set(ram, 1027, tm->tm_sec % 60 /* because of the leap second */);
+    ram_set(ram, 1028, tm->tm_min);
+    ram_set(ram, 1029, tm->tm_hour);
+    ram_set(ram, 1030, tm->tm_mday);
+    ram_set(ram, 1031, tm->tm_mon);
+    ram_set(ram, 1032, tm->tm_year + 1900);
+    ram_set(ram, 1033, (tm->tm_wday + 6) % 7);
+}
+
+void time_device_sync(ram_t* ram) {
+    time_t now = time(0);
+    struct tm local_time;
+    // The reentrant variants, as many VM may run on different threads.
+#ifdef _WIN32
+    localtime_s(&local_time, &now);
+#else
+    localtime_r(&now, &local_time);
+#endif
+    write_calendar(ram, &local_time);
+}
+
+static void synchronize_time(ram_t* ram, addr_t addr, word_t word) {
+    (void)addr;
+
+    if (word > 0)
+        time_device_sync(ram);
+}
+
+void time_device_install(ram_t* ram) {
+    ram_install_write_listener(ram, TIME_DEVICE_SYNC, TIME_DEVICE_SYNC, &synchronize_time);
+}
+
+void time_device_tick(ram_t* ram) {
+    ram_set(ram, TIME_DEVICE_TICK, 1);
+}
+
+void time_device_write_calendar(ram_t* ram, long long seconds) {
+    const time_t time = (time_t)seconds;
+    struct tm utc_time;
+#ifdef _WIN32
+    gmtime_s(&utc_time, &time);
+#else
+    gmtime_r(&time, &utc_time);
+#endif
+    write_calendar(ram, &utc_time);
+}
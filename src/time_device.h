@@ -0,0 +1,44 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+// The time device, shared by the VM and the native programs built by cpulm_aot.
+
+#ifndef CPULM_TIME_DEVICE_H
+#define CPULM_TIME_DEVICE_H
+
+#include "memory.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// The RAM word set to 1 every second.
+#define TIME_DEVICE_TICK 1024
+/// Writing a non zero value to this RAM word refreshes the calendar.
+#define TIME_DEVICE_SYNC 1025
+
+/// @brief Installs the calendar of the time device on the given RAM.
+///
+/// When the program writes a non zero value to TIME_DEVICE_SYNC, the current
+/// local time is written to the words 1025 to 1033.
+void time_device_install(ram_t* ram);
+
+/// @brief Writes the calendar of the current local time, as the listener
+/// installed by time_device_install() does.
+///
+/// For the drivers that dispatch the stores to the devices themselves.
+void time_device_sync(ram_t* ram);
+
+/// @brief Signals the program that one second elapsed.
+void time_device_tick(ram_t* ram);
+
+/// @brief Writes the calendar of the time @a seconds seconds after the Unix
+/// epoch, in UTC, as if the program had requested it.
+void time_device_write_calendar(ram_t* ram, long long seconds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // !CPULM_TIME_DEVICE_H
@@ -4,307 +4,666 @@
 
 #include "vm.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
+#include "history.hpp"
+#include "input_log.hpp"
+#include "jit.hpp"
 #include "screen.h"
+#include "time_device.h"
 #include "utils.h"
 
-void Breakpoint::enable(inst_t* code) {
-    old_inst = code[addr];
-    code[addr] = OP_break;
+static reg_index_t destination_slot(reg_index_t reg) {
+    return reg <= 1 ? VM::REG_DISCARD : reg;
+}
+
+handler_t DecodedInstruction::base_handler() const {
+    if (opcode == OP_alu) {
+        switch (alucode) {
+#define BINARY_INSTRUCTION(name, func) \
+    case BF_##name:                    \
+        return H_alu_##name;
+#include "instructions.def"
+        default:
+            return H_alu;
+        }
+    }
+
+    switch (opcode) {
+#define INSTRUCTION(name, opcode) \
+    case OP_##name:               \
+        return H_##name;
+#define BINARY_INSTRUCTION(name, func)
+#include "instructions.def"
+    default:
+        return H_invalid;
+    }
+}
+
+DecodedInstruction DecodedInstruction::decode(inst_t instruction, addr_t addr) {
+    InstructionDecoder decoder;
+    decoder.instruction = instruction;
+
+    DecodedInstruction decoded;
+    decoded.opcode = decoder.get_opcode();
+    switch (decoded.opcode) {
+    case OP_alu:
+        decoded.rd = destination_slot(decoder.get_reg());
+        decoded.rs1 = decoder.get_reg();
+        decoded.rs2 = decoder.get_reg();
+        decoded.alucode = decoder.get_alucode();
+        break;
+    case OP_lsl:
+    case OP_asr:
+    case OP_lsr:
+        decoded.rd = destination_slot(decoder.get_reg());
+        decoded.rs1 = decoder.get_reg();
+        decoded.rs2 = decoder.get_reg();
+        break;
+    case OP_load:
+        decoded.rd = destination_slot(decoder.get_reg());
+        decoded.rs1 = decoder.get_reg();
+        break;
+    case OP_store:
+        decoded.rs1 = decoder.get_reg();
+        decoded.rs2 = decoder.get_reg();
+        break;
+    case OP_loadi: {
+        decoded.rd = destination_slot(decoder.get_reg());
+        decoded.rs1 = decoder.get_reg();
+        const reg_t imm = decoder.get(16);
+        const bool lhw = decoder.get(1);
+        decoded.imm = lhw ? imm : (imm << 16);
+    } break;
+    case OP_jmp:
+        decoded.rs1 = decoder.get_reg();
+        break;
+    case OP_jmpc:
+        decoded.rs1 = decoder.get_reg();
+        decoded.select = decoder.get(MachineCodeInfo::NB_FLAGS);
+        break;
+    case OP_jmpi:
+        decoded.imm = addr + sign_extend_24(decoder.get(24));
+        break;
+    case OP_jmpic:
+        decoded.imm = addr + sign_extend_24(decoder.get(24));
+        decoded.select = decoder.get(MachineCodeInfo::NB_FLAGS);
+        break;
+    default:
+        break;
+    }
+
+    decoded.handler = decoded.base_handler();
+    return decoded;
+}
+
+static handler_t superinstruction_handler(const DecodedInstruction& first, const DecodedInstruction& second) {
+    if (first.handler == H_alu_sub) {
+        switch (second.opcode) {
+        case OP_jmpc:
+            return H_sub_jmpc;
+        case OP_jmpic:
+            return H_sub_jmpic;
+        case OP_jmpi:
+            return H_sub_jmpi;
+        default:
+            break;
+        }
+    } else if (first.handler == H_alu_add && second.opcode == OP_jmpi) {
+        return H_add_jmpi;
+    } else if (first.opcode == OP_loadi && second.opcode == OP_loadi) {
+        return H_loadi_loadi;
+    }
+
+    return (handler_t)first.handler;
+}
+
+void Breakpoint::enable(DecodedInstruction* code) {
+    if (!is_enabled)
+        old_inst = code[addr];
+    code[addr] = DecodedInstruction::decode(OP_break, addr);
     is_enabled = true;
 }
 
-void Breakpoint::disable(inst_t* code) {
-    code[addr] = old_inst;
+void Breakpoint::disable(DecodedInstruction* code) {
+    if (is_enabled)
+        code[addr] = old_inst;
     is_enabled = false;
 }
 
-static void synchronize_time(ram_t* ram, addr_t addr, word_t word) {
-    if (word > 0) {
-        time_t now = time(0);
-        tm* tm = localtime(&now);
-
-        ram_set(ram, 1025, 0);
-        ram_set(ram, 1026, 1);
-        ram_set(ram, 1027, tm->tm_sec % 60 /* because of the leap second */);
-        ram_set(ram, 1028, tm->tm_min);
-        ram_set(ram, 1029, tm->tm_hour);
-        ram_set(ram, 1030, tm->tm_mday);
-        ram_set(ram, 1031, tm->tm_mon);
-        ram_set(ram, 1032, tm->tm_year + 1900);
-        ram_set(ram, 1033, (tm->tm_wday + 6) % 7);
+Program::Program(std::vector<inst_t> code)
+    : m_code_storage(std::move(code)) {
+    m_code = m_code_storage.data();
+    m_length = m_code_storage.size();
+    decode();
+}
+
+Program::Program(MappedFile rom)
+    : m_rom(std::move(rom)) {
+    m_code = m_rom.data();
+    m_length = m_rom.size();
+    decode();
+}
+
+void Program::decode() {
+    m_decoded.reserve(m_length);
+    for (size_t addr = 0; addr < m_length; ++addr)
+        m_decoded.push_back(DecodedInstruction::decode(m_code[addr], addr));
+    for (size_t addr = 0; addr < m_length; ++addr)
+        fuse_at(m_decoded, addr);
+
+    // FNV-1a
+    m_hash = 0xcbf29ce484222325;
+    for (size_t addr = 0; addr < m_length; ++addr) {
+        m_hash ^= m_code[addr];
+        m_hash *= 0x100000001b3;
+    }
+}
+
+void PageSet::add_range(addr_t begin, std::size_t count) {
+    if (count == 0)
+        return;
+
+    const std::uint64_t last = std::min<std::uint64_t>(std::uint64_t(begin) + count - 1, UINT32_MAX);
+    for (std::uint64_t page = begin >> PAGE_BITS; page <= (last >> PAGE_BITS); ++page)
+        add_page((addr_t)page);
+}
+
+void Program::fuse_at(std::vector<DecodedInstruction>& program, addr_t addr) {
+    DecodedInstruction& first = program[addr];
+    first.handler = first.base_handler();
+    if (addr + 1 < program.size())
+        first.handler = superinstruction_handler(first, program[addr + 1]);
+}
+
+FrozenRam::~FrozenRam() {
+    ram_destroy(ram);
+}
+
+ram_t* FrozenRam::find(addr_t page) const {
+    for (const FrozenRam* layer = this; layer != nullptr; layer = layer->below.get()) {
+        if (layer->pages.contains(page))
+            return layer->ram;
+    }
+
+    return nullptr;
+}
+
+void CopyOnWrite::reset(ram_t* ram, std::shared_ptr<const FrozenRam> base) {
+    m_base = std::move(base);
+    m_checked.fill(NO_PAGE);
+    if (m_base == nullptr)
+        return;
+
+    // A PageSet always holds the page 0 and the page of the devices, so
+    // they look written already and are copied right away instead.
+    for (addr_t page : { addr_t(0), PageSet::DEVICE_PAGE }) {
+        copy_from_base(ram, page);
+        m_checked[page % CHECKED_SIZE] = page;
     }
 }
 
-VM::VM(std::vector<std::uint32_t>& rom_data, const std::vector<std::uint32_t>& ram_data, bool use_screen, const char* code_filename)
+void CopyOnWrite::copy_page(ram_t* ram, PageSet& written_pages, addr_t page) {
+    m_checked[page % CHECKED_SIZE] = page;
+    // The pages already written to the RAM of the VM are its own.
+    if (written_pages.contains(page))
+        return;
+
+    if (copy_from_base(ram, page))
+        written_pages.add_page(page);
+}
+
+bool CopyOnWrite::copy_from_base(ram_t* ram, addr_t page) const {
+    ram_t* const source = m_base->find(page);
+    if (source == nullptr)
+        return false;
+
+    // Frozen RAM are only read, which SparseMemory allows from many threads.
+    const addr_t base = page << PageSet::PAGE_BITS;
+    word_t words[PageSet::PAGE_WORDS];
+    RamRef { source, nullptr }.read_range(base, words);
+    for_each_nonzero_run(words, [ram, base](std::size_t offset, std::span<const word_t> run) {
+        RamRef { ram, nullptr }.write_range(addr_t(base + offset), run);
+    });
+    return true;
+}
+
+/// The time device as mapped by the VM: its words are RAM, and a store of a
+/// non zero value to TIME_DEVICE_SYNC also writes the calendar.
+static void time_device_write(void*, RamRef ram, addr_t addr, word_t word) {
+    ram.set(addr, word);
+    // The page of the time device is always in SparseMemory.
+    if (addr == TIME_DEVICE_SYNC && word > 0)
+        time_device_sync(ram.sparse);
+}
+
+/// The screen is a global of SparseMemory, so only one VM can map it.
+static std::atomic<bool> screen_in_use = false;
+
+VM::VM(std::shared_ptr<const Program> program, const std::vector<std::uint32_t>& ram_data, bool use_screen, const char* code_filename)
     : m_code_filename(code_filename)
-    , m_code(rom_data.data())
-    , m_code_length(rom_data.size())
+    , m_rom(std::move(program))
+    , m_code(m_rom->get_code())
+    , m_code_length(m_rom->get_length())
+    , m_program(m_rom->get_decoded().data())
     , m_ram(ram_create())
     , m_use_screen(use_screen) {
+    if (m_use_screen && screen_in_use.exchange(true)) {
+        warning("the screen is already used by another VM");
+        m_use_screen = false;
+    }
+
     if (m_use_screen)
         screen_init_with_ram_mapping(m_ram);
     ram_init(m_ram, ram_data.data(), ram_data.size());
-    ram_install_write_listener(m_ram, 1025, 1025, &synchronize_time);
+    m_written_pages.add_range(0, ram_data.size());
+
+    MmioDevice time_device;
+    time_device.begin = TIME_DEVICE_BEGIN;
+    time_device.end = TIME_DEVICE_END;
+    time_device.write = &time_device_write;
+    m_mmio.add(time_device);
     m_previous_cycle_time = std::chrono::steady_clock::now();
 }
 
-VM::~VM() {
-    ram_destroy(m_ram);
-    if (m_use_screen)
-        screen_terminate();
+VM::VM(const std::vector<std::uint32_t>& rom_data, const std::vector<std::uint32_t>& ram_data, bool use_screen, const char* code_filename)
+    : VM(std::make_shared<const Program>(rom_data), ram_data, use_screen, code_filename) {
 }
 
-void VM::execute() {
-    while (!at_end() && !m_at_breakpoint) {
-        step();
+VM::VM(std::shared_ptr<const Program> program, ram_t* ram, std::mutex* ram_lock, bool drives_clock)
+    : m_code_filename(nullptr)
+    , m_rom(std::move(program))
+    , m_code(m_rom->get_code())
+    , m_code_length(m_rom->get_length())
+    , m_program(m_rom->get_decoded().data())
+    , m_ram(ram)
+    , m_owns_ram(false)
+    , m_ram_lock(ram_lock)
+    , m_drives_clock(drives_clock) {
+    m_previous_cycle_time = std::chrono::steady_clock::now();
+}
+
+VM::~VM() {
+    close_input_log();
+    if (m_use_screen) {
+        screen_terminate();
+        screen_in_use = false;
     }
+    if (m_owns_ram)
+        ram_destroy(m_ram);
+}
 
-    m_at_breakpoint = false;
+StopReason VM::run(std::uint64_t budget) {
+    if (m_input_log != nullptr || m_virtual_clock != 0)
+        return run_clocked(budget);
+    return run_engine(budget);
 }
 
-void VM::step() {
-    if (at_end())
-        return;
+StopReason VM::run_engine(std::uint64_t budget) {
+    if (m_history != nullptr)
+        return run_recorded(budget);
 
-    auto now = std::chrono::steady_clock::now();
-    auto dur = std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_previous_cycle_time).count();
-    if (dur >= 1'000'000'000) {
-        // 1 second has elapsed
-        ram_set(m_ram, 1024, 1);
-        m_previous_cycle_time = now;
+    switch (m_engine) {
+    case ExecutionEngine::BASIC_BLOCKS:
+    case ExecutionEngine::JIT:
+        return run_blocks(budget);
+    case ExecutionEngine::INTERPRETER:
+    default:
+        return run_loop(budget);
     }
+}
 
-    InstructionDecoder decoder;
-    if (m_pc >= m_code_length) {
-        VM::error("jumping outside of program.");
+void VM::set_engine(ExecutionEngine engine) {
+    if (engine == ExecutionEngine::JIT && !Jit::is_supported()) {
+        warning("the JIT is not supported on this host, using the interpreter");
+        engine = ExecutionEngine::INTERPRETER;
     }
 
-    decoder.instruction = m_code[m_pc];
-    m_pc++;
-    execute(decoder);
+    m_engine = engine;
+    m_blocks.clear();
+    if (m_engine == ExecutionEngine::JIT)
+        m_jit = std::make_unique<Jit>();
+    else
+        m_jit.reset();
 }
 
-bool VM::test_flags(size_t select) {
-    for (int i = 0; i < MachineCodeInfo::NB_FLAGS; i++)
-        if (((select & (1 << i)) != 0) && m_flags[i])
-            return true;
-    return false;
+const char* VM::load_ram_file(const char* filename) {
+    MappedFile image;
+    if (const char* failure = image.open(filename, m_flat_ram != nullptr))
+        return failure;
+
+    m_written_pages.add_range(0, image.size());
+    if (m_flat_ram != nullptr)
+        m_flat_ram->map_image(std::move(image));
+    else
+        ram_init(m_ram, image.data(), image.size());
+    // The next clone() must not share the RAM frozen before the load.
+    m_frozen_at = UINT64_MAX;
+    return nullptr;
 }
 
-void VM::execute(InstructionDecoder instruction) {
-    const opcode_t opcode = instruction.get_opcode();
-    switch (opcode) {
-    case OP_alu:
-        return execute_alu(instruction);
-    case OP_lsl:
-        return execute_lsl(instruction);
-    case OP_asr:
-        return execute_asr(instruction);
-    case OP_lsr:
-        return execute_lsr(instruction);
-    case OP_load:
-        return execute_load(instruction);
-    case OP_loadi:
-        return execute_loadi(instruction);
-    case OP_store:
-        return execute_store(instruction);
-    case OP_jmp:
-        return execute_jmp(instruction);
-    case OP_jmpi:
-        return execute_jmpi(instruction);
-    case OP_jmpc:
-        return execute_jmpc(instruction);
-    case OP_jmpic:
-        return execute_jmpic(instruction);
-    case OP_break:
-        return execute_break(instruction);
-    default:
-        error("invalid opcode");
-        return;
+void VM::read_ram(addr_t addr, std::span<word_t> words) const {
+    // The pages still shared with a frozen RAM (see clone()) are read from
+    // it, a page at a time.
+    std::size_t done = 0;
+    while (done < words.size()) {
+        const addr_t part_addr = addr_t(addr + done);
+        const addr_t page = part_addr >> PageSet::PAGE_BITS;
+        const std::size_t length = std::min<std::size_t>(words.size() - done, PageSet::PAGE_WORDS - (part_addr & (PageSet::PAGE_WORDS - 1)));
+        const std::span<word_t> part = words.subspan(done, length);
+        if (!m_copy_on_write.is_active() || m_written_pages.contains(page))
+            ram_ref().read_range(part_addr, part);
+        else if (ram_t* frozen = m_copy_on_write.get_base()->find(page))
+            RamRef { frozen, nullptr }.read_range(part_addr, part);
+        else
+            std::fill(part.begin(), part.end(), 0);
+        done += length;
     }
 }
 
-void VM::execute_alu(InstructionDecoder instruction) {
-    // TODO : update the flags
-    reg_index_t rd = instruction.get_reg();
-    reg_index_t rs1 = instruction.get_reg();
-    reg_index_t rs2 = instruction.get_reg();
-    alucode_t alucode = instruction.get_alucode();
-
-    const reg_t rs1_val = get_reg(rs1);
-    const reg_t rs2_val = get_reg(rs2);
+void VM::set_ram_backend(RamBackend backend) {
+    if (backend == get_ram_backend())
+        return;
+    if (!m_track_written_pages) {
+        warning("the written pages are not tracked, the RAM backend is kept");
+        return;
+    }
 
-    std::memset(m_flags, 0, sizeof(m_flags));
+    if (backend == RamBackend::FLAT) {
+        if (!m_owns_ram) {
+            warning("the harts of a Machine share a sparse RAM");
+            return;
+        }
+        if (m_use_screen) {
+            warning("the screen needs the sparse RAM backend");
+            return;
+        }
+        if (m_copy_on_write.is_active()) {
+            warning("a cloned VM keeps the sparse RAM backend");
+            return;
+        }
+
+        m_flat_ram = std::make_unique<FlatRam>(m_ram, true);
+        m_flat_ram->add_sparse_range(TIME_DEVICE_BEGIN, TIME_DEVICE_END);
+    }
 
-    reg_t rd_val = 0;
-    switch (alucode) {
-    case BF_and:
-        rd_val = rs1_val & rs2_val;
-        break;
-    case BF_or:
-        rd_val = rs1_val | rs2_val;
-        break;
-    case BF_nor:
-        rd_val = ~(rs1_val | rs2_val);
-        break;
-    case BF_xor:
-        rd_val = rs1_val ^ rs2_val;
-        break;
-    case BF_add:
-        m_flags[FLAG_OVERFLOW] = __builtin_add_overflow((std::int32_t)rs1_val, (std::int32_t)rs2_val, (std::int32_t*)&rd_val);
-        m_flags[FLAG_CARRY] = __builtin_add_overflow((std::uint32_t)rs1_val, (std::uint32_t)rs2_val, (std::uint32_t*)&rd_val);
-        break;
-    case BF_sub:
-        m_flags[FLAG_OVERFLOW] = __builtin_sub_overflow((std::int32_t)rs1_val, (std::int32_t)rs2_val, (std::int32_t*)&rd_val);
-        m_flags[FLAG_CARRY] = __builtin_sub_overflow((std::uint32_t)rs1_val, (std::uint32_t)rs2_val, (std::uint32_t*)&rd_val);
-        break;
-    case BF_mul:
-        m_flags[FLAG_OVERFLOW] = __builtin_mul_overflow((std::int32_t)rs1_val, (std::int32_t)rs2_val, (std::int32_t*)&rd_val);
-        m_flags[FLAG_CARRY] = __builtin_mul_overflow((std::uint32_t)rs1_val, (std::uint32_t)rs2_val, (std::uint32_t*)&rd_val);
-        break;
-    case BF_div:
-        rd_val = rs1_val / rs2_val;
-        break;
-    default:
-        error("invalid ALU code");
-        break;
+    // Only the written pages can hold something else than zero. The words
+    // left behind in the SparseMemory RAM are overwritten if the VM ever
+    // goes back to it.
+    const RamRef sparse { m_ram, nullptr };
+    word_t words[PageSet::PAGE_WORDS];
+    for (addr_t page_number : m_written_pages.get_pages()) {
+        if (m_flat_ram->is_sparse(page_number))
+            continue;
+
+        const addr_t base = page_number << PageSet::PAGE_BITS;
+        if (backend == RamBackend::FLAT) {
+            sparse.read_range(base, words);
+            m_flat_ram->write_range(base, words);
+        } else {
+            m_flat_ram->read_range(base, words);
+            sparse.write_range(base, words);
+        }
     }
 
-    m_flags[FLAG_ZERO] = (rd_val == 0);
-    m_flags[FLAG_NEGATIVE] = (((std::int32_t)rd_val) < 0);
+    if (backend == RamBackend::SPARSE)
+        m_flat_ram.reset();
+}
 
-    set_reg(rd, rd_val);
+StopReason VM::step() {
+    if (m_input_log != nullptr || m_virtual_clock != 0)
+        return run_clocked(1);
+    return m_history != nullptr ? run_recorded(1) : run_loop(1);
 }
 
-void VM::execute_lsl(InstructionDecoder instruction) {
-    reg_index_t rd = instruction.get_reg();
-    reg_index_t rs1 = instruction.get_reg();
-    reg_index_t rs2 = instruction.get_reg();
+void VM::freeze_ram() {
+    auto frozen = std::make_shared<FrozenRam>();
+    frozen->ram = m_ram;
+    frozen->pages = m_written_pages.get_pages();
+    frozen->below = m_copy_on_write.get_base();
 
-    const reg_t rs1_val = get_reg(rs1);
-    const reg_t rs2_val = get_reg(rs2) & 0b11111;
-    set_reg(rd, rs1_val << rs2_val);
+    m_ram = ram_create();
+    if (m_use_screen) {
+        screen_terminate();
+        screen_init_with_ram_mapping(m_ram);
+    }
+    m_written_pages = PageSet();
+    m_copy_on_write.reset(m_ram, std::move(frozen));
+    m_frozen_at = m_instruction_count;
 }
 
-void VM::execute_asr(InstructionDecoder instruction) {
-    reg_index_t rd = instruction.get_reg();
-    reg_index_t rs1 = instruction.get_reg();
-    reg_index_t rs2 = instruction.get_reg();
-
-    const reg_t rs1_val = get_reg(rs1);
-    const reg_t rs2_val = get_reg(rs2) & 0b11111;
-    // Logical shift is done when operating on SIGNED values.
-    set_reg(rd, (std::int32_t)(rs1_val) >> rs2_val);
+std::unique_ptr<VM> VM::clone() {
+    if (!m_owns_ram || m_flat_ram != nullptr || !m_track_written_pages)
+        return nullptr;
+
+    // Nothing was executed nor loaded by the host since the last freeze,
+    // the frozen RAM is still the RAM of this VM.
+    if (!m_copy_on_write.is_active() || m_frozen_at != m_instruction_count)
+        freeze_ram();
+
+    auto copy = std::make_unique<VM>(m_rom, std::vector<std::uint32_t>(), false, m_code_filename);
+    copy->m_copy_on_write.reset(copy->m_ram, m_copy_on_write.get_base());
+    copy->m_frozen_at = m_frozen_at;
+
+    copy->m_pc = m_pc;
+    std::memcpy(copy->m_regs, m_regs, sizeof(m_regs));
+    copy->m_flags = m_flags;
+    copy->m_instruction_count = m_instruction_count;
+    copy->m_tick_countdown = m_tick_countdown;
+    copy->m_previous_cycle_time = m_previous_cycle_time;
+    copy->m_breakpoints = m_breakpoints;
+    copy->m_watchpoints = m_watchpoints;
+    copy->m_stop_on_device_write = m_stop_on_device_write;
+    if (m_patched_program != nullptr) {
+        copy->m_patched_program = m_patched_program;
+        copy->m_program = m_program;
+    }
+    copy->set_engine(m_engine);
+    return copy;
 }
 
-void VM::execute_lsr(InstructionDecoder instruction) {
-    reg_index_t rd = instruction.get_reg();
-    reg_index_t rs1 = instruction.get_reg();
-    reg_index_t rs2 = instruction.get_reg();
+DecodedInstruction* VM::patchable_program() {
+    // The clones that share m_patched_program patch their own copy, so it is
+    // private to this VM once no clone shares it anymore.
+    if (m_patched_program == nullptr) {
+        m_patched_program = std::make_shared<std::vector<DecodedInstruction>>(m_rom->get_decoded());
+        m_program = m_patched_program->data();
+    } else if (m_patched_program.use_count() > 1) {
+        m_patched_program = std::make_shared<std::vector<DecodedInstruction>>(*m_patched_program);
+        m_program = m_patched_program->data();
+    }
 
-    const reg_t rs1_val = get_reg(rs1);
-    const reg_t rs2_val = get_reg(rs2) & 0b11111;
-    // Logical shift is done when operating on UNSIGNED values.
-    set_reg(rd, (std::uint32_t)(rs1_val) >> rs2_val);
+    return m_patched_program->data();
 }
 
-void VM::execute_load(InstructionDecoder instruction) {
-    reg_index_t rd = instruction.get_reg();
-    reg_index_t rs = instruction.get_reg();
-    set_reg(rd, ram_get(m_ram, get_reg(rs)));
+void VM::program_changed(addr_t addr) {
+    // The patched instruction may also be the second half of the
+    // superinstruction that starts just before it.
+    if (addr > 0)
+        Program::fuse_at(*m_patched_program, addr - 1);
+    Program::fuse_at(*m_patched_program, addr);
+
+    // Patches are rare (breakpoints), simply forget all the blocks.
+    m_blocks.clear();
+    if (m_jit != nullptr)
+        m_jit->reset();
 }
 
-void VM::execute_loadi(InstructionDecoder instruction) {
-    reg_index_t rd = instruction.get_reg();
-    reg_index_t rs = instruction.get_reg();
-    uint16_t imm = instruction.get(16);
-    bool lhw = instruction.get(1);
+void VM::update_tick() {
+    // With a history, the tick is only set at the checkpoints. With an input
+    // log or a virtual clock, run_clocked() sets it.
+    if (!m_drives_clock || m_history != nullptr || m_input_log != nullptr || m_virtual_clock != 0)
+        return;
 
-    if (lhw) {
-        set_reg(rd, get_reg(rs) + imm);
-    } else {
-        set_reg(rd, get_reg(rs) + (imm << 16));
+    if (second_elapsed()) {
+        if (m_ram_lock != nullptr) {
+            std::lock_guard lock(*m_ram_lock);
+            time_device_tick(m_ram);
+        } else {
+            time_device_tick(m_ram);
+        }
     }
 }
 
-void VM::execute_store(InstructionDecoder instruction) {
-    reg_index_t rd = instruction.get_reg();
-    reg_index_t rs = instruction.get_reg();
-    ram_set(m_ram, get_reg(rd), get_reg(rs));
+void VM::set_virtual_clock(std::uint64_t instructions_per_second) {
+    if (m_owns_ram)
+        m_virtual_clock = instructions_per_second;
 }
 
-void VM::execute_jmp(InstructionDecoder instruction) {
-    reg_index_t rs = instruction.get_reg();
-    m_pc = get_reg(rs);
+void VM::set_tick() {
+    time_device_tick(m_ram);
+    if (m_input_log != nullptr) {
+        InputLog::Event event;
+        event.instruction_count = m_instruction_count;
+        event.kind = InputLog::EventKind::TICK;
+        m_input_log->record(event);
+    }
 }
 
-void VM::execute_jmpi(InstructionDecoder instruction) {
-    int32_t imm = sign_extend_24(instruction.get(24));
-    m_pc += imm - 1;
+bool VM::sync_calendar() {
+    const bool replaying = m_input_log != nullptr && m_input_log->is_replaying();
+    // The listener of the time device just wrote the host time.
+    if (m_virtual_clock != 0 && !replaying && m_device_write_word > 0)
+        time_device_write_calendar(m_ram, (long long)(m_instruction_count / m_virtual_clock));
+    return m_input_log == nullptr || log_calendar();
 }
 
-void VM::execute_jmpc(InstructionDecoder instruction) {
-    reg_index_t rs = instruction.get_reg();
-    size_t select = instruction.get(MachineCodeInfo::NB_FLAGS);
-    if (test_flags(select))
-        m_pc = get_reg(rs);
-}
+StopReason VM::run_clocked(std::uint64_t budget) {
+    // The stores to the calendar are caught as device writes.
+    const bool stop_on_device_write = m_stop_on_device_write;
+    m_stop_on_device_write = true;
+
+    StopReason reason = StopReason::BUDGET_EXHAUSTED;
+    while (budget > 0) {
+        std::uint64_t chunk = budget;
+        if (m_input_log != nullptr && m_input_log->is_replaying()) {
+            const InputLog::Event* event = m_input_log->peek();
+            while (event != nullptr && event->kind == InputLog::EventKind::TICK && event->instruction_count == m_instruction_count) {
+                time_device_tick(m_ram);
+                m_input_log->pop();
+                event = m_input_log->peek();
+            }
+
+            if (event != nullptr && event->kind != InputLog::EventKind::END && event->instruction_count <= m_instruction_count) {
+                m_error = "the run diverged from the input log";
+                reason = StopReason::ERROR;
+                break;
+            }
+
+            // The recording is over (or was cut by a crash), the clock of the
+            // VM takes over.
+            if (event == nullptr || (event->kind == InputLog::EventKind::END && event->instruction_count <= m_instruction_count)) {
+                m_input_log.reset();
+                if (m_virtual_clock != 0)
+                    continue;
+
+                m_stop_on_device_write = stop_on_device_write;
+                return run_engine(budget);
+            }
+
+            chunk = std::min(chunk, event->instruction_count - m_instruction_count);
+        } else if (m_virtual_clock != 0) {
+            // One tick every m_virtual_clock instructions, exactly.
+            const std::uint64_t elapsed = m_instruction_count % m_virtual_clock;
+            if (elapsed == 0 && m_instruction_count > 0)
+                set_tick();
+            chunk = std::min(chunk, m_virtual_clock - elapsed);
+        } else {
+            // The host clock is read at the same counts as by the engines.
+            const std::uint64_t elapsed = m_instruction_count % TICK_CHECK_INTERVAL;
+            if (elapsed == 0 && second_elapsed())
+                set_tick();
+            chunk = std::min(chunk, TICK_CHECK_INTERVAL - elapsed);
+        }
+
+        const std::uint64_t instruction_count = m_instruction_count;
+        reason = run_engine(chunk);
+        budget -= m_instruction_count - instruction_count;
+        if (reason == StopReason::DEVICE_WRITE) {
+            if (m_device_write_addr == TIME_DEVICE_SYNC && !sync_calendar()) {
+                m_error = "the run diverged from the input log";
+                reason = StopReason::ERROR;
+                break;
+            }
+            if (stop_on_device_write)
+                break;
+            reason = StopReason::BUDGET_EXHAUSTED;
+        } else if (reason != StopReason::BUDGET_EXHAUSTED) {
+            break;
+        }
+    }
 
-void VM::execute_jmpic(InstructionDecoder instruction) {
-    int32_t imm = sign_extend_24(instruction.get(24));
-    size_t select = instruction.get(MachineCodeInfo::NB_FLAGS);
-    if (test_flags(select))
-        m_pc += imm - 1;
+    m_stop_on_device_write = stop_on_device_write;
+    return reason;
 }
 
-void VM::execute_break(InstructionDecoder) {
-    m_pc -= 1;
-    printf("Breakpoint at PC = %#lx (%lu) reached.\n", m_pc, m_pc);
-    m_breakpoints[m_pc].disable(m_code);
-    m_at_breakpoint = true;
+bool VM::second_elapsed() {
+    auto now = std::chrono::steady_clock::now();
+    auto dur = std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_previous_cycle_time).count();
+    if (dur < 1'000'000'000)
+        return false;
+
+    m_previous_cycle_time = now;
+    return true;
 }
 
-void VM::warning(const char* msg) {
-    fprintf(stderr, "\x1b[1;33mWARNING:\x1b[0m %s\n", msg);
+void VM::reach_breakpoint() {
+    const auto it = m_breakpoints.find(m_pc - 1);
+    if (it != m_breakpoints.end()) {
+        // Resume on the original instruction the next time.
+        m_pc -= 1;
+        it->second.disable(patchable_program());
+        program_changed(m_pc);
+    }
+
+    // The breaks replayed by VM::seek() and VM::reverse_continue() were
+    // already reported when they were first reached.
+    if (m_history == nullptr || !m_history->is_replaying())
+        printf("Breakpoint at PC = %#lx (%lu) reached.\n", m_pc, m_pc);
 }
 
-void VM::error(const char* msg) {
-    fprintf(stderr, "\x1b[1;31mERROR:\x1b[0m machine code ill-formed; %s\n",
-        msg);
-    exit(EXIT_FAILURE);
+void VM::reach_watchpoint(addr_t addr) {
+    printf("Watchpoint at %#x written by PC = %#lx (%lu).\n", addr, m_pc - 1, m_pc - 1);
 }
 
-reg_t VM::get_reg(reg_index_t reg) const {
-    if (reg <= 1)
-        return reg;
-    else
-        return m_regs[reg];
+void VM::warning(const char* msg) {
+    fprintf(stderr, "\x1b[1;33mWARNING:\x1b[0m %s\n", msg);
 }
 
 void VM::set_reg(reg_index_t reg, reg_t value) {
-    m_regs[reg] = value;
+    m_regs[destination_slot(reg)] = value;
+    // The replays from the previous checkpoints would lose the new value.
+    if (m_history != nullptr)
+        take_checkpoint();
 }
 
 bool VM::at_end() const {
     return m_pc == 0xffffffff;
 }
 
-void VM::add_breakpoint(addr_t addr) {
+bool VM::add_breakpoint(addr_t addr) {
+    if (addr >= m_code_length)
+        return false;
+
     auto it = m_breakpoints.find(addr);
     if (it == m_breakpoints.end()) {
         Breakpoint breakpoint;
         breakpoint.addr = addr;
-        breakpoint.enable(m_code);
+        breakpoint.enable(patchable_program());
+        program_changed(addr);
         m_breakpoints.insert({ addr, breakpoint });
         printf("Breakpoint added at %#x\n", addr);
     } else {
-        it->second.enable(m_code);
+        it->second.enable(patchable_program());
+        program_changed(addr);
         printf("Breakpoint enabled at %#x\n", addr);
     }
+
+    return true;
 }
 
 void VM::remove_breakpoint(addr_t pc) {
@@ -312,10 +671,31 @@ void VM::remove_breakpoint(addr_t pc) {
     if (it == m_breakpoints.end())
         return;
 
-    it->second.disable(m_code);
+    it->second.disable(patchable_program());
+    program_changed(pc);
     m_breakpoints.erase(it);
 }
 
+void VM::add_watchpoint(addr_t addr) {
+    if (m_watchpoints.insert(addr).second)
+        printf("Watchpoint added at %#x\n", addr);
+}
+
+void VM::remove_watchpoint(addr_t addr) {
+    m_watchpoints.erase(addr);
+}
+
+void VM::print_watchpoints() {
+    if (m_watchpoints.empty()) {
+        printf("No watchpoints\n");
+        return;
+    }
+
+    printf("There is %lu watchpoint(s):\n", m_watchpoints.size());
+    for (addr_t addr : m_watchpoints)
+        printf("  - Watchpoint at %#x\n", addr);
+}
+
 void VM::print_breakpoints() {
     if (m_breakpoints.empty()) {
         printf("No breakpoints\n");
@@ -5,14 +5,20 @@
 #ifndef ASM_VM_VM_HPP
 #define ASM_VM_VM_HPP
 
+#include "alu.hpp"
+#include "flat_ram.hpp"
 #include "machine_code.hpp"
+#include "mapped_file.hpp"
 #include "memory.h"
+#include "mmio.hpp"
+#include <array>
 #include <chrono>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <vector>
 #include <unordered_map>
 
-#include "memory.h"
-
 using inst_t = MachineCodeInfo::InstructionTy;
 using reg_t = MachineCodeInfo::RegisterValueTy;
 using reg_index_t = MachineCodeInfo::RegisterIndexTy;
@@ -36,70 +42,595 @@ struct InstructionDecoder {
     reg_index_t get_reg() { return get(MachineCodeInfo::REG_BITS); }
 };
 
+/// Identifies the interpreter handler of a decoded instruction.
+///
+/// ALU instructions get one handler per function so that the interpreter does
+/// not need a second dispatch on the ALU code. H_alu is only used for invalid
+/// ALU codes. The superinstructions handlers come last.
+enum handler_t : std::uint8_t {
+#define INSTRUCTION(name, opcode) H_##name,
+#define BINARY_INSTRUCTION(name, func) H_alu_##name,
+#include "instructions.def"
+    H_invalid,
+#define SUPERINSTRUCTION(name) H_##name,
+#include "superinstructions.def"
+    H_COUNT
+};
+
+/// An instruction of the ROM already split into its fields.
+///
+/// The ROM is decoded once when the VM is created so that the interpreter
+/// does not have to extract the fields of each instruction again every time
+/// it is executed. Fields that are not used by the instruction are zero.
+struct DecodedInstruction {
+    std::uint8_t opcode = 0; ///< The opcode_t of the instruction.
+    std::uint8_t handler = H_invalid; ///< The handler_t of the instruction.
+    std::uint8_t alucode = 0; ///< The alucode_t (only for OP_alu).
+    /// The destination register slot, writes to r0 and r1 go to REG_DISCARD.
+    reg_index_t rd = 0;
+    reg_index_t rs1 = 0; ///< First source (the address register for OP_store).
+    reg_index_t rs2 = 0; ///< Second source (the value register for OP_store).
+    std::uint8_t select = 0; ///< The flags select (only for OP_jmpc and OP_jmpic).
+    /// For OP_loadi, the value to add to rs1 (already shifted for loadi.h).
+    /// For OP_jmpi and OP_jmpic, the absolute target address.
+    reg_t imm = 0;
+
+    static DecodedInstruction decode(inst_t instruction, addr_t addr);
+    /// Returns the handler of this instruction when it is not fused.
+    [[nodiscard]] handler_t base_handler() const;
+};
+
+/// A ROM decoded once, shared read-only by all the VM that run it.
+///
+/// Breakpoints are never patched into a Program, a VM that sets one works on
+/// its own copy of the decoded instructions.
+class Program {
+public:
+    explicit Program(std::vector<inst_t> code);
+    /// Executes the ROM @a rom in place, without copying it.
+    explicit Program(MappedFile rom);
+
+    [[nodiscard]] const inst_t* get_code() const { return m_code; }
+    [[nodiscard]] std::size_t get_length() const { return m_length; }
+    /// The decoded ROM with the superinstructions selected.
+    [[nodiscard]] const std::vector<DecodedInstruction>& get_decoded() const { return m_decoded; }
+    /// A hash of the machine code, identifies the ROM in the snapshots.
+    [[nodiscard]] std::uint64_t get_hash() const { return m_hash; }
+
+    /// Selects the handler of the instruction at @a addr of @a program, that
+    /// is a superinstruction if it starts a known idiom.
+    static void fuse_at(std::vector<DecodedInstruction>& program, addr_t addr);
+
+private:
+    void decode();
+
+    /// The machine code, in m_code_storage or m_rom.
+    const inst_t* m_code = nullptr;
+    std::size_t m_length = 0;
+    std::vector<inst_t> m_code_storage;
+    MappedFile m_rom;
+    std::vector<DecodedInstruction> m_decoded;
+    std::uint64_t m_hash = 0;
+};
+
+/// The RAM pages written by a VM, so that a snapshot only has to look at
+/// them (see VM::save_snapshot()).
+///
+/// Every store adds its page, so a small direct-mapped cache of the pages
+/// already in the set makes the common case a single compare.
+class PageSet {
+public:
+    /// A page is 1024 words (4 KiB).
+    static constexpr unsigned PAGE_BITS = 10;
+    static constexpr addr_t PAGE_WORDS = addr_t(1) << PAGE_BITS;
+
+    /// The page of the time device (VM::TIME_DEVICE_BEGIN to
+    /// VM::TIME_DEVICE_END), which the host writes behind the back of the VM.
+    static constexpr addr_t DEVICE_PAGE = 1024 >> PAGE_BITS;
+
+    /// The page of the devices is always in the set. So is the page 0, which
+    /// makes the zero-initialized entries of the cache valid.
+    PageSet() {
+        m_pages.insert(0);
+        add_page(DEVICE_PAGE);
+    }
+
+    void add(addr_t addr) {
+        const addr_t page = addr >> PAGE_BITS;
+        if (m_recent[page % RECENT_SIZE] != page) [[unlikely]]
+            add_page(page);
+    }
+    /// Adds the pages of the @a count words from @a begin.
+    void add_range(addr_t begin, std::size_t count);
+    void add_page(addr_t page) {
+        m_pages.insert(page);
+        m_recent[page % RECENT_SIZE] = page;
+    }
+
+    /// Returns the page numbers (addresses divided by PAGE_WORDS), sorted.
+    [[nodiscard]] const std::set<addr_t>& get_pages() const { return m_pages; }
+    [[nodiscard]] bool contains(addr_t page) const { return m_pages.contains(page); }
+
+private:
+    static constexpr std::size_t RECENT_SIZE = 64;
+    std::array<addr_t, RECENT_SIZE> m_recent = {};
+    std::set<addr_t> m_pages;
+};
+
+/// The RAM of a VM frozen by VM::clone(), shared read-only by the VM that
+/// derive from it.
+///
+/// A layer only holds the pages written to it before it was frozen, the
+/// other pages come from the layer @a below (if the VM was itself running on
+/// a frozen RAM) or are zero.
+struct FrozenRam {
+    ram_t* ram = nullptr;
+    /// The pages written to @a ram.
+    std::set<addr_t> pages;
+    std::shared_ptr<const FrozenRam> below;
+
+    FrozenRam() = default;
+    ~FrozenRam();
+
+    FrozenRam(const FrozenRam&) = delete;
+    FrozenRam& operator=(const FrozenRam&) = delete;
+
+    /// Returns the RAM that holds the content of @a page, or nullptr if the
+    /// page is zero.
+    [[nodiscard]] ram_t* find(addr_t page) const;
+};
+
+/// The pages that a VM shares with the frozen RAM it was cloned from.
+///
+/// A page is copied to the RAM of the VM the first time the VM loads from or
+/// stores to it, so the cost of a clone is proportional to the pages it
+/// touches. A direct-mapped cache of the pages already checked makes most
+/// accesses a single compare, as in PageSet.
+class CopyOnWrite {
+public:
+    CopyOnWrite() { m_checked.fill(NO_PAGE); }
+
+    [[nodiscard]] bool is_active() const { return m_base != nullptr; }
+    [[nodiscard]] const std::shared_ptr<const FrozenRam>& get_base() const { return m_base; }
+
+    /// Makes @a ram share the pages of @a base, @a ram must be empty except
+    /// for its devices and its PageSet new. The pages that a PageSet always
+    /// holds (the page 0 and PageSet::DEVICE_PAGE, which the devices write
+    /// behind the back of the VM) are copied right away. A null @a base
+    /// stops the sharing.
+    void reset(ram_t* ram, std::shared_ptr<const FrozenRam> base);
+
+    /// Must be called before each load or store of @a addr to @a ram, while
+    /// is_active(). The pages copied to @a ram are added to @a written_pages.
+    void access(ram_t* ram, PageSet& written_pages, addr_t addr) {
+        const addr_t page = addr >> PageSet::PAGE_BITS;
+        if (m_checked[page % CHECKED_SIZE] != page) [[unlikely]]
+            copy_page(ram, written_pages, page);
+    }
+
+private:
+    void copy_page(ram_t* ram, PageSet& written_pages, addr_t page);
+    /// Copies the page @a page of the frozen RAM to @a ram. Returns false if
+    /// it is zero there.
+    bool copy_from_base(ram_t* ram, addr_t page) const;
+
+    static constexpr std::size_t CHECKED_SIZE = 64;
+    /// Page numbers are below 2^22, so this is never a valid one.
+    static constexpr addr_t NO_PAGE = UINT32_MAX;
+    std::array<addr_t, CHECKED_SIZE> m_checked;
+    std::shared_ptr<const FrozenRam> m_base;
+};
+
 struct Breakpoint {
     addr_t addr;
-    inst_t old_inst;
+    DecodedInstruction old_inst;
     bool is_enabled = false;
 
-    void enable(inst_t* code);
-    void disable(inst_t* code);
+    void enable(DecodedInstruction* code);
+    void disable(DecodedInstruction* code);
+};
+
+/// The engines that can execute a program, see VM::set_engine().
+enum class ExecutionEngine {
+    /// The threaded interpreter (interpreter.cpp).
+    INTERPRETER,
+    /// Runs whole basic blocks at a time (block_engine.cpp).
+    BASIC_BLOCKS,
+    /// The basic block engine that also translates the hot blocks to native
+    /// code (jit_x86_64.cpp). Only available on x86-64 hosts.
+    JIT
+};
+
+/// Why VM::run() returned.
+enum class StopReason {
+    /// The program jumped to the address 0xffffffff.
+    HALTED,
+    /// A break instruction or a breakpoint was reached, it is not executed.
+    BREAKPOINT,
+    /// The whole budget of instructions was executed.
+    BUDGET_EXHAUSTED,
+    /// A store wrote to a watched RAM word, the store was executed.
+    WATCHPOINT,
+    /// A store wrote to a device, only with VM::set_stop_on_device_write().
+    DEVICE_WRITE,
+    /// The machine code is ill-formed, see VM::get_error().
+    ERROR
 };
 
+/// Where a VM keeps its RAM, see VM::set_ram_backend().
+enum class RamBackend {
+    /// A SparseMemory RAM, the default. Every load and store goes through a
+    /// call into SparseMemory.
+    SPARSE,
+    /// A FlatRam: plain host pages reached through a two-level page table,
+    /// allocated on the first store, so loads and stores are inlined. The
+    /// page of the time device stays in SparseMemory.
+    FLAT
+};
+
+struct JitContext;
+/// A basic block translated to native code. Returns the next pc.
+using JitBlockFn = std::size_t (*)(JitContext* context);
+
+/// A basic block of the program, cached by the basic block engine.
+///
+/// The body only contains instructions that cannot change the control flow.
+/// The terminator, if any, is a jump. Blocks that end on anything else
+/// (a breakpoint, an invalid instruction or the end of the ROM) have no
+/// terminator and leave that instruction to the interpreter.
+struct BasicBlock {
+    std::vector<DecodedInstruction> body;
+    DecodedInstruction terminator;
+    bool has_terminator = false;
+    /// How many times the block ran, used to find the hot blocks to JIT.
+    std::uint32_t hits = 0;
+    JitBlockFn native_code = nullptr;
+
+    /// The count of instructions executed by a run of the whole block.
+    [[nodiscard]] std::size_t length() const { return body.size() + has_terminator; }
+};
+
+class Jit;
+class ExecutionHistory;
+class InputLog;
+
 class VM {
 public:
-    VM(std::vector<std::uint32_t>& rom_data, const std::vector<std::uint32_t>& ram_data, bool use_screen = true, const char* code_filename = nullptr);
+    /// Register slot that receives the writes to the read-only r0 and r1.
+    static constexpr reg_index_t REG_DISCARD = MachineCodeInfo::REG_COUNT;
+    static constexpr size_t REG_SLOTS = MachineCodeInfo::REG_COUNT + 1;
+
+    /// The RAM words of the time device (the tick and the calendar).
+    static constexpr addr_t TIME_DEVICE_BEGIN = 1024;
+    static constexpr addr_t TIME_DEVICE_END = 1033;
+    static_assert(PageSet::DEVICE_PAGE == TIME_DEVICE_BEGIN >> PageSet::PAGE_BITS && PageSet::DEVICE_PAGE == TIME_DEVICE_END >> PageSet::PAGE_BITS);
+    /// The count of instructions executed between two reads of the host
+    /// clock, to know if the one second tick of the time device is due.
+    static constexpr std::uint32_t TICK_CHECK_INTERVAL = 16384;
+    /// The register rout, holding the result of the program.
+    static constexpr reg_index_t REG_OUT = 28;
+    /// The register that holds the id of a hart of a Machine when it starts.
+    static constexpr reg_index_t REG_HART_ID = 27;
+
+    /// Creates a VM running @a program, which may be shared with other VM.
+    ///
+    /// VM are independent from each other and can run on different threads.
+    /// Only one VM at a time can map the screen, @a use_screen is ignored
+    /// with a warning when another VM already does.
+    VM(std::shared_ptr<const Program> program, const std::vector<std::uint32_t>& ram_data, bool use_screen = true, const char* code_filename = nullptr);
+    VM(const std::vector<std::uint32_t>& rom_data, const std::vector<std::uint32_t>& ram_data, bool use_screen = true, const char* code_filename = nullptr);
+    /// Creates a hart of a Machine, running @a program on the RAM @a ram
+    /// that it shares with the other harts and does not own.
+    ///
+    /// When @a ram_lock is not null, each load and store holds it (see the
+    /// memory model of Machine) and only the interpreter is used. Only the
+    /// hart that @a drives_clock sets the tick of the time device.
+    VM(std::shared_ptr<const Program> program, ram_t* ram, std::mutex* ram_lock, bool drives_clock);
     ~VM();
 
+    VM(const VM&) = delete;
+    VM& operator=(const VM&) = delete;
+
     [[nodiscard]] const char* get_code_filename() const { return m_code_filename; }
     [[nodiscard]] const inst_t* get_code() const { return m_code; }
 
     [[nodiscard]] bool at_end() const;
 
     [[nodiscard]] addr_t get_pc() const { return m_pc; }
-    [[nodiscard]] reg_t get_reg(reg_index_t reg) const;
+    [[nodiscard]] reg_t get_reg(reg_index_t reg) const { return m_regs[reg]; }
     void set_reg(reg_index_t reg, reg_t value);
 
-    [[nodiscard]] bool get_flag(flag_t flag) const { return m_flags[flag]; }
+    /// Returns the count of instructions executed since the VM was created.
+    [[nodiscard]] std::uint64_t get_instruction_count() const { return m_instruction_count; }
+
+    [[nodiscard]] bool get_flag(flag_t flag) const { return (m_flags.get() & flag_bit(flag)) != 0; }
+    /// Returns all the flags packed as in the select of jmpc and jmpic.
+    [[nodiscard]] packed_flags_t get_flags() const { return m_flags.get(); }
+
+    [[nodiscard]] ExecutionEngine get_engine() const { return m_engine; }
+    /// Selects the engine used by run(). The JIT falls back to the
+    /// interpreter on hosts that do not support it.
+    void set_engine(ExecutionEngine engine);
+
+    [[nodiscard]] RamBackend get_ram_backend() const { return m_flat_ram != nullptr ? RamBackend::FLAT : RamBackend::SPARSE; }
+    /// Loads the RAM image @a filename to the words from the address 0. The
+    /// file is mapped rather than read: with the flat backend, its pages are
+    /// used in place and only read from the file when the program accesses
+    /// them (see FlatRam::map_image()), so the size of the image does not
+    /// matter; SparseMemory copies the words. Select the backend before.
+    /// Returns nullptr on success, otherwise the reason of the failure.
+    const char* load_ram_file(const char* filename);
+
+    /// Copies the RAM words from @a addr to @a words, for the host. The
+    /// words of the devices are read from the RAM, without calling them.
+    void read_ram(addr_t addr, std::span<word_t> words) const;
+
+    /// Moves the RAM to @a backend, keeping its content. The flat backend is
+    /// ignored with a warning by the harts of a Machine, by a VM that maps
+    /// the screen (whose words SparseMemory must see) and by a VM that still
+    /// shares pages with a frozen RAM (see clone()). Once the written pages
+    /// are not tracked anymore, the backend is kept with a warning.
+    void set_ram_backend(RamBackend backend);
 
-    void add_breakpoint(addr_t pc);
+    /// Maps @a device into the RAM of the VM (see MmioMap): its loads and
+    /// stores call the device instead of accessing the RAM. The time device
+    /// is mapped when the VM is created, except on the harts of a Machine,
+    /// whose devices are listeners of the shared RAM that the Machine maps
+    /// without callbacks. Returns false if the range of @a device overlaps
+    /// the one of a device already mapped.
+    ///
+    /// The execution history undoes the stores to the devices like any
+    /// other, but not what the devices did with them.
+    bool map_device(const MmioDevice& device) { return m_mmio.add(device); }
+    void unmap_device(addr_t begin) { m_mmio.remove(begin); }
+
+    /// Stops the execution after each store to a device (the words of the
+    /// devices mapped with map_device()), for drivers that multiplex many
+    /// VM.
+    void set_stop_on_device_write(bool enabled) { m_stop_on_device_write = enabled; }
+    /// Returns the address and the word of the store of the last
+    /// StopReason::DEVICE_WRITE.
+    [[nodiscard]] addr_t get_device_write_addr() const { return m_device_write_addr; }
+    [[nodiscard]] word_t get_device_write_word() const { return m_device_write_word; }
+    /// Returns true if @a addr is a word of a mapped device.
+    [[nodiscard]] bool is_device_address(addr_t addr) const {
+        return m_mmio.may_contain(addr) && m_mmio.find(addr) != nullptr;
+    }
+    [[nodiscard]] static constexpr bool is_time_device_address(addr_t addr) {
+        return addr >= TIME_DEVICE_BEGIN && addr <= TIME_DEVICE_END;
+    }
+
+    /// Returns the reason of the last StopReason::ERROR.
+    [[nodiscard]] const char* get_error() const { return m_error; }
+
+    /// Returns false if @a pc is outside of the program.
+    bool add_breakpoint(addr_t pc);
     void remove_breakpoint(addr_t pc);
     void print_breakpoints();
 
-    void execute();
-    void step();
+    /// Stops the execution after each store to the RAM word @a addr. The
+    /// basic block engines fall back to the interpreter while a watchpoint
+    /// is set.
+    void add_watchpoint(addr_t addr);
+    void remove_watchpoint(addr_t addr);
+    void print_watchpoints();
+
+    /// Runs the program with the selected engine until it stops, at most
+    /// @a budget instructions. The budget is exact even for the basic block
+    /// engines, so it can be used as a watchdog against runaway programs.
+    StopReason run(std::uint64_t budget = UINT64_MAX);
+    /// Executes one instruction with the interpreter.
+    StopReason step();
+
+    /// Logs the inputs of the time device (the ticks and the calendar) to the
+    /// file @a filename with the instruction counts at which the program sees
+    /// them, see InputLog. Returns nullptr on success, otherwise the reason
+    /// of the failure.
+    const char* record_inputs(const char* filename);
+    /// Replays the inputs logged by record_inputs() to @a filename instead of
+    /// reading the host clock, at the same instruction counts. The VM must be
+    /// in the state the recording started from (same ROM, RAM and
+    /// instruction count); a run that does not store to the calendar where
+    /// the recorded one did stops with StopReason::ERROR. Once the end of the
+    /// recording is reached, the host clock is used again. Returns nullptr on
+    /// success, otherwise the reason of the failure.
+    const char* replay_inputs(const char* filename);
+    /// Stops recording or replaying the inputs. A recording ends with the
+    /// current instruction count.
+    void close_input_log();
+
+    /// Drives the time device from the count of executed instructions
+    /// instead of the host clock: the tick is set every
+    /// @a instructions_per_second instructions, exactly, and the calendar
+    /// reads the time `instruction count / instructions_per_second` seconds
+    /// after 1970-01-01 00:00:00 UTC. Runs are then reproducible and the guest
+    /// clock runs as fast as the host can execute. 0 goes back to the host
+    /// clock. Ignored by the harts of a Machine, and by the replay of an
+    /// input log until its end.
+    void set_virtual_clock(std::uint64_t instructions_per_second);
+    [[nodiscard]] std::uint64_t get_virtual_clock() const { return m_virtual_clock; }
+
+    /// Records the execution so that it can be reversed, see
+    /// ExecutionHistory. At most @a memory_limit bytes of history are kept.
+    /// Everything runs on the interpreter while the history is enabled.
+    /// Returns nullptr on success, otherwise the reason of the failure: the
+    /// history cannot be recorded while the inputs are logged or the clock
+    /// is virtual.
+    const char* enable_history(std::size_t memory_limit);
+    void disable_history();
+    [[nodiscard]] bool has_history() const { return m_history != nullptr; }
+    /// Goes back @a count instructions, or to the oldest instruction of the
+    /// history. Returns the count of instructions actually undone.
+    std::uint64_t step_back(std::uint64_t count);
+    /// Goes back to the last time the pc reached a breakpoint (enabled or
+    /// not). Returns false if that is not in the history, the VM then goes
+    /// back to the oldest instruction of the history.
+    bool reverse_continue();
+
+    /// Returns a new VM in the same state as this one (the pc, the registers,
+    /// the flags, the breakpoints, the watchpoints and the RAM) that then runs
+    /// independently, on any thread. It shares the ROM and the RAM pages with
+    /// this VM, copy-on-write: the RAM of this VM is frozen (see FrozenRam)
+    /// and both VM copy a page from it when they first access it. Cloning
+    /// again before this VM executes anything shares the same frozen RAM.
+    ///
+    /// The clone does not map the screen. Returns nullptr for the harts of a
+    /// Machine, whose RAM is shared, with the flat RAM backend and once the
+    /// written pages are not tracked.
+    std::unique_ptr<VM> clone();
+
+    /// Writes the state of the VM to the file @a filename: the pc, the
+    /// registers, the flags, the breakpoints and the written RAM pages (see
+    /// snapshot.cpp for the format). Returns nullptr on success, otherwise
+    /// the reason of the failure.
+    const char* save_snapshot(const char* filename) const;
+    /// Restores the state saved by save_snapshot() to @a filename. The
+    /// snapshot must come from the same ROM. The VM is left unchanged on
+    /// failure. Returns nullptr on success, otherwise the reason of the
+    /// failure.
+    const char* load_snapshot(const char* filename);
+
+    /// Stops recording the RAM pages written by the stores, for the VM that
+    /// will never be saved nor cloned: each store then does less work. The
+    /// snapshots and clone() fail from then on, and the RAM backend cannot be
+    /// changed anymore. The tracking cannot be resumed, the pages written in
+    /// between would be missing.
+    void stop_tracking_written_pages() { m_track_written_pages = false; }
 
 private:
-    bool test_flags(size_t select);
-
-    void execute(InstructionDecoder instruction);
-    void execute_alu(InstructionDecoder instruction);
-    void execute_lsl(InstructionDecoder instruction);
-    void execute_asr(InstructionDecoder instruction);
-    void execute_lsr(InstructionDecoder instruction);
-    void execute_load(InstructionDecoder instruction);
-    void execute_loadi(InstructionDecoder instruction);
-    void execute_store(InstructionDecoder instruction);
-    void execute_jmp(InstructionDecoder instruction);
-    void execute_jmpi(InstructionDecoder instruction);
-    void execute_jmpc(InstructionDecoder instruction);
-    void execute_jmpic(InstructionDecoder instruction);
-    void execute_break(InstructionDecoder instruction);
+    /// The threaded interpreter, defined in interpreter.cpp.
+    ///
+    /// Executes at most @a budget instructions, see run().
+    StopReason run_loop(std::uint64_t budget);
+    /// The basic block engine, defined in block_engine.cpp. Same contract
+    /// as run_loop().
+    StopReason run_blocks(std::uint64_t budget);
+    /// Runs at most @a budget instructions with the selected engine, or with
+    /// run_recorded() while the history is enabled.
+    StopReason run_engine(std::uint64_t budget);
+    BasicBlock& find_block(addr_t addr);
+
+    /// Returns the decoded program that breakpoints can be patched into,
+    /// that is a copy of the one of the ROM that no other VM shares.
+    DecodedInstruction* patchable_program();
+    /// Updates the superinstructions and the cached basic blocks after the
+    /// instruction at @a addr was patched.
+    void program_changed(addr_t addr);
+
+    /// Runs at most @a budget instructions with the interpreter, taking the
+    /// checkpoints of the history, defined in history.cpp.
+    StopReason run_recorded(std::uint64_t budget);
+    /// Takes a checkpoint of the history, then checks the tick if this was
+    /// not done yet at this instruction count.
+    void take_checkpoint();
+    /// Undoes the execution back to the checkpoint @a index of the history.
+    /// The ticks set before @a replay_end are replayed by the next runs.
+    void rewind_to_checkpoint(std::size_t index, std::uint64_t replay_end);
+    /// Goes back to the instruction count @a instruction_count, which must
+    /// be in the history.
+    void seek(std::uint64_t instruction_count);
+
+    /// Runs at most @a budget instructions with run_engine() while the VM
+    /// drives the time device: replaying the input log, or from the virtual
+    /// clock or the host clock, recording the inputs if they are logged.
+    StopReason run_clocked(std::uint64_t budget);
+    /// Sets the tick of the time device and logs it.
+    void set_tick();
+    /// Called after a store to TIME_DEVICE_SYNC, writes the calendar of the
+    /// virtual clock and logs it. Returns false if the replayed log has no
+    /// calendar at this instruction count.
+    bool sync_calendar();
+    /// Records the calendar just written, or replaces it with the logged
+    /// one, defined in input_log.cpp. Returns false if the replayed log has
+    /// no calendar at this instruction count.
+    bool log_calendar();
+
+    [[nodiscard]] RamRef ram_ref() const { return { m_ram, m_flat_ram.get() }; }
+
+    /// Freezes the RAM into a FrozenRam and continues on a new RAM that
+    /// shares its pages, see clone().
+    void freeze_ram();
+
+    /// Accounts @a count executed instructions and reads the host clock
+    /// once every TICK_CHECK_INTERVAL instructions.
+    void retire(std::uint32_t count) {
+        m_instruction_count += count;
+        if (m_tick_countdown > count) {
+            m_tick_countdown -= count;
+            return;
+        }
+
+        m_tick_countdown = TICK_CHECK_INTERVAL;
+        update_tick();
+    }
+    /// Sets the tick of the time device if one second elapsed since the
+    /// previous one.
+    void update_tick();
+    /// Returns true (once) if one second elapsed since the previous tick.
+    bool second_elapsed();
+    void reach_breakpoint();
+    void reach_watchpoint(addr_t addr);
 
     static void warning(const char* msg);
-    static void error(const char* msg);
 
 private:
     const char* m_code_filename;
     std::chrono::steady_clock::time_point m_previous_cycle_time;
+    /// The count of instructions left before the next read of the clock.
+    std::uint32_t m_tick_countdown = TICK_CHECK_INTERVAL;
+    std::uint64_t m_instruction_count = 0;
     std::unordered_map<addr_t, Breakpoint> m_breakpoints;
+    /// The watched RAM words, sorted so that the interpreter can first check
+    /// a store against the range of all of them.
+    std::set<addr_t> m_watchpoints;
+    const char* m_error = nullptr;
+    bool m_stop_on_device_write = false;
+    /// The address and the word of the store of the last
+    /// StopReason::DEVICE_WRITE.
+    addr_t m_device_write_addr = 0;
+    word_t m_device_write_word = 0;
+    /// The instructions per second of the virtual clock, 0 for the host
+    /// clock.
+    std::uint64_t m_virtual_clock = 0;
     std::size_t m_pc = 0;
-    reg_t m_regs[MachineCodeInfo::REG_COUNT] = { 0 };
-    inst_t* m_code = nullptr;
+    /// The registers, r0 and r1 always hold their constant value.
+    reg_t m_regs[REG_SLOTS] = { 0, 1 };
+    std::shared_ptr<const Program> m_rom;
+    const inst_t* m_code = nullptr;
     size_t m_code_length = 0;
+    /// The decoded program that is executed: the one of m_rom, or
+    /// m_patched_program once a breakpoint was set.
+    const DecodedInstruction* m_program = nullptr;
+    /// The copy of the decoded program with the breakpoints. The clones share
+    /// it until one of them patches it (see patchable_program()).
+    std::shared_ptr<std::vector<DecodedInstruction>> m_patched_program;
+    /// The basic blocks already found, indexed by their start address.
+    std::vector<std::unique_ptr<BasicBlock>> m_blocks;
+    ExecutionEngine m_engine = ExecutionEngine::INTERPRETER;
+    std::unique_ptr<Jit> m_jit;
+    std::unique_ptr<ExecutionHistory> m_history;
+    std::unique_ptr<InputLog> m_input_log;
     ram_t* m_ram = nullptr;
+    /// The RAM in front of m_ram with the flat backend, null otherwise.
+    std::unique_ptr<FlatRam> m_flat_ram;
+    /// The devices mapped into the RAM.
+    MmioMap m_mmio;
+    /// The pages of the RAM written since the VM was created, while
+    /// m_track_written_pages.
+    PageSet m_written_pages;
+    bool m_track_written_pages = true;
+    /// The pages of m_ram still shared with the RAM frozen by clone().
+    CopyOnWrite m_copy_on_write;
+    /// The instruction count when the RAM was last frozen, reset by the
+    /// writes of the host to the RAM, which do not count as instructions.
+    std::uint64_t m_frozen_at = UINT64_MAX;
+    bool m_owns_ram = true;
+    /// The lock of a RAM shared by harts running on different threads.
+    std::mutex* m_ram_lock = nullptr;
+    bool m_drives_clock = true;
     bool m_use_screen = false;
-    bool m_at_breakpoint = false;
-    bool m_flags[MachineCodeInfo::NB_FLAGS] = { false };
+    /// The flags, only computed when they are read.
+    LazyFlags m_flags;
 };
 
 #endif // ASM_VM_VM_HPP
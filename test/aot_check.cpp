@@ -0,0 +1,184 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+// Checks that the executable generated by cpulm_aot from a ROM ends in the
+// same state as VM::run() on each engine (see test/CMakeLists.txt).
+//
+// USAGE: cpulm_aot_check write <workload> <output.po>
+//        cpulm_aot_check compare <input.po> <executable>
+//
+// `write` writes the ROM of a workload: fib, sum, alu or tick. `compare` runs
+// the ROM both ways and compares the pc, the registers, the flags and the
+// RAM words up to COMPARED_WORDS, except the words of the time device.
+
+#include "mapped_file.hpp"
+#include "time_device.h"
+#include "vm.hpp"
+#include "workloads.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+static constexpr addr_t COMPARED_WORDS = 0x9000;
+
+[[noreturn]] static void error(const std::string& msg) {
+    std::fprintf(stderr, "\x1b[1;31mERROR:\x1b[0m %s\n", msg.c_str());
+    std::exit(EXIT_FAILURE);
+}
+
+/// Stores the result of each ALU operation and shift, both ways around, from
+/// the address 0x100, and ends with the flags of a subtraction that borrows.
+static std::vector<std::uint32_t> make_alu_workload() {
+    using B = ProgramBuilder;
+    B b;
+    b.loadi(2, B::R0, 0x1234, true);
+    b.loadi(2, 2, 0x8765, false);
+    b.loadi(3, B::R0, 7);
+    b.loadi(4, B::R0, 0x100);
+    for (alucode_t alucode : { BF_and, BF_or, BF_nor, BF_xor, BF_add, BF_sub, BF_mul, BF_div }) {
+        b.alu(alucode, 5, 2, 3);
+        b.store(4, 5);
+        b.inc(4);
+        b.alu(alucode, 5, 3, 2);
+        b.store(4, 5);
+        b.inc(4);
+    }
+    for (opcode_t opcode : { OP_lsl, OP_asr, OP_lsr }) {
+        b.shift(opcode, 5, 2, 3);
+        b.store(4, 5);
+        b.inc(4);
+    }
+    b.alu(BF_sub, 5, 3, 2);
+    b.halt();
+    return b.finish();
+}
+
+/// Spins until the host clock ticks the time device, which it only does if
+/// the clock is checked while the program runs, then halts.
+static std::vector<std::uint32_t> make_tick_workload() {
+    using B = ProgramBuilder;
+    B b;
+    const auto wait = b.new_label();
+    b.loadi(2, B::R0, TIME_DEVICE_TICK);
+    b.bind(wait);
+    b.load(3, 2);
+    b.test(3);
+    b.jmpic(wait, SELECT_Z);
+    b.halt();
+    return b.finish();
+}
+
+static int write_workload(const char* workload, const char* filename) {
+    std::vector<std::uint32_t> rom;
+    if (std::strcmp(workload, "fib") == 0)
+        rom = make_fib_workload(20);
+    else if (std::strcmp(workload, "sum") == 0)
+        rom = make_sum_workload(1000, 3);
+    else if (std::strcmp(workload, "alu") == 0)
+        rom = make_alu_workload();
+    else if (std::strcmp(workload, "tick") == 0)
+        rom = make_tick_workload();
+    else
+        error(std::string("unknown workload '") + workload + "'");
+
+    std::FILE* file = std::fopen(filename, "wb");
+    if (file == nullptr || std::fwrite(rom.data(), sizeof(std::uint32_t), rom.size(), file) != rom.size())
+        error(std::string("failed to write file '") + filename + "'");
+    std::fclose(file);
+    return EXIT_SUCCESS;
+}
+
+/// The final state printed by a generated executable: the pc, the registers
+/// (r0 to r31), the flags, then the RAM words.
+struct AotState {
+    std::map<std::string, word_t> values;
+    std::vector<word_t> ram;
+};
+
+static AotState run_executable(const char* executable) {
+    const std::string command = std::string("'") + executable + "' --no-screen --regs --dump-ram 0 " + std::to_string(COMPARED_WORDS);
+    std::FILE* output = popen(command.c_str(), "r");
+    if (output == nullptr)
+        error(std::string("failed to run '") + executable + "'");
+
+    AotState state;
+    char line[256];
+    while (std::fgets(line, sizeof(line), output) != nullptr) {
+        char name[64];
+        unsigned long addr, value;
+        if (std::sscanf(line, "[%lx] = %lx", &addr, &value) == 2)
+            state.ram.push_back(word_t(value));
+        else if (std::sscanf(line, "%63s = %lx", name, &value) == 2)
+            state.values[name] = word_t(value);
+    }
+
+    if (pclose(output) != 0)
+        error(std::string("'") + executable + "' failed");
+    if (state.ram.size() != COMPARED_WORDS)
+        error(std::string("'") + executable + "' did not dump the RAM");
+    return state;
+}
+
+static std::size_t compare(const char* name, const AotState& state, const char* key, word_t expected) {
+    const auto it = state.values.find(key);
+    if (it != state.values.end() && it->second == expected)
+        return 0;
+
+    std::fprintf(stderr, "%s: %s = %#x, VM::run() gives %#x\n", name, key, it != state.values.end() ? it->second : 0, expected);
+    return 1;
+}
+
+static int compare_with_vm(const char* rom_filename, const char* executable) {
+    MappedFile rom;
+    if (const char* failure = rom.open(rom_filename, false))
+        error(std::string("failed to read file '") + rom_filename + "'; " + failure);
+
+    const AotState state = run_executable(executable);
+    std::size_t mismatches = 0;
+    for (ExecutionEngine engine : { ExecutionEngine::INTERPRETER, ExecutionEngine::BASIC_BLOCKS, ExecutionEngine::JIT }) {
+        VM vm(std::vector<std::uint32_t>(rom.data(), rom.data() + rom.size()), {}, false);
+        vm.set_engine(engine);
+        if (vm.run() != StopReason::HALTED)
+            error("the program did not halt");
+
+        const char* name = engine == ExecutionEngine::INTERPRETER ? "interpreter" : engine == ExecutionEngine::BASIC_BLOCKS ? "block" : "jit";
+        mismatches += compare(name, state, "pc", word_t(vm.get_pc()));
+        for (reg_index_t reg = 0; reg < MachineCodeInfo::REG_COUNT; ++reg)
+            mismatches += compare(name, state, ("r" + std::to_string(reg)).c_str(), vm.get_reg(reg));
+        mismatches += compare(name, state, "flags", vm.get_flags());
+
+        std::vector<word_t> ram(COMPARED_WORDS);
+        vm.read_ram(0, ram);
+        for (addr_t addr = 0; addr < COMPARED_WORDS; ++addr) {
+            // The host clock may tick during one of the runs only.
+            if (VM::is_time_device_address(addr) || ram[addr] == state.ram[addr])
+                continue;
+            std::fprintf(stderr, "%s: [%#x] = %#x, VM::run() gives %#x\n", name, addr, state.ram[addr], ram[addr]);
+            ++mismatches;
+        }
+    }
+
+    if (mismatches != 0) {
+        std::fprintf(stderr, "%zu mismatches\n", mismatches);
+        return EXIT_FAILURE;
+    }
+
+    std::printf("OK     %s\n", rom_filename);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc == 4 && std::strcmp(argv[1], "write") == 0)
+        return write_workload(argv[2], argv[3]);
+    if (argc == 4 && std::strcmp(argv[1], "compare") == 0)
+        return compare_with_vm(argv[2], argv[3]);
+
+    std::printf("USAGE: %s write <workload> <output.po>\n", argv[0]);
+    std::printf("       %s compare <input.po> <executable>\n", argv[0]);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,94 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "test.hpp"
+#include "vm_state.hpp"
+#include "workloads.hpp"
+
+static constexpr std::size_t COMPARED_WORDS = 0x9000;
+static constexpr ExecutionEngine ENGINES[] = { ExecutionEngine::INTERPRETER, ExecutionEngine::BASIC_BLOCKS, ExecutionEngine::JIT };
+
+TEST(budget, exact_on_each_engine) {
+    const std::vector<std::uint32_t> code = make_fib_workload(12);
+    for (ExecutionEngine engine : ENGINES) {
+        VM vm(code, {}, false);
+        vm.set_engine(engine);
+        VM reference(code, {}, false);
+        // Stops within the blocks, and in the hot blocks of the JIT.
+        for (std::uint64_t budget : { 1, 1, 2, 3, 5, 7, 11, 100, 1000, 4321 }) {
+            CHECK_EQ(vm.run(budget), StopReason::BUDGET_EXHAUSTED);
+            for (std::uint64_t i = 0; i < budget; ++i)
+                CHECK_EQ(reference.step(), StopReason::BUDGET_EXHAUSTED);
+            check_same_state(vm, reference, COMPARED_WORDS);
+        }
+
+        CHECK_EQ(vm.run(), StopReason::HALTED);
+        while (reference.step() == StopReason::BUDGET_EXHAUSTED)
+            ;
+        check_same_state(vm, reference, COMPARED_WORDS);
+
+        // A halted program stays halted.
+        CHECK_EQ(vm.run(10), StopReason::HALTED);
+        CHECK_EQ(vm.get_instruction_count(), reference.get_instruction_count());
+    }
+}
+
+TEST(budget, zero) {
+    VM vm(make_sum_workload(10, 1), {}, false);
+    CHECK_EQ(vm.run(0), StopReason::BUDGET_EXHAUSTED);
+    CHECK_EQ(vm.get_instruction_count(), 0u);
+    CHECK_EQ(vm.get_pc(), 0u);
+}
+
+TEST(budget, stop_reasons) {
+    using B = ProgramBuilder;
+    for (ExecutionEngine engine : ENGINES) {
+        // A break is not executed, nor counted.
+        B b;
+        b.inc(2);
+        b.brk();
+        b.inc(2);
+        b.loadi(3, B::R0, 0x1000);
+        b.jmp(3);
+        VM vm(b.finish(), {}, false);
+        vm.set_engine(engine);
+        CHECK_EQ(vm.run(), StopReason::BREAKPOINT);
+        CHECK_EQ(vm.get_instruction_count(), 1u);
+        CHECK_EQ(vm.get_reg(2), 1u);
+
+        // Jumping outside of the program is an error, the jump is counted.
+        CHECK_EQ(vm.run(), StopReason::ERROR);
+        CHECK(vm.get_error() != nullptr);
+        CHECK_EQ(vm.get_instruction_count(), 4u);
+        CHECK_EQ(vm.get_reg(2), 2u);
+
+        // A watchpoint stops after the store.
+        B w;
+        w.loadi(3, B::R0, 0x100);
+        w.store(3, B::R1);
+        w.inc(2);
+        w.halt();
+        VM watched(w.finish(), {}, false);
+        watched.set_engine(engine);
+        watched.add_watchpoint(0x100);
+        CHECK_EQ(watched.run(), StopReason::WATCHPOINT);
+        CHECK_EQ(watched.get_instruction_count(), 2u);
+        CHECK_EQ(watched.get_reg(2), 0u);
+        CHECK_EQ(watched.run(), StopReason::HALTED);
+
+        // And so does a store to a device, when asked.
+        B d;
+        d.loadi(3, B::R0, VM::TIME_DEVICE_BEGIN + 5);
+        d.store(3, B::R1);
+        d.inc(2);
+        d.halt();
+        VM device(d.finish(), {}, false);
+        device.set_engine(engine);
+        device.set_stop_on_device_write(true);
+        CHECK_EQ(device.run(), StopReason::DEVICE_WRITE);
+        CHECK_EQ(device.get_instruction_count(), 2u);
+        CHECK_EQ(device.run(), StopReason::HALTED);
+        CHECK_EQ(device.get_reg(2), 1u);
+    }
+}
@@ -0,0 +1,119 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "test.hpp"
+#include "vm.hpp"
+#include "workloads.hpp"
+
+#include <cstdio>
+#include <string>
+
+/// A word of the page of the time device, but not of the device itself.
+static constexpr addr_t DEVICE_PAGE_ADDR = 1100;
+static constexpr addr_t RAM_ADDR = 0x2000;
+
+/// Stores r20 to RAM_ADDR and DEVICE_PAGE_ADDR, then breaks, forever.
+static std::vector<std::uint32_t> make_store_program() {
+    using B = ProgramBuilder;
+    B b;
+    const auto loop = b.new_label();
+    b.bind(loop);
+    b.loadi(2, B::R0, RAM_ADDR);
+    b.store(2, 20);
+    b.loadi(2, B::R0, DEVICE_PAGE_ADDR);
+    b.store(2, 20);
+    b.brk();
+    b.jmpi(loop);
+    return b.finish();
+}
+
+static word_t read_word(const VM& vm, addr_t addr) {
+    word_t word = 0;
+    vm.read_ram(addr, std::span<word_t>(&word, 1));
+    return word;
+}
+
+/// Sets r20 to @a value then runs the program to its break.
+static void store_value(VM& vm, reg_t value) {
+    vm.set_reg(20, value);
+    CHECK_EQ(vm.run(), StopReason::BREAKPOINT);
+    CHECK_EQ(read_word(vm, RAM_ADDR), value);
+    CHECK_EQ(read_word(vm, DEVICE_PAGE_ADDR), value);
+}
+
+TEST(clone, isolation) {
+    std::vector<std::uint32_t> ram(0x3001);
+    ram[0x3000] = 77;
+    VM vm(make_store_program(), ram, false);
+    store_value(vm, 5);
+
+    auto first = vm.clone();
+    CHECK(first != nullptr);
+    CHECK_EQ(read_word(*first, RAM_ADDR), 5u);
+    CHECK_EQ(read_word(*first, DEVICE_PAGE_ADDR), 5u);
+    store_value(*first, 9);
+    CHECK_EQ(read_word(vm, RAM_ADDR), 5u);
+    CHECK_EQ(read_word(vm, DEVICE_PAGE_ADDR), 5u);
+
+    store_value(vm, 7);
+    CHECK_EQ(read_word(*first, RAM_ADDR), 9u);
+    CHECK_EQ(read_word(*first, DEVICE_PAGE_ADDR), 9u);
+
+    // A clone of a clone, on two frozen layers.
+    auto second = first->clone();
+    CHECK_EQ(read_word(*second, RAM_ADDR), 9u);
+    store_value(*second, 11);
+    CHECK_EQ(read_word(*first, RAM_ADDR), 9u);
+    CHECK_EQ(read_word(*first, DEVICE_PAGE_ADDR), 9u);
+    CHECK_EQ(read_word(vm, RAM_ADDR), 7u);
+
+    // The pages that none of them wrote are still shared.
+    for (const VM* instance : { &vm, first.get(), second.get() })
+        CHECK_EQ(read_word(*instance, 0x3000), 77u);
+}
+
+TEST(clone, after_host_write) {
+    VM vm(make_store_program(), {}, false);
+    store_value(vm, 5);
+    auto first = vm.clone();
+
+    // Loaded by the host without executing anything.
+    const std::string filename = std::string(P_tmpdir) + "/cpulm_tests_clone.do";
+    const std::uint32_t image[] = { 0, 42 };
+    std::FILE* file = std::fopen(filename.c_str(), "wb");
+    CHECK(file != nullptr);
+    std::fwrite(image, sizeof(image[0]), 2, file);
+    std::fclose(file);
+    CHECK(vm.load_ram_file(filename.c_str()) == nullptr);
+    std::remove(filename.c_str());
+
+    auto second = vm.clone();
+    CHECK_EQ(read_word(vm, 1), 42u);
+    CHECK_EQ(read_word(*second, 1), 42u);
+    CHECK_EQ(read_word(*second, RAM_ADDR), 5u);
+    CHECK_EQ(read_word(*first, 1), 0u);
+}
+
+TEST(clone, shared_breakpoints) {
+    // The outer loop of the workload starts at 1, once per iteration.
+    VM vm(make_sum_workload(4, 2), {}, false);
+    CHECK(vm.add_breakpoint(1));
+    auto first = vm.clone();
+    auto second = vm.clone();
+
+    first->remove_breakpoint(1);
+    CHECK_EQ(first->run(), StopReason::HALTED);
+    CHECK_EQ(second->run(), StopReason::BREAKPOINT);
+    CHECK_EQ(second->get_instruction_count(), 1u);
+    CHECK_EQ(vm.run(), StopReason::BREAKPOINT);
+    CHECK_EQ(vm.get_instruction_count(), 1u);
+
+    // A breakpoint set by a clone is its own. The breakpoint reached is
+    // disabled.
+    CHECK(second->add_breakpoint(2));
+    CHECK_EQ(second->run(), StopReason::BREAKPOINT);
+    CHECK_EQ(second->get_pc(), 2u);
+    CHECK_EQ(vm.run(), StopReason::HALTED);
+    CHECK_EQ(vm.get_reg(VM::REG_OUT), first->get_reg(VM::REG_OUT));
+}
@@ -0,0 +1,70 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "test.hpp"
+#include "vm.hpp"
+#include "workloads.hpp"
+
+#include <cstdio>
+#include <string>
+
+static constexpr addr_t DEVICE_ADDR = 0x3000;
+
+/// A device that stores one more than the word written, and remembers its
+/// word when restored.
+struct IncrementDevice {
+    std::size_t write_count = 0;
+    std::size_t restore_count = 0;
+    word_t restored = 0;
+
+    MmioDevice map() {
+        MmioDevice device;
+        device.begin = device.end = DEVICE_ADDR;
+        device.write = [](void* context, RamRef ram, addr_t addr, word_t word) {
+            ++static_cast<IncrementDevice*>(context)->write_count;
+            ram.set(addr, word + 1);
+        };
+        device.restore = [](void* context, RamRef ram) {
+            auto* self = static_cast<IncrementDevice*>(context);
+            ++self->restore_count;
+            self->restored = ram.get(DEVICE_ADDR);
+        };
+        device.context = this;
+        return device;
+    }
+};
+
+/// Stores 42 to the device.
+static std::vector<std::uint32_t> make_device_program() {
+    using B = ProgramBuilder;
+    B b;
+    b.loadi(2, B::R0, DEVICE_ADDR);
+    b.loadi(3, B::R0, 42);
+    b.store(2, 3);
+    b.halt();
+    return b.finish();
+}
+
+TEST(devices, snapshot_restores_raw_words) {
+    const std::string filename = std::string(P_tmpdir) + "/cpulm_tests_devices.snap";
+    {
+        IncrementDevice device;
+        VM vm(make_device_program(), {}, false);
+        CHECK(vm.map_device(device.map()));
+        CHECK_EQ(vm.run(), StopReason::HALTED);
+        CHECK_EQ(device.write_count, 1u);
+        CHECK(vm.save_snapshot(filename.c_str()) == nullptr);
+    }
+
+    IncrementDevice device;
+    VM vm(make_device_program(), {}, false);
+    CHECK(vm.map_device(device.map()));
+    CHECK(vm.load_snapshot(filename.c_str()) == nullptr);
+    std::remove(filename.c_str());
+
+    // The word stored by the device, not stored again through it.
+    CHECK_EQ(device.write_count, 0u);
+    CHECK_EQ(device.restore_count, 1u);
+    CHECK_EQ(device.restored, 43u);
+}
@@ -0,0 +1,86 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "test.hpp"
+#include "vm_state.hpp"
+#include "workloads.hpp"
+
+static constexpr std::size_t COMPARED_WORDS = 0x9000;
+
+/// Each superinstruction of superinstructions.def, in a loop.
+static std::vector<std::uint32_t> make_idioms_program() {
+    using B = ProgramBuilder;
+    B b;
+    const auto loop = b.new_label();
+    const auto next = b.new_label();
+    const auto done = b.new_label();
+
+    b.loadi(21, B::R0, 50);
+    b.loadi(6, done);
+    b.bind(loop);
+    // loadi_loadi
+    b.loadi(3, B::R0, 0x1234, true);
+    b.loadi(3, 3, 0x5678, false);
+    b.alu(BF_add, B::ROUT, B::ROUT, 3);
+    // sub_jmpc
+    b.alu(BF_sub, 2, 21, B::R1);
+    b.jmpc(6, SELECT_Z);
+    // sub_jmpic
+    b.alu(BF_sub, 2, 21, 22);
+    b.jmpic(next, SELECT_N);
+    // add_jmpi
+    b.inc(22);
+    b.jmpi(next);
+    b.bind(next);
+    // sub_jmpi
+    b.dec(21);
+    b.jmpi(loop);
+    b.bind(done);
+    b.halt();
+    return b.finish();
+}
+
+/// Runs @a code to its end with run() on each engine, fused, and checks the
+/// result against a run one instruction at a time, which never fuses.
+static void check_fused_run(const std::vector<std::uint32_t>& code, const std::vector<std::uint32_t>& ram) {
+    VM unfused(code, ram, false);
+    StopReason reason;
+    while ((reason = unfused.step()) == StopReason::BUDGET_EXHAUSTED)
+        ;
+    CHECK_EQ(reason, StopReason::HALTED);
+
+    for (ExecutionEngine engine : { ExecutionEngine::INTERPRETER, ExecutionEngine::BASIC_BLOCKS, ExecutionEngine::JIT }) {
+        VM fused(code, ram, false);
+        fused.set_engine(engine);
+        CHECK_EQ(fused.run(), StopReason::HALTED);
+        check_same_state(fused, unfused, COMPARED_WORDS);
+    }
+}
+
+TEST(fusion, same_results) {
+    check_fused_run(make_idioms_program(), {});
+    check_fused_run(make_fib_workload(12), {});
+    check_fused_run(make_sum_workload(100, 3), {});
+    check_fused_run(make_collatz_workload(30), { 27 });
+}
+
+TEST(fusion, breakpoint_within_pair) {
+    // The jmpc of sub_jmpc, at 5.
+    const std::vector<std::uint32_t> code = make_idioms_program();
+    VM unfused(code, {}, false);
+    while (unfused.get_pc() != 5)
+        CHECK_EQ(unfused.step(), StopReason::BUDGET_EXHAUSTED);
+
+    VM fused(code, {}, false);
+    CHECK(fused.add_breakpoint(5));
+    CHECK_EQ(fused.run(), StopReason::BREAKPOINT);
+    check_same_state(fused, unfused, COMPARED_WORDS);
+
+    // Removing it fuses the pair again.
+    fused.remove_breakpoint(5);
+    CHECK_EQ(fused.run(), StopReason::HALTED);
+    while (unfused.step() == StopReason::BUDGET_EXHAUSTED)
+        ;
+    check_same_state(fused, unfused, COMPARED_WORDS);
+}
@@ -0,0 +1,96 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "history.hpp"
+#include "test.hpp"
+#include "vm.hpp"
+#include "workloads.hpp"
+
+/// Counts in r2 the instructions executed around a break of the ROM.
+static std::vector<std::uint32_t> make_break_program() {
+    using B = ProgramBuilder;
+    B b;
+    b.loadi(2, B::R0, 1);
+    b.inc(2);
+    b.brk();
+    b.inc(2); // pc = 3
+    b.inc(2);
+    b.halt();
+    return b.finish();
+}
+
+TEST(history, step_back_across_break) {
+    VM vm(make_break_program(), {}, false);
+    CHECK(vm.enable_history(std::size_t(1) << 20) == nullptr);
+
+    CHECK_EQ(vm.run(), StopReason::BREAKPOINT);
+    CHECK_EQ(vm.get_instruction_count(), 2u);
+    CHECK_EQ(vm.run(), StopReason::HALTED);
+    CHECK_EQ(vm.get_instruction_count(), 7u);
+    CHECK_EQ(vm.get_reg(2), 4u);
+
+    // Replays from the first checkpoint, over the break.
+    CHECK_EQ(vm.step_back(3), 3u);
+    CHECK_EQ(vm.get_instruction_count(), 4u);
+    CHECK_EQ(vm.get_pc(), 5u);
+    CHECK_EQ(vm.get_reg(2), 4u);
+
+    CHECK_EQ(vm.step_back(3), 3u);
+    CHECK_EQ(vm.get_instruction_count(), 1u);
+    CHECK_EQ(vm.get_reg(2), 1u);
+
+    CHECK_EQ(vm.run(), StopReason::BREAKPOINT);
+    CHECK_EQ(vm.get_instruction_count(), 2u);
+    CHECK_EQ(vm.run(), StopReason::HALTED);
+    CHECK_EQ(vm.get_instruction_count(), 7u);
+    CHECK_EQ(vm.get_reg(2), 4u);
+}
+
+TEST(history, reverse_continue_across_break) {
+    VM vm(make_break_program(), {}, false);
+    CHECK(vm.enable_history(std::size_t(1) << 20) == nullptr);
+    CHECK(vm.add_breakpoint(4));
+
+    CHECK_EQ(vm.run(), StopReason::BREAKPOINT);
+    CHECK_EQ(vm.run(), StopReason::BREAKPOINT);
+    CHECK_EQ(vm.get_instruction_count(), 3u);
+    CHECK_EQ(vm.run(), StopReason::HALTED);
+
+    CHECK(vm.reverse_continue());
+    CHECK_EQ(vm.get_instruction_count(), 3u);
+    CHECK_EQ(vm.get_pc(), 4u);
+    CHECK_EQ(vm.get_reg(2), 3u);
+
+    // Nothing reached the breakpoint before.
+    CHECK(!vm.reverse_continue());
+    CHECK_EQ(vm.get_instruction_count(), 0u);
+    CHECK_EQ(vm.get_pc(), 0u);
+}
+
+TEST(history, step_back_exact_count) {
+    VM vm(make_fib_workload(18), {}, false);
+    CHECK(vm.enable_history(std::size_t(1) << 24) == nullptr);
+    CHECK_EQ(vm.run(), StopReason::HALTED);
+    const std::uint64_t end = vm.get_instruction_count();
+    const reg_t result = vm.get_reg(VM::REG_OUT);
+
+    // Lands on the exact count, on and between the checkpoints.
+    constexpr std::uint64_t interval = ExecutionHistory::CHECKPOINT_INTERVAL;
+    for (std::uint64_t target : { end - 1, end - interval - 3, end / 2, 2 * interval + 5, std::uint64_t(1) }) {
+        VM reference(make_fib_workload(18), {}, false);
+        CHECK_EQ(reference.run(target), StopReason::BUDGET_EXHAUSTED);
+
+        const std::uint64_t count = vm.get_instruction_count() - target;
+        CHECK_EQ(vm.step_back(count), count);
+        CHECK_EQ(vm.get_instruction_count(), target);
+        CHECK_EQ(vm.get_pc(), reference.get_pc());
+        CHECK_EQ(vm.get_flags(), reference.get_flags());
+        for (reg_index_t reg = 0; reg < MachineCodeInfo::REG_COUNT; ++reg)
+            CHECK_EQ(vm.get_reg(reg), reference.get_reg(reg));
+    }
+
+    CHECK_EQ(vm.run(), StopReason::HALTED);
+    CHECK_EQ(vm.get_instruction_count(), end);
+    CHECK_EQ(vm.get_reg(VM::REG_OUT), result);
+}
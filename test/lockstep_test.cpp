@@ -0,0 +1,71 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "lockstep.hpp"
+#include "test.hpp"
+#include "workloads.hpp"
+
+/// Counts down from the word at address 0 in r3. The odd values are summed
+/// in r6 and the even ones xored in r7, a lane breaks when it reaches 6.
+/// The sum is then moved to the output register.
+static std::shared_ptr<const Program> make_branch_program() {
+    using B = ProgramBuilder;
+    B b;
+    const auto loop = b.new_label();
+    const auto even = b.new_label();
+    const auto next = b.new_label();
+    const auto stop = b.new_label();
+    const auto done = b.new_label();
+    b.load(3, B::R0);
+    b.loadi(5, B::R0, 6);
+    b.bind(loop);
+    b.test(3);
+    b.jmpic(done, SELECT_Z);
+    b.alu(BF_and, 4, 3, B::R1);
+    b.jmpic(even, SELECT_Z);
+    b.alu(BF_add, 6, 6, 3);
+    b.jmpi(next);
+    b.bind(even);
+    b.alu(BF_xor, 7, 7, 3);
+    b.alu(BF_sub, B::R0, 3, 5);
+    b.jmpic(stop, SELECT_Z);
+    b.bind(next);
+    b.dec(3);
+    b.jmpi(loop);
+    b.bind(stop);
+    b.brk();
+    b.bind(done);
+    b.mov(B::ROUT, 6);
+    b.halt();
+    return std::make_shared<const Program>(b.finish());
+}
+
+TEST(lockstep, divergent_lanes_match_vm) {
+    const auto program = make_branch_program();
+    const std::uint32_t counts[] = { 0, 1, 2, 5, 6, 9, 4, 13 };
+    std::vector<std::vector<std::uint32_t>> rams;
+    for (const std::uint32_t count : counts)
+        rams.push_back({ count });
+
+    LockstepVM<8> lockstep(program, rams);
+    CHECK_EQ(lockstep.run(), StopReason::HALTED);
+
+    std::uint64_t instruction_count = 0;
+    for (std::size_t lane = 0; lane < rams.size(); ++lane) {
+        VM vm(program, rams[lane], false);
+        const StopReason reason = vm.run();
+        CHECK_EQ(lockstep.get_lane_reason(lane), reason);
+        CHECK_EQ(lockstep.get_pc(lane), vm.get_pc());
+        CHECK_EQ(lockstep.get_instruction_count(lane), vm.get_instruction_count());
+        for (reg_index_t reg = 0; reg < MachineCodeInfo::REG_COUNT; ++reg)
+            CHECK_EQ(lockstep.get_reg(lane, reg), vm.get_reg(reg));
+        instruction_count += lockstep.get_instruction_count(lane);
+    }
+
+    // Both kinds of lanes, and divergent ones.
+    CHECK_EQ(lockstep.get_lane_reason(0), StopReason::HALTED);
+    CHECK_EQ(lockstep.get_lane_reason(4), StopReason::BREAKPOINT);
+    CHECK(lockstep.get_step_count() < instruction_count);
+    CHECK(lockstep.get_step_count() > lockstep.get_instruction_count(7));
+}
@@ -0,0 +1,95 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "machine.hpp"
+#include "test.hpp"
+#include "time_device.h"
+#include "workloads.hpp"
+
+/// Loops @a iterations times on each hart. The hart 0 counts the ticks of
+/// the time device in r6, clearing the tick after each one.
+static std::shared_ptr<const Program> make_tick_program(std::uint16_t iterations) {
+    using B = ProgramBuilder;
+    B b;
+    const auto spin = b.new_label();
+    const auto loop = b.new_label();
+    const auto done = b.new_label();
+    b.loadi(20, B::R0, iterations);
+    b.loadi(21, B::R0, TIME_DEVICE_TICK);
+    b.test(VM::REG_HART_ID);
+    b.jmpic(loop, SELECT_Z);
+    b.bind(spin);
+    b.test(20);
+    b.jmpic(done, SELECT_Z);
+    b.dec(20);
+    b.jmpi(spin);
+    b.bind(loop);
+    b.test(20);
+    b.jmpic(done, SELECT_Z);
+    b.dec(20);
+    b.load(5, 21);
+    b.test(5);
+    b.jmpic(loop, SELECT_Z);
+    b.inc(6);
+    b.store(21, B::R0);
+    b.jmpi(loop);
+    b.bind(done);
+    b.halt();
+    return std::make_shared<const Program>(b.finish());
+}
+
+/// Requests the calendar then loads its seconds in r3 and its minutes in r4.
+static std::shared_ptr<const Program> make_calendar_program() {
+    using B = ProgramBuilder;
+    B b;
+    b.loadi(2, B::R0, TIME_DEVICE_SYNC);
+    b.store(2, B::R1);
+    b.loadi(2, B::R0, 1027);
+    b.load(3, 2);
+    b.loadi(2, B::R0, 1028);
+    b.load(4, 2);
+    b.halt();
+    return std::make_shared<const Program>(b.finish());
+}
+
+TEST(machine, round_robin_ticks) {
+    constexpr std::uint64_t instructions_per_second = 50;
+    std::uint64_t previous_ticks = 0;
+    for (int run = 0; run < 2; ++run) {
+        Machine machine(make_tick_program(500), {}, 2, HartScheduling::ROUND_ROBIN);
+        machine.set_quantum(7);
+        machine.set_virtual_clock(instructions_per_second);
+        machine.run();
+        CHECK_EQ(machine.get_result(0), StopReason::HALTED);
+        CHECK_EQ(machine.get_result(1), StopReason::HALTED);
+
+        // One tick every 50 instructions of both harts, the last one may not
+        // have been seen.
+        const std::uint64_t ticks = machine.get_hart(0).get_reg(6) + ram_get(machine.get_ram(), TIME_DEVICE_TICK);
+        CHECK_EQ(ticks, machine.get_instruction_count() / instructions_per_second);
+        CHECK(ticks > 0);
+        // And at the same instructions on each run.
+        if (run > 0)
+            CHECK_EQ(machine.get_hart(0).get_reg(6), previous_ticks);
+        previous_ticks = machine.get_hart(0).get_reg(6);
+    }
+}
+
+TEST(machine, round_robin_calendar) {
+    Machine machine(make_calendar_program(), {}, 2, HartScheduling::ROUND_ROBIN);
+    // The hart 0 runs to its end before the hart 1 starts.
+    machine.set_quantum(1000);
+    machine.set_virtual_clock(1);
+    machine.run();
+    CHECK_EQ(machine.get_result(0), StopReason::HALTED);
+    CHECK_EQ(machine.get_result(1), StopReason::HALTED);
+
+    // The calendar reads one second per instruction of both harts, up to
+    // the store that requested it.
+    CHECK_EQ(machine.get_hart(0).get_reg(3), 2u);
+    CHECK_EQ(machine.get_hart(0).get_reg(4), 0u);
+    const std::uint64_t seconds = machine.get_hart(0).get_instruction_count() + 2;
+    CHECK_EQ(machine.get_hart(1).get_reg(3), seconds % 60);
+    CHECK_EQ(machine.get_hart(1).get_reg(4), seconds / 60 % 60);
+}
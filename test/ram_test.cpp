@@ -0,0 +1,177 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "flat_ram.hpp"
+#include "mmio.hpp"
+#include "test.hpp"
+
+#include <cstring>
+
+/// A RAM whose words hold their own address plus one.
+static std::vector<word_t> make_words(std::size_t count) {
+    std::vector<word_t> words(count);
+    for (std::size_t i = 0; i < count; ++i)
+        words[i] = word_t(i + 1);
+    return words;
+}
+
+/// Checks copy_words() against memmove() on a vector.
+static void check_copy_words(addr_t destination, addr_t source, std::size_t count) {
+    std::vector<word_t> words = make_words(4 * FlatRam::PAGE_WORDS);
+    std::vector<word_t> expected = words;
+    std::memmove(expected.data() + destination, expected.data() + source, count * sizeof(word_t));
+
+    copy_words(
+        destination, source, count,
+        [&](addr_t addr, std::span<word_t> span) { std::copy_n(words.begin() + addr, span.size(), span.begin()); },
+        [&](addr_t addr, std::span<const word_t> span) { std::copy(span.begin(), span.end(), words.begin() + addr); });
+    CHECK(words == expected);
+}
+
+TEST(ram, copy_words_overlap) {
+    constexpr addr_t page = FlatRam::PAGE_WORDS;
+    // Forward, the destination before the source.
+    check_copy_words(page - 100, page + 10, 2 * page + 50);
+    check_copy_words(10, 11, 3 * page);
+    // Backward, the destination after the source.
+    check_copy_words(page + 10, page - 100, 2 * page + 50);
+    check_copy_words(11, 10, 3 * page);
+    // Disjoint and empty ranges.
+    check_copy_words(3 * page, 0, page);
+    check_copy_words(0, 2 * page + 3, page + 7);
+    check_copy_words(5, 5, page);
+    check_copy_words(5, 7, 0);
+}
+
+TEST(ram, flat_range_accesses) {
+    ram_t* sparse = ram_create();
+    {
+        FlatRam ram(sparse, false);
+        constexpr addr_t page = FlatRam::PAGE_WORDS;
+
+        // Zeroes never allocate a page.
+        const std::vector<word_t> zeroes(3 * page);
+        ram.write_range(page, zeroes);
+        ram.fill(0, 0, 4 * page);
+        CHECK_EQ(ram.get_page_count(), 0u);
+
+        const std::vector<word_t> words = make_words(2 * page + 20);
+        ram.write_range(page - 10, words);
+        std::vector<word_t> read(words.size());
+        ram.read_range(page - 10, read);
+        CHECK(read == words);
+        for (std::size_t i = 0; i < words.size(); ++i)
+            CHECK_EQ(ram.get(addr_t(page - 10 + i)), words[i]);
+
+        // Overlapping copies across the pages, both ways.
+        std::vector<word_t> expected(5 * page);
+        std::copy(words.begin(), words.end(), expected.begin() + page - 10);
+        ram.copy(page + 5, page - 10, 2 * page);
+        std::memmove(expected.data() + page + 5, expected.data() + page - 10, 2 * page * sizeof(word_t));
+        ram.copy(page - 3, page + 5, 2 * page);
+        std::memmove(expected.data() + page - 3, expected.data() + page + 5, 2 * page * sizeof(word_t));
+        read.resize(expected.size());
+        ram.read_range(0, read);
+        CHECK(read == expected);
+
+        ram.fill(page + 1, 7, page);
+        std::fill_n(expected.begin() + page + 1, page, 7);
+        ram.read_range(0, read);
+        CHECK(read == expected);
+    }
+    ram_destroy(sparse);
+}
+
+TEST(ram, flat_store_after_zero_page) {
+    ram_t* sparse = ram_create();
+    {
+        FlatRam ram(sparse, false);
+        const addr_t addr = 5 * FlatRam::PAGE_WORDS + 3;
+
+        // The loads map the page never written to the zero page in the read
+        // TLB, the store must replace it.
+        CHECK_EQ(ram.get(addr), 0u);
+        CHECK_EQ(ram.get(addr + 1), 0u);
+        ram.set(addr, 42);
+        CHECK_EQ(ram.get(addr), 42u);
+        CHECK_EQ(ram.get(addr + 1), 0u);
+        CHECK_EQ(ram.get_page_count(), 1u);
+    }
+    ram_destroy(sparse);
+}
+
+TEST(ram, nonzero_runs) {
+    const word_t words[] = { 0, 1, 2, 0, 0, 3, 0, 4, 5, 6 };
+    std::vector<std::pair<std::size_t, std::size_t>> runs;
+    for_each_nonzero_run(words, [&](std::size_t offset, std::span<const word_t> run) { runs.emplace_back(offset, run.size()); });
+    CHECK(runs == (std::vector<std::pair<std::size_t, std::size_t>> { { 1, 2 }, { 5, 1 }, { 7, 3 } }));
+}
+
+/// A device that logs the stores to its words, and reads the complement of
+/// their address.
+struct LoggingDevice {
+    std::vector<std::pair<addr_t, word_t>> writes;
+
+    MmioDevice map(addr_t begin, addr_t end) {
+        MmioDevice device;
+        device.begin = begin;
+        device.end = end;
+        device.read = [](void*, RamRef, addr_t addr) { return word_t(~addr); };
+        device.write = [](void* context, RamRef, addr_t addr, word_t word) {
+            static_cast<LoggingDevice*>(context)->writes.emplace_back(addr, word);
+        };
+        device.context = this;
+        return device;
+    }
+};
+
+TEST(ram, mmio_split_range) {
+    ram_t* sparse = ram_create();
+    {
+        FlatRam flat(sparse, false);
+        const RamRef ram { sparse, &flat };
+        LoggingDevice first, second;
+        MmioMap mmio;
+        CHECK(mmio.add(first.map(1500, 1503)));
+        CHECK(mmio.add(second.map(1504, 1504)));
+        // A device without callbacks, whose words are RAM.
+        MmioDevice plain;
+        plain.begin = plain.end = 2000;
+        CHECK(mmio.add(plain));
+
+        // The range starts within the first device and covers the others.
+        const std::vector<word_t> words = make_words(1000);
+        mmio.write_range(ram, 1502, words);
+        CHECK((first.writes == std::vector<std::pair<addr_t, word_t>> { { 1502, 1 }, { 1503, 2 } }));
+        CHECK((second.writes == std::vector<std::pair<addr_t, word_t>> { { 1504, 3 } }));
+        CHECK_EQ(ram.get(1502), 0u);
+        CHECK_EQ(ram.get(1504), 0u);
+        CHECK_EQ(ram.get(1505), 4u);
+        CHECK_EQ(ram.get(2000), 499u);
+        CHECK_EQ(ram.get(2501), 1000u);
+
+        std::vector<word_t> read(1010);
+        mmio.read_range(ram, 1495, read);
+        for (std::size_t i = 0; i < read.size(); ++i) {
+            const addr_t addr = addr_t(1495 + i);
+            if (addr >= 1500 && addr <= 1504)
+                CHECK_EQ(read[i], word_t(~addr));
+            else
+                CHECK_EQ(read[i], addr >= 1505 && addr <= 2501 ? word_t(addr - 1501) : 0u);
+        }
+
+        // A range that ends within the first device.
+        first.writes.clear();
+        mmio.fill(ram, 1400, 9, 101);
+        CHECK((first.writes == std::vector<std::pair<addr_t, word_t>> { { 1500, 9 } }));
+        CHECK_EQ(ram.get(1499), 9u);
+        CHECK_EQ(ram.get(1500), 0u);
+
+        // A range away from the devices.
+        mmio.fill(ram, 3000, 5, 10);
+        CHECK_EQ(ram.get(3009), 5u);
+        CHECK_EQ(second.writes.size(), 1u);
+    }
+    ram_destroy(sparse);
+}
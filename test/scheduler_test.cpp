@@ -0,0 +1,75 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "guest_scheduler.hpp"
+#include "test.hpp"
+#include "workloads.hpp"
+
+#include <memory>
+#include <span>
+
+static constexpr addr_t DEVICE_ADDR = 0x3000;
+static constexpr std::uint16_t STORE_COUNT = 5;
+
+/// A device that counts the words written to it.
+struct CountDevice {
+    std::size_t write_count = 0;
+
+    MmioDevice map(addr_t addr) {
+        MmioDevice device;
+        device.begin = device.end = addr;
+        device.write = [](void* context, RamRef ram, addr_t addr, word_t word) {
+            ++static_cast<CountDevice*>(context)->write_count;
+            ram.set(addr, word);
+        };
+        device.context = this;
+        return device;
+    }
+};
+
+/// Stores STORE_COUNT times to the device at @a addr, counting down in r3.
+static std::vector<std::uint32_t> make_store_program(addr_t addr) {
+    using B = ProgramBuilder;
+    B b;
+    const auto loop = b.new_label();
+    const auto done = b.new_label();
+    b.loadi(2, B::R0, addr);
+    b.loadi(3, B::R0, STORE_COUNT);
+    b.bind(loop);
+    b.test(3);
+    b.jmpic(done, SELECT_Z);
+    b.store(2, 3);
+    b.dec(3);
+    b.jmpi(loop);
+    b.bind(done);
+    b.halt();
+    return b.finish();
+}
+
+TEST(scheduler, yield_on_device_writes) {
+    constexpr std::size_t guest_count = 2;
+    CountDevice devices[guest_count];
+    std::unique_ptr<VM> vms[guest_count];
+    GuestScheduler scheduler(2);
+    for (std::size_t i = 0; i < guest_count; ++i) {
+        const addr_t addr = DEVICE_ADDR + i;
+        vms[i] = std::make_unique<VM>(make_store_program(addr), std::vector<std::uint32_t> {}, false);
+        CHECK(vms[i]->map_device(devices[i].map(addr)));
+        scheduler.spawn(run_guest(*vms[i], 1'000'000));
+    }
+    scheduler.run();
+
+    for (std::size_t i = 0; i < guest_count; ++i) {
+        CHECK_EQ(scheduler.get_result(i), StopReason::HALTED);
+        CHECK_EQ(devices[i].write_count, std::size_t(STORE_COUNT));
+        CHECK_EQ(vms[i]->get_reg(3), 0u);
+        // The last word stored, through the device.
+        word_t word = 0;
+        vms[i]->read_ram(DEVICE_ADDR + i, std::span<word_t>(&word, 1));
+        CHECK_EQ(word, 1u);
+    }
+    // The slice is never exhausted: each guest yields after each of its
+    // stores, then is resumed once more to halt.
+    CHECK_EQ(scheduler.get_resume_count(), guest_count * (STORE_COUNT + 1));
+}
@@ -0,0 +1,130 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#include "test.hpp"
+#include "vm_state.hpp"
+#include "workloads.hpp"
+
+#include <cstdio>
+#include <string>
+
+static constexpr std::size_t IMAGE_WORDS = 6000;
+/// Covers the image and the stack of the fib workload.
+static constexpr std::size_t COMPARED_WORDS = 0x9000;
+
+/// A RAM image with literals, zeroes, runs across pages and runs too short
+/// to be packed as runs.
+static std::vector<std::uint32_t> make_image() {
+    std::vector<std::uint32_t> image(IMAGE_WORDS);
+    for (std::size_t i = 0; i < image.size(); ++i) {
+        if (i < 1000)
+            image[i] = i % 7 == 0 ? 0 : std::uint32_t(i);
+        else if (i < 3000)
+            image[i] = 5;
+        else if (i < 3002)
+            image[i] = 9;
+        else if (i >= 5000)
+            image[i] = std::uint32_t(i / 3);
+    }
+    return image;
+}
+
+static std::string temporary_file(const char* name) {
+    return std::string(P_tmpdir) + "/cpulm_tests_" + name;
+}
+
+static std::vector<char> read_bytes(const std::string& filename) {
+    std::vector<char> bytes;
+    if (std::FILE* file = std::fopen(filename.c_str(), "rb")) {
+        char buffer[4096];
+        std::size_t count;
+        while ((count = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+            bytes.insert(bytes.end(), buffer, buffer + count);
+        std::fclose(file);
+    }
+    return bytes;
+}
+
+TEST(snapshot, round_trip) {
+    const std::string filename = temporary_file("round_trip.snap");
+    const std::string second_filename = temporary_file("round_trip_2.snap");
+    VM vm(make_fib_workload(10), make_image(), false);
+    CHECK_EQ(vm.run(500), StopReason::BUDGET_EXHAUSTED);
+    CHECK(vm.add_breakpoint(5));
+    CHECK(vm.save_snapshot(filename.c_str()) == nullptr);
+
+    VM restored(make_fib_workload(10), {}, false);
+    CHECK(restored.load_snapshot(filename.c_str()) == nullptr);
+    check_same_state(restored, vm, COMPARED_WORDS);
+
+    // Saving again gives the same file, the packing is deterministic.
+    CHECK(restored.save_snapshot(second_filename.c_str()) == nullptr);
+    CHECK(read_bytes(second_filename) == read_bytes(filename));
+    std::remove(filename.c_str());
+    std::remove(second_filename.c_str());
+
+    // The breakpoints are restored too.
+    CHECK_EQ(vm.run(), StopReason::BREAKPOINT);
+    CHECK_EQ(restored.run(), StopReason::BREAKPOINT);
+    check_same_state(restored, vm, COMPARED_WORDS);
+    CHECK_EQ(vm.run(), StopReason::HALTED);
+    CHECK_EQ(restored.run(), StopReason::HALTED);
+    check_same_state(restored, vm, COMPARED_WORDS);
+}
+
+TEST(snapshot, overwrites_written_pages) {
+    const std::string filename = temporary_file("overwrite.snap");
+    VM vm(make_fib_workload(10), make_image(), false);
+    CHECK(vm.save_snapshot(filename.c_str()) == nullptr);
+
+    // Written everywhere, also past the pages of the snapshot.
+    VM restored(make_fib_workload(10), std::vector<std::uint32_t>(3 * IMAGE_WORDS, 0xdead), false);
+    CHECK_EQ(restored.run(1000), StopReason::BUDGET_EXHAUSTED);
+    CHECK(restored.load_snapshot(filename.c_str()) == nullptr);
+    std::remove(filename.c_str());
+    check_same_state(restored, vm, COMPARED_WORDS);
+}
+
+TEST(snapshot, rejects_invalid_files) {
+    const std::string filename = temporary_file("invalid.snap");
+    VM vm(make_fib_workload(10), make_image(), false);
+    CHECK_EQ(vm.run(500), StopReason::BUDGET_EXHAUSTED);
+    CHECK(vm.save_snapshot(filename.c_str()) == nullptr);
+    const std::vector<char> bytes = read_bytes(filename);
+
+    // Another ROM.
+    VM other(make_fib_workload(11), {}, false);
+    CHECK(other.load_snapshot(filename.c_str()) != nullptr);
+
+    // Truncated in the middle of the pages, the VM is left unchanged.
+    VM restored(make_fib_workload(10), make_image(), false);
+    CHECK_EQ(restored.run(100), StopReason::BUDGET_EXHAUSTED);
+    std::FILE* file = std::fopen(filename.c_str(), "wb");
+    CHECK(file != nullptr);
+    std::fwrite(bytes.data(), 1, bytes.size() - 64, file);
+    std::fclose(file);
+    CHECK(restored.load_snapshot(filename.c_str()) != nullptr);
+    std::remove(filename.c_str());
+    CHECK_EQ(restored.get_instruction_count(), 100u);
+
+    VM expected(make_fib_workload(10), make_image(), false);
+    CHECK_EQ(expected.run(100), StopReason::BUDGET_EXHAUSTED);
+    check_same_state(restored, expected, COMPARED_WORDS);
+}
+
+TEST(snapshot, untracked_written_pages) {
+    for (ExecutionEngine engine : { ExecutionEngine::INTERPRETER, ExecutionEngine::BASIC_BLOCKS, ExecutionEngine::JIT }) {
+        VM vm(make_fib_workload(10), {}, false);
+        vm.set_engine(engine);
+        vm.stop_tracking_written_pages();
+        CHECK_EQ(vm.run(), StopReason::HALTED);
+        CHECK_EQ(vm.get_reg(ProgramBuilder::ROUT), 55u);
+
+        // Nothing can tell which pages the stack was written to.
+        const std::string filename = temporary_file("untracked.snap");
+        CHECK(vm.save_snapshot(filename.c_str()) != nullptr);
+        CHECK(vm.load_snapshot(filename.c_str()) != nullptr);
+        CHECK(vm.clone() == nullptr);
+    }
+}
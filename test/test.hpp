@@ -0,0 +1,58 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#ifndef CPULM_TEST_TEST_HPP
+#define CPULM_TEST_TEST_HPP
+
+#include <vector>
+
+/*
+ * A minimal test framework, the tests of the VM only need checks.
+ *
+ * TEST(suite, name) { ... } defines a test case of the suite, registered
+ * before main() runs (see test_main.cpp). A failed CHECK() or CHECK_EQ() is
+ * reported and the test case carries on.
+ */
+
+struct TestCase {
+    const char* suite;
+    const char* name;
+    void (*function)();
+};
+
+/// All the test cases, in the order of their definition in each file.
+std::vector<TestCase>& test_cases();
+
+struct TestRegistration {
+    TestRegistration(const char* suite, const char* name, void (*function)()) {
+        test_cases().push_back({ suite, name, function });
+    }
+};
+
+/// Reports a failed check of the running test case.
+void check_failed(const char* file, int line, const char* condition);
+void check_failed(const char* file, int line, const char* condition, unsigned long long actual, unsigned long long expected);
+
+#define TEST(suite, name)                                                                       \
+    static void suite##_##name();                                                               \
+    static const TestRegistration suite##_##name##_registration(#suite, #name, suite##_##name); \
+    static void suite##_##name()
+
+#define CHECK(condition)                                  \
+    do {                                                  \
+        if (!(condition))                                 \
+            check_failed(__FILE__, __LINE__, #condition); \
+    } while (false)
+
+/// Checks integers, enumerations or pointers, printing both on failure.
+#define CHECK_EQ(actual, expected)                                                         \
+    do {                                                                                   \
+        const auto actual_value = (actual);                                                \
+        const auto expected_value = (expected);                                            \
+        if (!(actual_value == expected_value))                                             \
+            check_failed(__FILE__, __LINE__, #actual " == " #expected,                     \
+                (unsigned long long)(actual_value), (unsigned long long)(expected_value)); \
+    } while (false)
+
+#endif // CPULM_TEST_TEST_HPP
@@ -0,0 +1,68 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+// USAGE: cpulm_tests [suite...]
+//
+// Runs the test cases of the given suites, or all of them. Exits with a
+// failure status if a check failed.
+
+#include "test.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static const TestCase* current_test = nullptr;
+static std::size_t failed_checks = 0;
+
+std::vector<TestCase>& test_cases() {
+    static std::vector<TestCase> cases;
+    return cases;
+}
+
+void check_failed(const char* file, int line, const char* condition) {
+    std::fprintf(stderr, "%s:%d: %s.%s: check failed: %s\n", file, line, current_test->suite, current_test->name, condition);
+    ++failed_checks;
+}
+
+void check_failed(const char* file, int line, const char* condition, unsigned long long actual, unsigned long long expected) {
+    std::fprintf(stderr, "%s:%d: %s.%s: check failed: %s (%#llx != %#llx)\n", file, line, current_test->suite, current_test->name, condition, actual, expected);
+    ++failed_checks;
+}
+
+static bool is_selected(const TestCase& test, int argc, char* argv[]) {
+    if (argc < 2)
+        return true;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(test.suite, argv[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+int main(int argc, char* argv[]) {
+    std::size_t run_count = 0;
+    std::size_t failed_count = 0;
+    for (const TestCase& test : test_cases()) {
+        if (!is_selected(test, argc, argv))
+            continue;
+
+        current_test = &test;
+        const std::size_t previous_failed_checks = failed_checks;
+        test.function();
+        ++run_count;
+        if (failed_checks != previous_failed_checks)
+            ++failed_count;
+        std::printf("%-6s %s.%s\n", failed_checks != previous_failed_checks ? "FAILED" : "OK", test.suite, test.name);
+    }
+
+    if (run_count == 0) {
+        std::fprintf(stderr, "\x1b[1;31mERROR:\x1b[0m no test case to run\n");
+        return EXIT_FAILURE;
+    }
+
+    std::printf("%zu test cases, %zu failed\n", run_count, failed_count);
+    return failed_count == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,26 @@
+// Copyright (c) 2023 Hubert Gruniaux
+// This file is part of asm which is released under the MIT license.
+// See file LICENSE.txt for full license details.
+
+#ifndef CPULM_TEST_VM_STATE_HPP
+#define CPULM_TEST_VM_STATE_HPP
+
+#include "test.hpp"
+#include "vm.hpp"
+
+/// Checks that @a vm is in the state of @a expected: the pc, the flags, the
+/// instruction count, the registers and the @a ram_words first RAM words.
+inline void check_same_state(const VM& vm, const VM& expected, std::size_t ram_words) {
+    CHECK_EQ(vm.get_pc(), expected.get_pc());
+    CHECK_EQ(vm.get_flags(), expected.get_flags());
+    CHECK_EQ(vm.get_instruction_count(), expected.get_instruction_count());
+    for (reg_index_t reg = 0; reg < MachineCodeInfo::REG_COUNT; ++reg)
+        CHECK_EQ(vm.get_reg(reg), expected.get_reg(reg));
+
+    std::vector<word_t> words(ram_words), expected_words(ram_words);
+    vm.read_ram(0, words);
+    expected.read_ram(0, expected_words);
+    CHECK(words == expected_words);
+}
+
+#endif // CPULM_TEST_VM_STATE_HPP